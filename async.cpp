@@ -1,5 +1,7 @@
 #include "async.h"
 #include "util.h"
+#include "metrics.h"
+#include "loopmon.h"
 
 #include <vector>
 #include <mutex>
@@ -45,6 +47,7 @@ public:
         {
             std::unique_lock<std::mutex> l(m_handlerMutex);
             m_handlerList.emplace_back(std::move(handler));
+            metrics::addGauge(metrics::Gauge::ASYNC_QUEUE_DEPTH, 1);
         }
         int retval = uv_async_send(&m_asyncHandle);
         if (retval != 0) {
@@ -82,12 +85,16 @@ public:
 
 private:
     void invokeHandler() {
+        LoopMonitor::Scope scope(LoopMonitor::kAsyncDrain);
         std::vector<HandlerType> handlers;
         {
             std::unique_lock<std::mutex> l(m_handlerMutex);
             m_handlerList.swap(handlers);
             m_handlerList.reserve(kInitialHandlerListSize);
+            metrics::addGauge(metrics::Gauge::ASYNC_QUEUE_DEPTH, 
+                              -int64_t(handlers.size()));
         }
+        LoopMonitor::recordBacklog(handlers.size());
         for (auto& h : handlers) {
             h();
         }
@@ -0,0 +1,134 @@
+#include "busypoll.h"
+#include "log.h"
+#include "metrics.h"
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
+
+// CPU time of the calling thread in ns, 0 where unavailable
+static uint64_t threadCpuNanos() {
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit,
+                        &kernel, &user)) {
+        return 0;
+    }
+    uint64_t k = (uint64_t(kernel.dwHighDateTime) << 32) | kernel.dwLowDateTime;
+    uint64_t u = (uint64_t(user.dwHighDateTime) << 32) | user.dwLowDateTime;
+    return (k + u) * 100;
+#else
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+        return 0;
+    }
+    return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+#endif
+}
+
+// -----------------------------------------------------------------------------
+// Section: BusyPoll
+// -----------------------------------------------------------------------------
+thread_local uint64_t BusyPoll::s_received = 0;
+
+BusyPoll::BusyPoll(uv_loop_t& loop, int spinMicros)
+    : m_loop(loop)
+    , m_spinNanos(spinMicros > 0 ? uint64_t(spinMicros) * 1000 : 0)
+    , m_stopping(false), m_cpuNanos(0) {
+}
+
+// static
+bool BusyPoll::pinThread(int cpu) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int retval = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (retval != 0) {
+        LOGE << "pinning loop thread to cpu " << cpu << ": "
+             << strerror(retval);
+        return false;
+    }
+    LOGI << "loop thread pinned to cpu " << cpu;
+    return true;
+#elif defined(_WIN32)
+    if (cpu >= int(sizeof(DWORD_PTR) * 8) ||
+            0 == SetThreadAffinityMask(GetCurrentThread(),
+                                       DWORD_PTR(1) << cpu)) {
+        LOGE << "pinning loop thread to cpu " << cpu << " failed";
+        return false;
+    }
+    LOGI << "loop thread pinned to cpu " << cpu;
+    return true;
+#else
+    LOGW << "thread pinning is not supported on this platform";
+    (void)cpu;
+    return false;
+#endif
+}
+
+// static
+void BusyPoll::onCpuSample(uv_timer_t* handle) {
+    BusyPoll* self = CONTAINER_OF(handle, BusyPoll, m_cpuTimer);
+    self->sampleCpu();
+}
+
+void BusyPoll::sampleCpu() {
+    uint64_t cpuNanos = threadCpuNanos();
+    if (cpuNanos > m_cpuNanos) {
+        metrics::add(metrics::Counter::LOOP_CPU_NANOS, cpuNanos - m_cpuNanos);
+        m_cpuNanos = cpuNanos;
+    }
+}
+
+void BusyPoll::run() {
+    m_cpuNanos = threadCpuNanos();
+    uv_timer_init(&m_loop, &m_cpuTimer);
+    uv_timer_start(&m_cpuTimer, onCpuSample, kCpuSampleMillis,
+                   kCpuSampleMillis);
+    uv_unref((uv_handle_t*)&m_cpuTimer);
+
+    if (0 == m_spinNanos) {
+        uv_run(&m_loop, UV_RUN_DEFAULT);
+    } else {
+        LOGI << "busy polling for " << m_spinNanos / 1000
+             << "us before blocking";
+        uint64_t lastReceiveNanos = uv_hrtime();
+        while (!m_stopping) {
+            uint64_t received = s_received;
+            uint64_t startNanos = uv_hrtime();
+            if (0 == uv_run(&m_loop, UV_RUN_NOWAIT)) {
+                break;
+            }
+            uint64_t now = uv_hrtime();
+            if (s_received != received) {
+                lastReceiveNanos = now;
+                continue;
+            }
+            // an iteration that found nothing to receive was spent spinning
+            metrics::add(metrics::Counter::BUSY_POLL_SPIN_NANOS,
+                         now - startNanos);
+            if (now - lastReceiveNanos < m_spinNanos || m_stopping) {
+                continue;
+            }
+            if (0 == uv_run(&m_loop, UV_RUN_ONCE)) {
+                break;
+            }
+            lastReceiveNanos = uv_hrtime();
+        }
+    }
+
+    sampleCpu();
+    uv_timer_stop(&m_cpuTimer);
+    uv_close((uv_handle_t*)&m_cpuTimer, nullptr);
+}
+
+void BusyPoll::stop() {
+    m_stopping = true;
+    uv_stop(&m_loop);
+}
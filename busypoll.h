@@ -0,0 +1,52 @@
+#pragma once
+
+#include "util.h"
+#include "uv.h"
+#include <stdint.h>
+
+// -----------------------------------------------------------------------------
+// Section: BusyPoll
+// -----------------------------------------------------------------------------
+// Runs a uv loop for the lowest wakeup latency: after each datagram the
+// loop keeps polling with UV_RUN_NOWAIT for up to the spin budget, and
+// only blocks in epoll once that much time passed without any arriving.
+// Spinning is charged to the busy_poll_spin_ns counter and the loop
+// thread's CPU time to loop_cpu_ns, so that reply_latency can be weighed
+// against what it costs.
+class BusyPoll {
+public:
+    // A |spinMicros| of 0 never spins, the loop runs as UV_RUN_DEFAULT
+    BusyPoll(uv_loop_t& loop, int spinMicros);
+
+    // Pins the calling thread to |cpu|, false if that is not possible
+    static bool pinThread(int cpu);
+
+    // Called by receive paths on the loop thread, restarts the budget
+    static void noteReceive() {
+        s_received++;
+    }
+
+    // Runs the loop on the calling thread until stop() or until nothing
+    // keeps it alive
+    void run();
+
+    // Loop thread only, run() returns once the current iteration ends
+    void stop();
+
+private:
+    static const uint64_t kCpuSampleMillis = 1000;
+
+    static void onCpuSample(uv_timer_t* handle);
+
+    void sampleCpu();
+
+    static thread_local uint64_t s_received;
+
+    uv_loop_t& m_loop;
+    uint64_t m_spinNanos;
+    bool m_stopping;
+    uv_timer_t m_cpuTimer;
+    uint64_t m_cpuNanos;                // thread CPU time already counted
+
+    DISALLOW_COPY_MOVE_AND_ASSIGN(BusyPoll);
+};
@@ -0,0 +1,177 @@
+#include "capture.h"
+#include "log.h"
+#include <string.h>
+#include <errno.h>
+
+static const char kCaptureMagic[8] = { 'N', 'A', 'T', 'C', 'H', 'K', 'C', 'P' };
+static const size_t kCaptureFileBufSize = 1 << 20;
+
+static int putVarint(char* p, uint64_t v) {
+    int n = 0;
+    while (v >= 0x80) {
+        p[n++] = char( (v & 0x7f) | 0x80 );
+        v >>= 7;
+    }
+    p[n++] = char(v);
+    return n;
+}
+
+static bool getVarint(const char*& p, const char* end, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+        uint8_t b = uint8_t(*p++);
+        v |= uint64_t(b & 0x7f) << shift;
+        if ( (b & 0x80) == 0 ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// -----------------------------------------------------------------------------
+// Section: PacketCapture
+// -----------------------------------------------------------------------------
+std::atomic<PacketCapture*> PacketCapture::s_current(nullptr);
+
+// static
+PacketCapture* PacketCapture::open(const std::string& path) {
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (nullptr == fp) {
+        LOGE << "fopen " << path << ": " << strerror(errno);
+        return nullptr;
+    }
+    if (fwrite(kCaptureMagic, sizeof(kCaptureMagic), 1, fp) != 1 ||
+            fputc(kCaptureVersion, fp) == EOF) {
+        LOGE << "write " << path << ": " << strerror(errno);
+        fclose(fp);
+        return nullptr;
+    }
+    LOGI << "capturing inbound datagrams to " << path;
+    return new PacketCapture(fp);
+}
+
+// static
+void PacketCapture::install(PacketCapture* capture) {
+    s_current.store(capture, std::memory_order_release);
+}
+
+PacketCapture::PacketCapture(FILE* fp)
+    : m_fp(fp), m_fileBuf(kCaptureFileBufSize), m_lastNanos(0)
+    , m_lastFlushNanos(0), m_skipped(0) {
+    setvbuf(m_fp, m_fileBuf.data(), _IOFBF, m_fileBuf.size());
+}
+
+PacketCapture::~PacketCapture() {
+    PacketCapture* self = this;
+    s_current.compare_exchange_strong(self, nullptr);
+    fclose(m_fp);
+    if (m_skipped > 0) {
+        LOGW << m_skipped << " datagram(s) not captured, too many endpoints";
+    }
+}
+
+bool PacketCapture::endpointId(const EndpointKey& key, uint32_t& id) {
+    auto it = m_endpointIds.find(key);
+    if (it != m_endpointIds.end()) {
+        id = it->second;
+        return true;
+    }
+    if (m_endpointIds.size() >= kMaxEndpoints) {
+        return false;
+    }
+    id = uint32_t(m_endpointIds.size());
+    m_endpointIds.emplace(key, id);
+    fputc(kCaptureEndpoint, m_fp);
+    fwrite(&key, sizeof(key), 1, m_fp);
+    return true;
+}
+
+void PacketCapture::append(const Endpoint& local, const Endpoint& peer,
+                           const char* data, int size) {
+    uint64_t now = uv_hrtime();
+    std::unique_lock<std::mutex> l(m_mutex);
+    uint32_t localId = 0;
+    uint32_t peerId = 0;
+    if (!endpointId(local.key(), localId) ||
+            !endpointId(peer.key(), peerId)) {
+        m_skipped += 1;
+        return;
+    }
+    uint64_t delta = (0 == m_lastNanos || now < m_lastNanos) ?
+            0 : now - m_lastNanos;
+    m_lastNanos = now;
+    char hdr[1 + 4 * 10];
+    int len = 0;
+    hdr[len++] = char(kCapturePacket);
+    len += putVarint(hdr + len, delta);
+    len += putVarint(hdr + len, localId);
+    len += putVarint(hdr + len, peerId);
+    len += putVarint(hdr + len, uint64_t(size));
+    fwrite(hdr, len, 1, m_fp);
+    fwrite(data, size, 1, m_fp);
+    // the server normally runs until killed, keep the file at most a
+    // second behind
+    if (now - m_lastFlushNanos >= kFlushIntervalNanos) {
+        fflush(m_fp);
+        m_lastFlushNanos = now;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Section: CaptureReader
+// -----------------------------------------------------------------------------
+bool CaptureReader::load(const std::string& path) {
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (nullptr == fp) {
+        return false;
+    }
+    std::vector<char> data;
+    char buf[64 * 1024];
+    size_t n;
+    while ( (n = fread(buf, 1, sizeof(buf), fp)) > 0 ) {
+        data.insert(data.end(), buf, buf + n);
+    }
+    fclose(fp);
+
+    if (data.size() < sizeof(kCaptureMagic) + 1 ||
+            memcmp(data.data(), kCaptureMagic, sizeof(kCaptureMagic)) != 0 ||
+            uint8_t(data[sizeof(kCaptureMagic)]) != kCaptureVersion) {
+        return false;
+    }
+    const char* p = data.data() + sizeof(kCaptureMagic) + 1;
+    const char* end = data.data() + data.size();
+    uint64_t offset = 0;
+    while (p < end) {
+        int type = uint8_t(*p++);
+        if (kCaptureEndpoint == type) {
+            EndpointKey key;
+            if (end - p < (int)sizeof(key)) {
+                break;
+            }
+            memcpy(&key, p, sizeof(key));
+            p += sizeof(key);
+            m_endpoints.push_back(key);
+        } else if (kCapturePacket == type) {
+            uint64_t delta, localId, peerId, len;
+            if (!getVarint(p, end, delta) || !getVarint(p, end, localId) ||
+                    !getVarint(p, end, peerId) || !getVarint(p, end, len) ||
+                    uint64_t(end - p) < len ||
+                    localId >= m_endpoints.size() ||
+                    peerId >= m_endpoints.size()) {
+                break;
+            }
+            offset += delta;
+            CapturedPacket pkt;
+            pkt.offsetNanos = m_packets.empty() ? 0 : offset;
+            pkt.localId = uint32_t(localId);
+            pkt.peerId = uint32_t(peerId);
+            pkt.payload.assign(p, size_t(len));
+            p += len;
+            m_packets.emplace_back(std::move(pkt));
+        } else {
+            // unknown record, or the tail of a capture cut short
+            break;
+        }
+    }
+    return true;
+}
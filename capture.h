@@ -0,0 +1,103 @@
+#pragma once
+
+#include "util.h"
+#include "endpoint.h"
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdio.h>
+
+// -----------------------------------------------------------------------------
+// Capture file layout
+//
+//   header: "NATCHKCP" | version (1 byte)
+//   then a sequence of records, each starting with a type byte:
+//     kCaptureEndpoint: key (20 bytes); defines the next endpoint id,
+//                       counting from 0
+//     kCapturePacket:   delta ns since previous packet (varint) |
+//                       local id (varint) | peer id (varint) |
+//                       length (varint) | payload
+//
+// Endpoints are written once and referenced by id afterwards, so a packet
+// costs its payload plus a handful of bytes.
+// -----------------------------------------------------------------------------
+enum {
+    kCaptureEndpoint = 1,
+    kCapturePacket = 2
+};
+
+static const uint8_t kCaptureVersion = 1;
+
+// -----------------------------------------------------------------------------
+// Section: PacketCapture
+// -----------------------------------------------------------------------------
+// Records inbound datagrams with their payload for later replay. Installed
+// process-wide like PacketTrace; UdpServiceImpl feeds it from handleRecv.
+class PacketCapture {
+public:
+    static PacketCapture* open(const std::string& path);
+
+    static void install(PacketCapture* capture);
+
+    static inline void record(const Endpoint& local, const Endpoint& peer,
+                              const char* data, int size) {
+        PacketCapture* capture = s_current.load(std::memory_order_acquire);
+        if (nullptr != capture) {
+            capture->append(local, peer, data, size);
+        }
+    }
+
+    ~PacketCapture();
+
+private:
+    static const size_t kMaxEndpoints = 1 << 20;
+    static const uint64_t kFlushIntervalNanos = 1000000000ULL;
+
+    explicit PacketCapture(FILE* fp);
+
+    void append(const Endpoint& local, const Endpoint& peer,
+                const char* data, int size);
+    bool endpointId(const EndpointKey& key, uint32_t& id);
+
+    static std::atomic<PacketCapture*> s_current;
+
+    std::mutex m_mutex;
+    FILE* m_fp;
+    std::vector<char> m_fileBuf;
+    std::unordered_map<EndpointKey, uint32_t> m_endpointIds;
+    uint64_t m_lastNanos;
+    uint64_t m_lastFlushNanos;
+    uint64_t m_skipped;
+
+    DISALLOW_COPY_MOVE_AND_ASSIGN(PacketCapture);
+};
+
+// -----------------------------------------------------------------------------
+// Section: CaptureReader
+// -----------------------------------------------------------------------------
+struct CapturedPacket {
+    uint64_t offsetNanos;   // since the first packet
+    uint32_t localId;
+    uint32_t peerId;
+    std::string payload;
+};
+
+class CaptureReader {
+public:
+    // Loads the whole file, returns false if it is not a valid capture
+    bool load(const std::string& path);
+
+    const std::vector<EndpointKey>& endpoints() const {
+        return m_endpoints;
+    }
+
+    const std::vector<CapturedPacket>& packets() const {
+        return m_packets;
+    }
+
+private:
+    std::vector<EndpointKey> m_endpoints;
+    std::vector<CapturedPacket> m_packets;
+};
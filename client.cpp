@@ -1,22 +1,41 @@
 #include "longopt.h"
 #include "log.h"
 #include "util.h"
-#include "async.h"
+#include "loopgroup.h"
 #include "endpoint.h"
 #include "message.h"
 #include "udpsvc.h"
+#include "pkttrace.h"
+#include "timeline.h"
 #include <uv.h>
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
+#include <functional>
 #include <set>
-#include <thread>
+#include <algorithm>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
 
 static const option_t kOptions[] = {
     { '-', NULL, 0, NULL, "arguments:" },
     { 'l', "listen-udp", LONGOPT_REQUIRE, NULL, "<ip>:<port>"},
     { 's', "servers", LONGOPT_REQUIRE, NULL, "udp server list <ip>:<port>,<ip>:<port>,..." },
+    { 'w', "wire-version", LONGOPT_REQUIRE, NULL, "wire protocol version: auto(default), 0 or 1" },
+    { 'v', "log-level", LONGOPT_REQUIRE, NULL, "trace(default), debug, info, warn or error"},
+    { 't', "trace", LONGOPT_REQUIRE, NULL, "save the packet trace, recorded in memory regardless, to this file on exit"},
+    { 0, "trace-records", LONGOPT_REQUIRE, NULL, "packet trace ring size in records, 0 to turn tracing off (default 65536)"},
+    { 0, "stats", LONGOPT_NOPARAM, NULL, "print the metrics of the first server instead of checking, loopback only"},
+    { 0, "timeline", LONGOPT_REQUIRE, NULL, "write stages, tasks, sends, replies and verdicts to this file as Chrome trace-event JSON"},
+    { 0, "all-interfaces", LONGOPT_NOPARAM, NULL, "classify every non-loopback IPv4 interface address at once, each bound with the port of -l, and print a table"},
+    { 0, "deadline", LONGOPT_REQUIRE, NULL, "ms each uplink of --all-interfaces gets, one still undecided then shows where it stopped (default 60000)"},
     { 0, NULL, 0, NULL, NULL }
 };
 
@@ -29,6 +48,22 @@ static const int kMaxChkFullConeCount = 5;
 static const int kChkRestrictedConeIntervalMillis = 2000;
 static const int kMaxChkRestrictedConeCount = 5;
 
+static const int kBatchProbeIntervalMillis = 2000;
+static const int kMaxBatchProbeCount = 5;
+
+// longer than the stages of a classification with every retry taken
+static const int kDefaultSurveyDeadlineMillis = 60 * 1000;
+
+static const int kGetStatsIntervalMillis = 1000;
+static const int kMaxGetStatsCount = 3;
+
+// the intervals above are the longest retransmission timeouts, a measured
+// server is retried as soon as its RTT allows, but never sooner than this
+static const int kMinRtoMillis = 200;
+
+// negotiate the wire protocol version with the first server that answers
+static const int kWireAuto = -1;
+
 enum {
     kFullCone = 1,
     kRestrictedCone,
@@ -38,131 +73,562 @@ enum {
 
 struct InterfaceAddress {
     std::string name;
-    Endpoint addr4;
-    Endpoint addr6;
+    std::vector<Endpoint> addrs4;
+    std::vector<Endpoint> addrs6;
+    bool internal;              // loopback
 };
 
-struct CheckSymmetricNatContext {
-    std::vector<Endpoint> myAddrList;
-    int finishedTasks;
+typedef std::map<std::string, InterfaceAddress> InterfaceMap;
+
+// Gets the final verdict of a Client, such as "FULL CONE NAT"
+typedef std::function<void(const char* verdict)> VerdictHandler;
+
+// outcome of a FULL CONE probe
+enum {
+    kNotFullCone,
+    kIsFullCone,
+    kFullConeUntested       // the relaying server knows the other is down
+};
+
+struct BatchProbeResult {
+    const Endpoint* myAddr;     // nullptr if the server never answered
+    int version;                // wire version the server answered in
+    int fullCone;               // kNotFullCone etc
 };
 
+// -----------------------------------------------------------------------------
+// Section: RttEstimator
+// -----------------------------------------------------------------------------
+// Smoothed round-trip time of one server after RFC 6298. Only answers to a
+// request sent once are sampled (Karn's algorithm), an answer to a
+// retransmitted request cannot be matched to its transmission.
+class RttEstimator {
+    uint64_t m_srttNanos;
+    uint64_t m_rttvarNanos;
+    int m_samples;
+
+public:
+    RttEstimator() : m_srttNanos(0), m_rttvarNanos(0), m_samples(0) { }
+
+    void sample(uint64_t rttNanos) {
+        if (0 == m_samples) {
+            m_srttNanos = rttNanos;
+            m_rttvarNanos = rttNanos / 2;
+        } else {
+            uint64_t err = (rttNanos > m_srttNanos) ? 
+                    rttNanos - m_srttNanos : m_srttNanos - rttNanos;
+            m_rttvarNanos = (3 * m_rttvarNanos + err) / 4;
+            m_srttNanos = (7 * m_srttNanos + rttNanos) / 8;
+        }
+        m_samples += 1;
+    }
+
+    bool measured() const {
+        return m_samples > 0;
+    }
+
+    uint64_t srttNanos() const {
+        return m_srttNanos;
+    }
+
+    // SRTT + 4 * RTTVAR within [kMinRtoMillis, |maxMillis|], |maxMillis|
+    // until the first sample
+    uint64_t rtoMillis(int maxMillis) const {
+        if (0 == m_samples) {
+            return uint64_t(maxMillis);
+        }
+        uint64_t rto = (m_srttNanos + 4 * m_rttvarNanos) / 1000000;
+        rto = std::max(rto, uint64_t(kMinRtoMillis));
+        return std::min(rto, uint64_t(maxMillis));
+    }
+};
+
+// "<what> <ip>:<port>", names a task on the timeline
+static std::string spanName(const char* what, const Endpoint& svr) {
+    char buf[INET6_ADDRSTRLEN + 8];
+    int len = svr.format(buf, sizeof(buf));
+    return std::string(what) + " " + std::string(buf, len);
+}
+
 class Client;
 // -----------------------------------------------------------------------------
-// Section: GetAddrTask
+// Section: ProbePool
 // -----------------------------------------------------------------------------
-class GetAddrTask : public UdpService::IMessageHandler {
-    typedef std::function<void(const Endpoint*)> CompletionHandler;
+// Storage of the probes of one Client. Blocks of finished probes are kept
+// per size and taken again before the heap is asked, so that thousands of
+// concurrent probes do not churn it.
+class ProbePool {
+public:
+    ProbePool() {
+    }
 
-    Client& m_client;
-    Endpoint m_svr;
-    uv_timer_t m_timer;
-    int m_tryCount;
-    CompletionHandler m_completionHandler;
+    ~ProbePool() {
+        for (auto& entry : m_free) {
+            for (void* block : entry.second) {
+                ::operator delete(block);
+            }
+        }
+    }
 
+    void* allocate(size_t size) {
+        std::vector<void*>& blocks = m_free[size];
+        if (blocks.empty()) {
+            return ::operator new(size);
+        }
+        void* block = blocks.back();
+        blocks.pop_back();
+        return block;
+    }
+
+    void release(void* block, size_t size) {
+        std::vector<void*>& blocks = m_free[size];
+        if (blocks.size() < kMaxPooled) {
+            blocks.push_back(block);
+        } else {
+            ::operator delete(block);
+        }
+    }
+
+private:
+    static const size_t kMaxPooled = 1024;     // per size
+
+    std::map<size_t, std::vector<void*>> m_free;
+
+    DISALLOW_COPY_MOVE_AND_ASSIGN(ProbePool);
+};
+
+// -----------------------------------------------------------------------------
+// Section: ProbeTask
+// -----------------------------------------------------------------------------
+// What every probe offers regardless of its types, for WhenAny
+class Probe : public UdpService::IMessageHandler {
+public:
+    // Ends the probe without calling its completion, only while it runs
+    virtual void cancel() = 0;
+};
+
+// One request and its answer, the client's send-and-wait: the request goes
+// to the server again after every retransmission timeout until a message
+// of the transaction yields a Result or the tries run out. The completion
+// is where the waiting code goes on.
+//
+// Request carries the server and what the request is about, and provides
+//   static const MessageId kId, int kMaxTries, int kMaxIntervalMillis
+//   Endpoint svr
+//   void encode(wire::Writer& writer) const
+//   Endpoint via() const      server the answer comes back through, which
+//                             adds its RTO; unspecified if none
+// Matcher provides
+//   static bool match(const Request& request, const Endpoint& peer,
+//                     const wire::MessageView& msg, Result& result)
+// which takes |msg| from |peer| as the answer by filling in |result|.
+template <typename Request, typename Matcher, typename Result>
+class ProbeTask : public Probe {
 public:
+    // Gets nullptr once the tries ran out, |result| is valid during the
+    // call only
+    typedef std::function<void(const Result* result)> Completion;
+
+    // Allocated from the ProbePool of |client|
+    static ProbeTask* start(Client& client, const Request& request, 
+                            Completion&& completion);
+
+    void cancel() override;
+
+private:
     static void onTimeout(uv_timer_t* handle);
     static void onCloseHandle(uv_handle_t* handle);
 
-    GetAddrTask(Client& client, const Endpoint& svr, 
-                CompletionHandler&& handler);
+    ProbeTask(Client& client, const Request& request, 
+              Completion&& completion);
 
-private:
     void handleMessage(UdpService& udpSvc, const Endpoint& peer, 
-                       const char* data, int size) override;
+                       const char* data, int size, 
+                       uint64_t recvNanos) override;
     void send();
+    uint64_t retransmitMillis() const;
     void stop();
+
+    Client& m_client;
+    Request m_request;
+    uv_timer_t m_timer;
+    int m_tryCount;
+    uint16_t m_txid;
+    uint64_t m_sentNanos;
+    uint64_t m_span;                // on the timeline
+    Completion m_completion;
+};
+
+// GETADDR, answered by ADDR carrying the address |svr| saw
+struct GetAddrRequest {
+    static const MessageId kId = MessageId::GETADDR;
+    static const int kMaxTries = kMaxGetAddrCount;
+    static const int kMaxIntervalMillis = kGetAddrIntervalMillis;
+
+    Endpoint svr;
+
+    void encode(wire::Writer& writer) const {
+        writer.add(kId);
+    }
+
+    Endpoint via() const {
+        return Endpoint();
+    }
+};
+
+struct AddrMatcher {
+    static bool match(const GetAddrRequest& request, const Endpoint& peer, 
+                      const wire::MessageView& msg, Endpoint& myAddr) {
+        if (peer != request.svr || MessageId::ADDR != msg.id) {
+            return false;
+        }
+        if (!msg.addr(myAddr)) {
+            LOGW << "invalid ADDR from " << peer;
+            return false;
+        }
+        return true;
+    }
 };
 
+// CHKFULLCONE, |svr| relays it through |svrUnknown| or tells it is down
+struct ChkFullConeRequest {
+    static const MessageId kId = MessageId::CHKFULLCONE;
+    static const int kMaxTries = kMaxChkFullConeCount;
+    static const int kMaxIntervalMillis = kChkFullConeIntervalMillis;
+
+    Endpoint svr;
+    Endpoint svrUnknown;
+
+    void encode(wire::Writer& writer) const {
+        writer.add(kId, svrUnknown);
+    }
+
+    Endpoint via() const {
+        return svrUnknown;
+    }
+};
+
+struct FullConeMatcher {
+    static bool match(const ChkFullConeRequest& request, 
+                      const Endpoint& peer, const wire::MessageView& msg, 
+                      int& result) {
+        if (peer == request.svrUnknown && MessageId::FULLCONE == msg.id) {
+            result = kIsFullCone;
+            return true;
+        }
+        if (peer == request.svr && MessageId::PEER_UNAVAILABLE == msg.id) {
+            LOGW << "recv PEER_UNAVAILABLE from " << peer << ", " 
+                 << request.svrUnknown << " is down";
+            result = kFullConeUntested;
+            return true;
+        }
+        return false;
+    }
+};
+
+// CHKRESTRICTEDCONE, answered from the server's IP through another port
+struct ChkRestrictedConeRequest {
+    static const MessageId kId = MessageId::CHKRESTRICTEDCONE;
+    static const int kMaxTries = kMaxChkRestrictedConeCount;
+    static const int kMaxIntervalMillis = kChkRestrictedConeIntervalMillis;
+
+    Endpoint svr;
+
+    void encode(wire::Writer& writer) const {
+        writer.add(kId);
+    }
+
+    // the answering port is unknown, allow for the detour
+    Endpoint via() const {
+        return svr;
+    }
+};
+
+struct RestrictedConeMatcher {
+    static bool match(const ChkRestrictedConeRequest& request, 
+                      const Endpoint& peer, const wire::MessageView& msg, 
+                      int& natType) {
+        // from any other IP it says nothing about the filter probed
+        if (peer == request.svr || MessageId::RESTRICTEDCONE != msg.id ||
+                peer.key().hostOnly() != request.svr.key().hostOnly()) {
+            return false;
+        }
+        natType = kRestrictedCone;
+        return true;
+    }
+};
+
+// GETSTATS, answered on loopback only
+struct GetStatsRequest {
+    static const MessageId kId = MessageId::GETSTATS;
+    static const int kMaxTries = kMaxGetStatsCount;
+    static const int kMaxIntervalMillis = kGetStatsIntervalMillis;
+
+    Endpoint svr;
+
+    void encode(wire::Writer& writer) const {
+        writer.add(kId);
+    }
+
+    Endpoint via() const {
+        return Endpoint();
+    }
+};
+
+// |stats| points into the datagram
+struct StatsMatcher {
+    static bool match(const GetStatsRequest& request, const Endpoint& peer, 
+                      const wire::MessageView& msg, wire::MessageView& stats) {
+        if (peer != request.svr || MessageId::STATS != msg.id) {
+            return false;
+        }
+        stats = msg;
+        return true;
+    }
+};
+
+typedef ProbeTask<GetAddrRequest, AddrMatcher, Endpoint> GetAddrTask;
+typedef ProbeTask<ChkFullConeRequest, FullConeMatcher, int> 
+        CheckFullConeTask;
+typedef ProbeTask<ChkRestrictedConeRequest, RestrictedConeMatcher, int> 
+        CheckRestrictedConeTask;
+typedef ProbeTask<GetStatsRequest, StatsMatcher, wire::MessageView> 
+        GetStatsTask;
+
 // -----------------------------------------------------------------------------
-// Section: CheckFullConeTask
+// Section: WhenAll / WhenAny
 // -----------------------------------------------------------------------------
-class CheckFullConeTask : public UdpService::IMessageHandler {
-    typedef std::function<void(bool isOk)> CompletionHandler;
+// Joins concurrent probes. add() hands the starter a completion taking the
+// result of its probe, nullptr for none. Probes never complete from within
+// start(), so everything is added before the first result comes in.
 
-    Client& m_client;
-    Endpoint m_svr;
-    Endpoint m_svrUnknown;
-    uv_timer_t m_timer;
-    int m_tryCount;
-    CompletionHandler m_completionHandler;
+// |done| gets the results of all probes in the order they were added
+template <typename Result>
+class WhenAll {
+public:
+    typedef std::function<void(const Result* result)> Part;
+    typedef std::function<void(const std::vector<const Result*>& results)> 
+            Done;
+
+    explicit WhenAll(Done&& done) : m_state(std::make_shared<State>()) {
+        m_state->done = std::move(done);
+    }
+
+    // |start| gets a Part and starts a probe completing it
+    template <typename Start>
+    void add(Start start) {
+        std::shared_ptr<State> state = m_state;
+        size_t index = state->results.size();
+        state->results.emplace_back();
+        state->present.push_back(false);
+        state->pending += 1;
+        start(Part([state, index](const Result* result) {
+            if (nullptr != result) {
+                state->results[index] = *result;
+                state->present[index] = true;
+            }
+            if (0 == --state->pending) {
+                std::vector<const Result*> results;
+                for (size_t i = 0; i < state->results.size(); i++) {
+                    results.push_back(state->present[i] ? 
+                                      &state->results[i] : nullptr);
+                }
+                state->done(results);
+            }
+        }));
+    }
+
+private:
+    struct State {
+        std::vector<Result> results;
+        std::vector<bool> present;
+        size_t pending = 0;
+        Done done;
+    };
+
+    std::shared_ptr<State> m_state;
+};
 
+// |done| gets the first result, the probes still running are cancelled;
+// it gets nullptr if all of them ended without one
+template <typename Result>
+class WhenAny {
 public:
-    static void onTimeout(uv_timer_t* handle);
-    static void onCloseHandle(uv_handle_t* handle);
+    typedef std::function<void(const Result* result)> Part;
+    typedef std::function<void(const Result* result)> Done;
+
+    explicit WhenAny(Done&& done) : m_state(std::make_shared<State>()) {
+        m_state->done = std::move(done);
+    }
 
-    CheckFullConeTask(Client& client, 
-                      const Endpoint& svr, 
-                      const Endpoint& svrUnknown, 
-                      CompletionHandler&& handler);
+    // |start| gets a Part and returns the probe completing it
+    template <typename Start>
+    void add(Start start) {
+        std::shared_ptr<State> state = m_state;
+        size_t index = state->running.size();
+        state->running.push_back(nullptr);
+        state->running[index] = start(Part([state, index](
+                                                const Result* result) {
+            state->running[index] = nullptr;
+            if (state->finished) {
+                return;
+            }
+            if (nullptr != result) {
+                state->finished = true;
+                for (Probe*& probe : state->running) {
+                    if (nullptr != probe) {
+                        probe->cancel();
+                        probe = nullptr;
+                    }
+                }
+                state->done(result);
+            } else if (std::all_of(state->running.begin(), 
+                                   state->running.end(), 
+                                   [](Probe* p) { return !p; })) {
+                state->finished = true;
+                state->done(nullptr);
+            }
+        }));
+    }
 
 private:
-    void handleMessage(UdpService& udpSvc, const Endpoint& peer, 
-                       const char* data, int size) override;
-    void send();
-    void stop();
+    struct State {
+        std::vector<Probe*> running;     // nullptr once completed
+        bool finished = false;
+        Done done;
+    };
+
+    std::shared_ptr<State> m_state;
 };
 
 // -----------------------------------------------------------------------------
-// Section: CheckRestrictedConeTask
+// Section: BatchProbeTask
 // -----------------------------------------------------------------------------
-class CheckRestrictedConeTask : public UdpService::IMessageHandler {
-    typedef std::function<void(int natType)> CompletionHandler;
+// Asks for GETADDR and CHKFULLCONE in one datagram and retransmits only
+// the operations that are still unanswered. Answers that are absent when
+// the retries run out count as negative. CHKRESTRICTEDCONE waits for its
+// stage: the symmetric stage contacts the other servers first, which
+// changes what the NAT's filter lets in, and the verdict must not depend
+// on whether the probes were batched.
+class BatchProbeTask : public Probe {
+    typedef std::function<void(const BatchProbeResult&)> CompletionHandler;
 
     Client& m_client;
     Endpoint m_svr;
+    Endpoint m_svrUnknown;
     uv_timer_t m_timer;
     int m_tryCount;
+    uint16_t m_txid;
+    uint64_t m_sentNanos;
+    uint64_t m_span;                // on the timeline
+    int m_version;
+    Endpoint m_myAddr;
+    bool m_gotAddr;
+    bool m_gotFullCone;
+    bool m_peerUnavailable;
     CompletionHandler m_completionHandler;
 
 public:
     static void onTimeout(uv_timer_t* handle);
     static void onCloseHandle(uv_handle_t* handle);
 
-    CheckRestrictedConeTask(Client& client, 
-                            const Endpoint& svr, 
-                            CompletionHandler&& handler);
+    // |svrUnknown| may be left unspecified to skip the FULL CONE probe
+    BatchProbeTask(Client& client, 
+                   const Endpoint& svr, 
+                   const Endpoint& svrUnknown, 
+                   CompletionHandler&& handler);
+
+    void cancel() override;
 
 private:
     void handleMessage(UdpService& udpSvc, const Endpoint& peer, 
-                       const char* data, int size) override;
+                       const char* data, int size, 
+                       uint64_t recvNanos) override;
     void send();
+    uint64_t retransmitMillis() const;
+    void checkDone();
+    void finish();
     void stop();
-}; 
+};
 
 // -----------------------------------------------------------------------------
 // Section: Client
 // -----------------------------------------------------------------------------
 class Client : public UdpService::IMessageHandler {
-    friend class GetAddrTask;
-    friend class CheckFullConeTask;
-    friend class CheckRestrictedConeTask;
+    template <typename Request, typename Matcher, typename Result>
+    friend class ProbeTask;
+    friend class BatchProbeTask;
 
     uv_loop_t& m_loop;
     UdpService m_udpSvc;
     std::vector<IpPort> m_svrList;
-
-    typedef std::map<std::string, InterfaceAddress> InterfaceMap;
+    int m_wireVersion;
+    uint16_t m_nextTxid;
+    std::map<EndpointKey, RttEstimator> m_rttMap;
+    uint64_t m_stage;                   // span of the running stage
+    const char* m_stageName;
+    const char* m_finding;              // latest decide(), if any
+    ProbePool m_probePool;
     InterfaceMap m_interfaceMap;
+    VerdictHandler m_verdictHandler;
+    bool m_reported;
+    bool m_closed;
+    uv_timer_t m_deadlineTimer;
+    std::vector<Probe*> m_probes;       // running, for close()
 
 public:
+    static void onDeadline(uv_timer_t* handle) {
+        Client* self = CONTAINER_OF(handle, Client, m_deadlineTimer);
+        self->expire();
+    }
+
+    // |interfaces| tells the addresses of the host, see
+    // queryInterfaceAddresses(). A non-empty |device| is the interface
+    // the socket is bound to. With a |deadlineMillis|, |handler| hears
+    // how far the client got if it has not concluded by then.
     Client(uv_loop_t& loop, const Endpoint& listenAddr, 
-           const std::vector<IpPort>& svrList)
-        : m_loop(loop), m_udpSvc(loop, listenAddr), m_svrList(svrList) {
+           const std::string& device, const InterfaceMap& interfaces, 
+           const std::vector<IpPort>& svrList, int wireVersion, 
+           bool statsOnly, uint64_t deadlineMillis = 0,
+           VerdictHandler&& handler = VerdictHandler())
+        : m_loop(loop), m_udpSvc(loop, listenAddr, udpOptions(device))
+        , m_svrList(svrList)
+        , m_wireVersion(wireVersion), m_nextTxid(uint16_t(uv_hrtime()))
+        , m_stage(0), m_stageName(nullptr)
+        , m_finding(nullptr), m_interfaceMap(interfaces)
+        , m_verdictHandler(std::move(handler)), m_reported(false)
+        , m_closed(false) {
+        uv_timer_init(&loop, &m_deadlineTimer);
+        if (deadlineMillis > 0) {
+            uv_timer_start(&m_deadlineTimer, onDeadline, deadlineMillis, 0);
+        }
         m_udpSvc.addMessageHandler(this);
         m_udpSvc.start();
-        queryInterfaceAddresses();
+        if (statsOnly) {
+            queryStats();
+            return;
+        }
         checkIfBehindNat();
     }
 
-    void handleMessage(UdpService& udpSvc, const Endpoint& peer, 
-                       const char* data, int size) override {
-        MessageId msgId = MessageId(data[0]);
-        LOGT << "recv message " << int(msgId) << " from " << peer;
+    // Ends the probes still running, closes the deadline timer and shuts
+    // the UdpService down, so the client leaves nothing on the loop and
+    // may be deleted once the loop has run out; any number of times
+    void close() {
+        if (m_closed) {
+            return;
+        }
+        m_closed = true;
+        std::vector<Probe*> probes(m_probes);
+        for (Probe* probe : probes) {
+            probe->cancel();
+        }
+        closeDeadline();
+        m_udpSvc.shutdown([](){});
     }
 
-private:
-    void queryInterfaceAddresses() {
+    // Fills |interfaceMap| with the addresses of the host by interface
+    static void queryInterfaceAddresses(InterfaceMap& interfaceMap) {
         uv_interface_address_t* addrs;
         int count = 0;
         int retval = uv_interface_addresses(&addrs, &count);
@@ -174,13 +640,14 @@ private:
             uv_interface_address_t& entry = addrs[i];
             std::string name = entry.name;
             Endpoint endpoint((const struct sockaddr*)&entry.address);
-            InterfaceAddress& ia = m_interfaceMap[name];
+            InterfaceAddress& ia = interfaceMap[name];
             ia.name = name;
+            ia.internal = (0 != entry.is_internal);
             int af = endpoint.sockaddr()->sa_family;
             if (AF_INET == af) {
-                ia.addr4 = endpoint;
+                ia.addrs4.push_back(endpoint);
             } else if (AF_INET6 == af) {
-                ia.addr6 = endpoint;
+                ia.addrs6.push_back(endpoint);
             } else {
                 LOGW << "unsupported address family " << af 
                      << " found on interface " << name 
@@ -189,300 +656,879 @@ private:
             }
         }
         uv_free_interface_addresses(addrs, count);
-        LOGI << "found " << m_interfaceMap.size() << " interface(s)";
+        LOGI << "found " << interfaceMap.size() << " interface(s)";
+        for (auto it = interfaceMap.begin(); it != interfaceMap.end(); ++it) {
+            const InterfaceAddress& ia = it->second;
+            std::string v4, v6;
+            for (const Endpoint& addr : ia.addrs4) {
+                v4 += (v4.empty() ? "" : " ") + addr.ip();
+            }
+            for (const Endpoint& addr : ia.addrs6) {
+                v6 += (v6.empty() ? "" : " ") + addr.ip();
+            }
+            LOGI << ia.name << ", v4: " << v4 << ", v6: " << v6;
+        }
+    }
+
+    void handleMessage(UdpService& udpSvc, const Endpoint& peer, 
+                       const char* data, int size, 
+                       uint64_t recvNanos) override {
+        wire::Reader reader;
+        if (!reader.init(data, size)) {
+            LOGW << "malformed datagram of " << size << " bytes from " 
+                 << peer;
+            return;
+        }
+        wire::MessageView msg;
+        while (reader.next(msg)) {
+            LOGT << "recv message " << int(msg.id) << " from " << peer;
+        }
+    }
+
+private:
+    static UdpService::Options udpOptions(const std::string& device) {
+        UdpService::Options options;
+        options.device = device;
+        // RTTs end when the kernel got the answer, not when the loop
+        // came around to it
+        options.kernelTimestamps = true;
+        return options;
+    }
+
+    // Samples the RTT of |svr| from a request transmitted once at
+    // |sentNanos| and answered at |recvNanos|
+    void sampleRtt(const Endpoint& svr, uint64_t sentNanos, 
+                   uint64_t recvNanos) {
+        if (0 == sentNanos || recvNanos <= sentNanos) {
+            return;
+        }
+        RttEstimator& rtt = m_rttMap[svr.key()];
+        rtt.sample(recvNanos - sentNanos);
+        LOGD << "rtt to " << svr << " " << (recvNanos - sentNanos) / 1000 
+             << "us, smoothed " << rtt.srttNanos() / 1000 << "us";
+    }
+
+    uint64_t rtoMillis(const Endpoint& svr, int maxMillis) const {
+        auto it = m_rttMap.find(svr.key());
+        if (it == m_rttMap.end()) {
+            return uint64_t(maxMillis);
+        }
+        return it->second.rtoMillis(maxMillis);
+    }
+
+    // Delay after transmission |tryCount|: |rto| doubled for every
+    // retransmission so far, at most |maxMillis|
+    static uint64_t retransmitMillis(uint64_t rto, int tryCount, 
+                                     int maxMillis) {
+        for (int i = 1; i < tryCount && rto < uint64_t(maxMillis); i++) {
+            rto *= 2;
+        }
+        return std::min(rto, uint64_t(maxMillis));
+    }
+
+    // Puts transmission |tryCount| of a task on the timeline, along with
+    // how long it will wait for the answer
+    static void traceSend(uint64_t span, int tryCount, 
+                          uint64_t timeoutMillis) {
+        TimelineArgs args;
+        args.add("try", int64_t(tryCount));
+        args.add("timeout_ms", int64_t(timeoutMillis));
+        Timeline::event(span, (1 == tryCount) ? "send" : "retransmit", args);
+    }
+
+    // Puts answer |what| on the timeline at its receive time; the delay
+    // is measured from the latest transmission
+    static void traceReply(uint64_t span, const char* what, 
+                           const Endpoint& peer, uint64_t sentNanos, 
+                           uint64_t recvNanos) {
+        int64_t delay = (recvNanos > sentNanos) ? 
+                int64_t(recvNanos - sentNanos) / 1000 : 0;
+        TimelineArgs args;
+        args.add("from", peer);
+        args.add("since_send_us", delay);
+        Timeline::event(span, what, args, recvNanos);
+    }
+
+    // Ends the current stage, if any, and starts stage |name|
+    void beginStage(const char* name) {
+        m_stageName = name;
+        Timeline::end(m_stage);
+        m_stage = Timeline::begin("stage", name);
+    }
+
+    // Records |verdict| and ends the stage that reached it
+    void decide(const char* verdict) {
+        m_finding = verdict;
+        Timeline::mark(verdict);
+        Timeline::end(m_stage, TimelineArgs().add("verdict", verdict));
+        m_stage = 0;
+    }
+
+    // Records the final |verdict| and shuts the client down
+    void conclude(const char* verdict) {
+        decide(verdict);
+        close();
+        report(verdict);
+    }
+
+    void closeDeadline() {
+        if (!uv_is_closing((uv_handle_t*)&m_deadlineTimer)) {
+            uv_close((uv_handle_t*)&m_deadlineTimer, nullptr);
+        }
+    }
+
+    // The handler hears a client once, a verdict after the deadline is
+    // only logged
+    void report(const char* verdict) {
+        if (m_reported) {
+            LOGI << "verdict " << verdict << " past the deadline";
+            return;
+        }
+        m_reported = true;
+        if (m_verdictHandler) {
+            m_verdictHandler(verdict);
+        }
+    }
+
+    // Reports the stage the client is stuck in and what it found so far;
+    // its probes run on, the UdpService they use must stay open until
+    // close()
+    void expire() {
+        closeDeadline();
+        std::string partial = "timeout";
+        if (nullptr != m_stageName) {
+            partial += std::string(" in ") + m_stageName;
+        }
+        if (nullptr != m_finding) {
+            partial += std::string(", ") + m_finding;
+        }
+        LOGW << "deadline passed: " << partial;
+        report(partial.c_str());
+    }
+
+    // The server with the lowest smoothed RTT, the first one listed
+    // until any of them was measured
+    Endpoint fastestServer() const {
+        const IpPort& first = m_svrList[0];
+        Endpoint fastest(AF_INET, first.ip, first.port);
+        uint64_t best = UINT64_MAX;
+        for (const IpPort& addr : m_svrList) {
+            Endpoint endpoint(AF_INET, addr.ip, addr.port);
+            auto it = m_rttMap.find(endpoint.key());
+            if (it != m_rttMap.end() && it->second.measured() && 
+                    it->second.srttNanos() < best) {
+                best = it->second.srttNanos();
+                fastest = endpoint;
+            }
+        }
+        return fastest;
+    }
+
+    // With kWireAuto, retries alternate between the current version and
+    // legacy until some server answers, so old servers still work.
+    int wireVersion(int tryCount) const {
+        if (kWireAuto != m_wireVersion) {
+            return m_wireVersion;
+        }
+        return (tryCount % 2 == 0) ? wire::kCurrentVersion : wire::kLegacy;
+    }
+
+    uint16_t newTxid() {
+        return m_nextTxid++;
+    }
+
+    // Probes are known to the client while they run, so close() can end
+    // them
+    void addProbe(Probe* probe) {
+        m_probes.push_back(probe);
+    }
+
+    void removeProbe(Probe* probe) {
+        m_probes.erase(std::remove(m_probes.begin(), m_probes.end(), probe), 
+                       m_probes.end());
+    }
+
+    // Looks for message |id| answering transaction |txid|. The first match
+    // settles the wire version when negotiating.
+    bool matchReply(const char* data, int size, MessageId id, 
+                    uint16_t txid, wire::MessageView& msg) {
+        wire::Reader reader;
+        if (!reader.init(data, size)) {
+            return false;
+        }
+        if (wire::kLegacy != reader.version() && reader.txid() != txid) {
+            return false;
+        }
+        while (reader.next(msg)) {
+            if (msg.id == id) {
+                settleWireVersion(reader.version());
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void settleWireVersion(int version) {
+        if (kWireAuto == m_wireVersion) {
+            m_wireVersion = version;
+            LOGI << "using wire protocol version " << m_wireVersion;
+        }
+    }
+
+    // Whether the IP of |addr| is one of the host, whatever the port
+    bool isLocalAddress(const Endpoint& addr) const {
+        EndpointKey host = addr.key().hostOnly();
         for (auto it = m_interfaceMap.begin(); 
                 it != m_interfaceMap.end(); ++it) {
             const InterfaceAddress& ia = it->second;
-            LOGI << ia.name 
-                 << ", v4: " << (ia.addr4.v4() ? ia.addr4.ip() : "") 
-                 << ", v6: " << (ia.addr6.v6() ? ia.addr6.ip() : "");
+            for (const Endpoint& local : ia.addrs4) {
+                if (local.key().hostOnly() == host) {
+                    return true;
+                }
+            }
+            for (const Endpoint& local : ia.addrs6) {
+                if (local.key().hostOnly() == host) {
+                    return true;
+                }
+            }
         }
+        return false;
+    }
+
+    // |handler| gets nullptr if |svr| never answered
+    GetAddrTask* getAddr(const Endpoint& svr, 
+                         std::function<void(const Endpoint* myAddr)>&& 
+                                 handler) {
+        return GetAddrTask::start(*this, GetAddrRequest{ svr }, 
+                                  [svr, handler](const Endpoint* myAddr) {
+            if (nullptr == myAddr) {
+                LOGW << "failed to get address from " << svr;
+            } else {
+                LOGI << "recv ADDR from " << svr 
+                     << ", my address is " << *myAddr;
+            }
+            handler(myAddr);
+        });
+    }
+
+    // |handler| gets kIsFullCone etc
+    CheckFullConeTask* checkFullCone(const Endpoint& svr, 
+                                     const Endpoint& svrUnknown, 
+                                     std::function<void(int result)>&& 
+                                             handler) {
+        return CheckFullConeTask::start(*this, 
+                                        ChkFullConeRequest{ svr, svrUnknown }, 
+                                        [handler](const int* result) {
+            handler(result ? *result : kNotFullCone);
+        });
+    }
+
+    // |handler| gets kRestrictedCone or kPortRestrictedCone
+    CheckRestrictedConeTask* checkRestrictedCone(
+            const Endpoint& svr, std::function<void(int natType)>&& handler) {
+        return CheckRestrictedConeTask::start(*this, 
+                                              ChkRestrictedConeRequest{ svr }, 
+                                              [handler](const int* natType) {
+            handler(natType ? *natType : kPortRestrictedCone);
+        });
+    }
+
+    // |handler| gets nullptr if |svr| never answered
+    GetStatsTask* getStats(const Endpoint& svr, 
+                           std::function<void(const char* text, int size)>&& 
+                                   handler) {
+        return GetStatsTask::start(*this, GetStatsRequest{ svr }, 
+                                   [svr, handler](
+                                        const wire::MessageView* stats) {
+            if (nullptr == stats) {
+                LOGW << "failed to get stats from " << svr 
+                     << ", GETSTATS is answered on loopback only";
+                handler(nullptr, 0);
+                return;
+            }
+            handler(stats->value, stats->size);
+        });
+    }
+
+    void queryStats() {
+        const IpPort& addr = m_svrList[0];
+        Endpoint endpoint(AF_INET, addr.ip, addr.port);
+        beginStage("stats");
+        getStats(endpoint, [this](const char* text, int size) {
+            if (nullptr != text) {
+                fwrite(text, 1, size, stdout);
+                fflush(stdout);
+            }
+            Timeline::end(m_stage);
+            m_stage = 0;
+            close();
+        });
     }
 
     void checkIfBehindNat() {
         LOGI << "check if behind NAT";
+        beginStage("behind NAT");
         const IpPort& addr = m_svrList[0];
         Endpoint endpoint(AF_INET, addr.ip, addr.port);
-        new GetAddrTask(*this, endpoint, [this](const Endpoint* myAddr) {
-            if (nullptr == myAddr) {
-                m_udpSvc.shutdown([](){});
-                return;
-            }
-            bool behindNat = true;
-            for (auto it = m_interfaceMap.begin(); 
-                    it != m_interfaceMap.end(); ++it) {
-                const InterfaceAddress& ia = it->second;
-                if (*myAddr == ia.addr4 || *myAddr == ia.addr6) {
-                    behindNat = false;
-                    break;
+        if (wire::kLegacy == m_wireVersion) {
+            getAddr(endpoint, [this](const Endpoint* myAddr) {
+                if (checkMyAddr(myAddr)) {
+                    checkIfFullConeNat();
                 }
+            });
+            return;
+        }
+        // FULL CONE is probed in the same round trip
+        Endpoint svrUnknown;
+        if (m_svrList.size() >= 2) {
+            svrUnknown.init(AF_INET, m_svrList[1].ip, m_svrList[1].port);
+        }
+        new BatchProbeTask(*this, endpoint, svrUnknown, [this](
+                                        const BatchProbeResult& result) {
+            if (!checkMyAddr(result.myAddr)) {
+                return;
             }
-            if (!behindNat) {
-                LOGI << "host has public ip address!";
-                m_udpSvc.shutdown([](){});
-            } else {
-                LOGI << "host MAY behind NAT!";
+            if (wire::kLegacy == result.version || m_svrList.size() < 2) {
                 checkIfFullConeNat();
+                return;
             }
+            onFullConeResult(result.fullCone, 2);
         });
     }
 
-    void checkIfFullConeNat() {
+    // Returns true if the host may be behind NAT and checking goes on
+    bool checkMyAddr(const Endpoint* myAddr) {
+        if (nullptr == myAddr) {
+            conclude("no answer");
+            return false;
+        }
+        if (isLocalAddress(*myAddr)) {
+            LOGI << "host has public ip address!";
+            conclude("public IP");
+            return false;
+        }
+        LOGI << "host MAY behind NAT!";
+        decide("behind NAT");
+        return true;
+    }
+
+    // Asks the first server to relay through every server from
+    // |firstUnknown| on at once, the first relayed answer proves FULL CONE
+    void checkIfFullConeNat(size_t firstUnknown = 1) {
         if (m_svrList.size() < 2) {
             LOGW << "you must specify more than TWO servers with public IP "
                     "address for checking FULL CONE NAT";
-            m_udpSvc.shutdown([](){});
+            conclude("too few servers");
             return;
         }
         LOGI << "check if FULL CONE NAT";
+        beginStage("full cone");
         const IpPort& addr1 = m_svrList[0];
-        const IpPort& addr2 = m_svrList[1];
         Endpoint endpoint1(AF_INET, addr1.ip, addr1.port);
-        Endpoint endpoint2(AF_INET, addr2.ip, addr2.port);
-        new CheckFullConeTask(*this, endpoint1, endpoint2, [this](bool isOk) {
-            if (isOk) {
-                LOGI << "FULL CONE NAT!";
-                m_udpSvc.shutdown([](){});
-                return;
+        // relays through servers that are down
+        std::shared_ptr<size_t> untested = std::make_shared<size_t>(0);
+        size_t count = m_svrList.size() - firstUnknown;
+        WhenAny<Endpoint> any([this, untested, count](
+                                        const Endpoint* svrUnknown) {
+            int result = kIsFullCone;
+            if (nullptr == svrUnknown) {
+                result = (*untested == count) ? kFullConeUntested : 
+                                                kNotFullCone;
             }
-            checkIfSymmetricNat();
+            onFullConeResult(result, m_svrList.size());
         });
+        for (size_t i = firstUnknown; i < m_svrList.size(); i++) {
+            const IpPort& addr2 = m_svrList[i];
+            Endpoint endpoint2(AF_INET, addr2.ip, addr2.port);
+            any.add([this, endpoint1, endpoint2, untested](
+                                const WhenAny<Endpoint>::Part& part) {
+                return checkFullCone(endpoint1, endpoint2, 
+                                     [endpoint2, untested, part](int result) {
+                    if (kFullConeUntested == result) {
+                        *untested += 1;
+                    }
+                    part((kIsFullCone == result) ? &endpoint2 : nullptr);
+                });
+            });
+        }
+    }
+
+    // A relay through a server that is down proves nothing, the servers
+    // from |nextUnknown| on are tried instead
+    void onFullConeResult(int result, size_t nextUnknown) {
+        if (kIsFullCone == result) {
+            LOGI << "FULL CONE NAT!";
+            conclude("FULL CONE NAT");
+            return;
+        }
+        if (kFullConeUntested == result) {
+            if (nextUnknown < m_svrList.size()) {
+                decide("server unavailable");
+                checkIfFullConeNat(nextUnknown);
+                return;
+            }
+            LOGW << "no server available to check FULL CONE NAT";
+            conclude("servers unavailable");
+            return;
+        }
+        decide("not FULL CONE");
+        checkIfSymmetricNat();
     }
 
     void checkIfSymmetricNat() {
         if (m_svrList.size() < 2) {
             LOGW << "you must specify more than TWO servers with public IP "
                     "address for checking SYMMETRIC NAT";
-            m_udpSvc.shutdown([](){});
+            conclude("too few servers");
             return;
         }
         LOGI << "check SYMMETRIC NAT";
-        CheckSymmetricNatContext* ctx = new CheckSymmetricNatContext;
-        ctx->myAddrList.reserve(m_svrList.size());
-        ctx->finishedTasks = 0;
+        beginStage("symmetric");
+        WhenAll<Endpoint> all([this](
+                        const std::vector<const Endpoint*>& myAddrList) {
+            onSymmetricResult(myAddrList);
+        });
         for (const IpPort& addr : m_svrList) {
             Endpoint endpoint(AF_INET, addr.ip, addr.port);
-            new GetAddrTask(*this, endpoint, [this, ctx](
-                                                const Endpoint* myAddr) {
-                ctx->finishedTasks += 1;
-                if (nullptr != myAddr) {
-                    ctx->myAddrList.emplace_back(*myAddr);
-                }
-                if (ctx->finishedTasks == m_svrList.size()) {
-                    bool isSymmetricNat = false;
-                    std::map<std::string, std::set<uint16_t>> ipPorts;
-                    for (const Endpoint& ep : ctx->myAddrList) {
-                        std::set<uint16_t>& portSet = ipPorts[ep.ip()];
-                        portSet.insert(ep.port());
-                        if (portSet.size() >= 2) {
-                            LOGI << "SYMMETRIC NAT!";
-                            isSymmetricNat = true;
-                            break;
-                        }
-                    }
-
-                    delete ctx;
-
-                    if (!isSymmetricNat) {
-                        if (ipPorts.size() > 1) {
-                            LOGI << "host has " << ipPorts.size() 
-                                 << " different IPs. SYMMETRIC NAT!";
-                            isSymmetricNat = true;
-                        }
-                    }
-                    if (!isSymmetricNat) {
-                        checkIfRestrictedConeNat();
-                    } else {
-                        m_udpSvc.shutdown([](){});
-                    }
-                }
+            all.add([this, endpoint](const WhenAll<Endpoint>::Part& part) {
+                getAddr(endpoint, WhenAll<Endpoint>::Part(part));
             });
         }
     }
 
-    void checkIfRestrictedConeNat() {
-        LOGI << "check [PORT] RESTRICTED CONE NAT";
-        const IpPort& addr = m_svrList[0];
-        Endpoint endpoint(AF_INET, addr.ip, addr.port);
-        new CheckRestrictedConeTask(*this, endpoint, [this](int natType) {
-            if (kRestrictedCone == natType) {
-                LOGI << "RESTRICTED CONE NAT!";
-            } else {
-                LOGI << "PORT RESTRICTED CONE NAT!";
+    // |myAddrList| holds the address each server saw, nullptr where one
+    // did not answer
+    void onSymmetricResult(const std::vector<const Endpoint*>& myAddrList) {
+        bool isSymmetricNat = false;
+        std::map<EndpointKey, std::set<uint16_t>> ipPorts;
+        for (const Endpoint* ep : myAddrList) {
+            if (nullptr == ep) {
+                continue;
             }
-            m_udpSvc.shutdown([](){});
+            std::set<uint16_t>& portSet = ipPorts[ep->key().hostOnly()];
+            portSet.insert(ep->port());
+            if (portSet.size() >= 2) {
+                LOGI << "SYMMETRIC NAT!";
+                isSymmetricNat = true;
+                break;
+            }
+        }
+        if (!isSymmetricNat) {
+            if (ipPorts.size() > 1) {
+                LOGI << "host has " << ipPorts.size() 
+                     << " different IPs. SYMMETRIC NAT!";
+                isSymmetricNat = true;
+            }
+        }
+        if (!isSymmetricNat) {
+            decide("not SYMMETRIC");
+            checkIfRestrictedConeNat();
+        } else {
+            conclude("SYMMETRIC NAT");
+        }
+    }
+
+    void checkIfRestrictedConeNat() {
+        Endpoint endpoint = fastestServer();
+        LOGI << "check [PORT] RESTRICTED CONE NAT through " << endpoint;
+        beginStage("restricted cone");
+        checkRestrictedCone(endpoint, [this](int natType) {
+            reportRestrictedCone(natType);
         });
     }
+
+    void reportRestrictedCone(int natType) {
+        if (kRestrictedCone == natType) {
+            LOGI << "RESTRICTED CONE NAT!";
+            conclude("RESTRICTED CONE NAT");
+        } else {
+            LOGI << "PORT RESTRICTED CONE NAT!";
+            conclude("PORT RESTRICTED CONE NAT");
+        }
+    }
 };
 
 // -----------------------------------------------------------------------------
-// Section: GetAddrTask implementation
+// Section: ProbeTask implementation
 // -----------------------------------------------------------------------------
 // static
-void GetAddrTask::onTimeout(uv_timer_t* handle) {
-    GetAddrTask* self = CONTAINER_OF(handle, GetAddrTask, m_timer);
-    if (self->m_tryCount < kMaxGetAddrCount) {
+template <typename Request, typename Matcher, typename Result>
+ProbeTask<Request, Matcher, Result>* 
+ProbeTask<Request, Matcher, Result>::start(Client& client, 
+                                           const Request& request, 
+                                           Completion&& completion) {
+    void* block = client.m_probePool.allocate(sizeof(ProbeTask));
+    return new (block) ProbeTask(client, request, std::move(completion));
+}
+
+// static
+template <typename Request, typename Matcher, typename Result>
+void ProbeTask<Request, Matcher, Result>::onTimeout(uv_timer_t* handle) {
+    ProbeTask* self = CONTAINER_OF(handle, ProbeTask, m_timer);
+    if (self->m_tryCount < Request::kMaxTries) {
         self->send();
         self->m_tryCount += 1;
+        uint64_t timeout = self->retransmitMillis();
+        Client::traceSend(self->m_span, self->m_tryCount, timeout);
+        uv_timer_start(handle, onTimeout, timeout, 0);
     } else {
-        LOGW << "failed to get address from " << self->m_svr;
-        self->m_completionHandler(nullptr);
+        Timeline::event(self->m_span, "timeout");
         self->stop();
+        self->m_completion(nullptr);
     }
 }
 
 // static
-void GetAddrTask::onCloseHandle(uv_handle_t* handle) {
-    GetAddrTask* self = CONTAINER_OF(handle, GetAddrTask, m_timer);
-    delete self;
+template <typename Request, typename Matcher, typename Result>
+void ProbeTask<Request, Matcher, Result>::onCloseHandle(uv_handle_t* handle) {
+    ProbeTask* self = CONTAINER_OF(handle, ProbeTask, m_timer);
+    ProbePool& pool = self->m_client.m_probePool;
+    self->~ProbeTask();
+    pool.release(self, sizeof(ProbeTask));
 }
 
-GetAddrTask::GetAddrTask(Client& client, const Endpoint& svr,
-                         CompletionHandler&& handler)
-    : m_client(client), m_svr(svr), m_tryCount(0)
-    , m_completionHandler(std::move(handler)) {
+template <typename Request, typename Matcher, typename Result>
+ProbeTask<Request, Matcher, Result>::ProbeTask(Client& client, 
+                                               const Request& request, 
+                                               Completion&& completion)
+    : m_client(client), m_request(request), m_tryCount(0)
+    , m_txid(client.newTxid()), m_sentNanos(0)
+    , m_span(Timeline::begin("task", spanName(messageName(Request::kId), 
+                                              request.svr)))
+    , m_completion(std::move(completion)) {
     uv_timer_init(&client.m_loop, &m_timer);
-    uv_timer_start(&m_timer, onTimeout, 0, kGetAddrIntervalMillis);
+    uv_timer_start(&m_timer, onTimeout, 0, 0);
     m_client.m_udpSvc.addMessageHandler(this);
+    m_client.addProbe(this);
 }
 
-void GetAddrTask::handleMessage(UdpService& udpSvc, const Endpoint& peer, 
-                                const char* data, int size) {
-    MessageId msgId = MessageId(data[0]);
-    if ( (MessageId::ADDR == msgId) && (peer == m_svr) ) {
-        const struct sockaddr* sa = (const struct sockaddr*)(data + 1);
-        Endpoint myAddr(sa);
-        LOGI << "recv ADDR from " << peer << ", my address is " << myAddr;
-        m_completionHandler(&myAddr);
+template <typename Request, typename Matcher, typename Result>
+void ProbeTask<Request, Matcher, Result>::cancel() {
+    Timeline::event(m_span, "cancel");
+    stop();
+}
+
+template <typename Request, typename Matcher, typename Result>
+void ProbeTask<Request, Matcher, Result>::handleMessage(
+        UdpService& udpSvc, const Endpoint& peer, const char* data, int size, 
+        uint64_t recvNanos) {
+    wire::Reader reader;
+    if (!reader.init(data, size)) {
+        return;
+    }
+    if (wire::kLegacy != reader.version() && reader.txid() != m_txid) {
+        return;
+    }
+    wire::MessageView msg;
+    Result result;
+    while (reader.next(msg)) {
+        if (!Matcher::match(m_request, peer, msg, result)) {
+            continue;
+        }
+        m_client.settleWireVersion(reader.version());
+        Client::traceReply(m_span, messageName(msg.id), peer, m_sentNanos, 
+                           recvNanos);
+        if (1 == m_tryCount && peer == m_request.svr) {
+            m_client.sampleRtt(m_request.svr, m_sentNanos, recvNanos);
+        }
         stop();
+        m_completion(&result);
+        return;
     }
 }
 
-void GetAddrTask::send() {
-    LOGD << "send GETADDR to " << m_svr;
-    char buf[1];
-    buf[0] = char(MessageId::GETADDR);
-    m_client.m_udpSvc.send(m_svr, buf, 1);
+template <typename Request, typename Matcher, typename Result>
+void ProbeTask<Request, Matcher, Result>::send() {
+    LOGD << "send " << messageName(Request::kId) << " to " << m_request.svr;
+    char buf[wire::kMaxDatagramSize];
+    wire::Writer writer(buf, sizeof(buf), 
+                        m_client.wireVersion(m_tryCount), m_txid);
+    m_request.encode(writer);
+    m_sentNanos = uv_hrtime();
+    m_client.m_udpSvc.send(m_request.svr, writer.data(), writer.size());
+}
+
+template <typename Request, typename Matcher, typename Result>
+uint64_t ProbeTask<Request, Matcher, Result>::retransmitMillis() const {
+    uint64_t rto = m_client.rtoMillis(m_request.svr, 
+                                      Request::kMaxIntervalMillis);
+    Endpoint via = m_request.via();
+    if (via.family() != 0) {
+        rto += m_client.rtoMillis(via, Request::kMaxIntervalMillis);
+    }
+    return Client::retransmitMillis(rto, m_tryCount, 
+                                    Request::kMaxIntervalMillis);
 }
 
-void GetAddrTask::stop() {
+template <typename Request, typename Matcher, typename Result>
+void ProbeTask<Request, Matcher, Result>::stop() {
+    Timeline::end(m_span);
     uv_timer_stop(&m_timer);
     uv_close((uv_handle_t*)&m_timer, onCloseHandle);
     m_client.m_udpSvc.removeMessageHandler(this);
+    m_client.removeProbe(this);
 }
 
 // -----------------------------------------------------------------------------
-// Section: CheckFullConeTask implementation
+// Section: BatchProbeTask implementation
 // -----------------------------------------------------------------------------
 // static
-void CheckFullConeTask::onTimeout(uv_timer_t* handle) {
-    CheckFullConeTask* self = CONTAINER_OF(handle, CheckFullConeTask, m_timer);
-    if (self->m_tryCount < kMaxChkFullConeCount) {
+void BatchProbeTask::onTimeout(uv_timer_t* handle) {
+    BatchProbeTask* self = CONTAINER_OF(handle, BatchProbeTask, m_timer);
+    if (self->m_tryCount < kMaxBatchProbeCount) {
         self->send();
         self->m_tryCount += 1;
+        uint64_t timeout = self->retransmitMillis();
+        Client::traceSend(self->m_span, self->m_tryCount, timeout);
+        uv_timer_start(handle, onTimeout, timeout, 0);
     } else {
-        self->m_completionHandler(false);
-        self->stop();
+        Timeline::event(self->m_span, "timeout");
+        if (!self->m_gotAddr) {
+            LOGW << "failed to get address from " << self->m_svr;
+        }
+        self->finish();
     }
 }
 
 // static
-void CheckFullConeTask::onCloseHandle(uv_handle_t* handle) {
-    CheckFullConeTask* self = CONTAINER_OF(handle, CheckFullConeTask, m_timer);
+void BatchProbeTask::onCloseHandle(uv_handle_t* handle) {
+    BatchProbeTask* self = CONTAINER_OF(handle, BatchProbeTask, m_timer);
     delete self;
 }
 
-CheckFullConeTask::CheckFullConeTask(Client& client, 
-                                     const Endpoint& svr, 
-                                     const Endpoint& svrUnknown, 
-                                     CompletionHandler&& handler)
+BatchProbeTask::BatchProbeTask(Client& client, 
+                               const Endpoint& svr, 
+                               const Endpoint& svrUnknown, 
+                               CompletionHandler&& handler)
     : m_client(client), m_svr(svr), m_svrUnknown(svrUnknown), m_tryCount(0)
+    , m_txid(client.newTxid()), m_sentNanos(0)
+    , m_span(Timeline::begin("task", spanName("batch probe", svr)))
+    , m_version(wire::kCurrentVersion)
+    , m_gotAddr(false), m_gotFullCone(false), m_peerUnavailable(false)
     , m_completionHandler(std::move(handler)) {
     uv_timer_init(&client.m_loop, &m_timer);
-    uv_timer_start(&m_timer, onTimeout, 0, kChkFullConeIntervalMillis);
+    uv_timer_start(&m_timer, onTimeout, 0, 0);
     m_client.m_udpSvc.addMessageHandler(this);
+    m_client.addProbe(this);
 }
 
-void CheckFullConeTask::handleMessage(UdpService& udpSvc, const Endpoint& peer, 
-                                      const char* data, int size) {
-    MessageId msgId = MessageId(data[0]);
-    if ( (MessageId::FULLCONE == msgId) && (peer == m_svrUnknown) ) {
-        stop();
-        m_completionHandler(true);
+void BatchProbeTask::handleMessage(UdpService& udpSvc, const Endpoint& peer, 
+                                   const char* data, int size,
+                                   uint64_t recvNanos) {
+    wire::Reader reader;
+    if (!reader.init(data, size)) {
+        return;
+    }
+    bool legacy = (wire::kLegacy == reader.version());
+    if (!legacy && reader.txid() != m_txid) {
+        return;
+    }
+    bool updated = false;
+    wire::MessageView msg;
+    while (reader.next(msg)) {
+        if (MessageId::ADDR == msg.id && !m_gotAddr && peer == m_svr) {
+            if (!msg.addr(m_myAddr)) {
+                LOGW << "invalid ADDR from " << peer;
+                continue;
+            }
+            LOGI << "recv ADDR from " << peer 
+                 << ", my address is " << m_myAddr;
+            Client::traceReply(m_span, "ADDR", peer, m_sentNanos, recvNanos);
+            if (1 == m_tryCount) {
+                m_client.sampleRtt(m_svr, m_sentNanos, recvNanos);
+            }
+            m_gotAddr = true;
+            m_version = reader.version();
+            m_client.settleWireVersion(m_version);
+            updated = true;
+        } else if (legacy) {
+            // legacy answers carry no txid, only ADDR can be attributed
+            continue;
+        } else if (MessageId::FULLCONE == msg.id && !m_gotFullCone && 
+                   m_svrUnknown.family() != 0 && peer == m_svrUnknown) {
+            LOGD << "recv FULLCONE from " << peer;
+            Client::traceReply(m_span, "FULLCONE", peer, m_sentNanos, 
+                               recvNanos);
+            m_gotFullCone = true;
+            updated = true;
+        } else if (MessageId::PEER_UNAVAILABLE == msg.id && 
+                   !m_gotFullCone && !m_peerUnavailable && peer == m_svr) {
+            LOGW << "recv PEER_UNAVAILABLE from " << peer << ", " 
+                 << m_svrUnknown << " is down";
+            Timeline::event(m_span, "peer unavailable");
+            m_peerUnavailable = true;
+            updated = true;
+        }
+    }
+    if (updated) {
+        checkDone();
     }
 }
 
-void CheckFullConeTask::send() {
-    LOGD << "send CHKFULLCONE to " << m_svr;
-    char buf[1 + sizeof(struct sockaddr_in6)];
-    memset(buf, 0, sizeof(buf));
-    buf[0] = char(MessageId::CHKFULLCONE);
-    int size = m_svrUnknown.serializeToArray(
-                buf + 1, sizeof(struct sockaddr_in6));
-    m_client.m_udpSvc.send(m_svr, buf, 1 + size);
+void BatchProbeTask::send() {
+    char buf[wire::kMaxDatagramSize];
+    int version = m_client.wireVersion(m_tryCount);
+    wire::Writer writer(buf, sizeof(buf), version, m_txid);
+    if (!m_gotAddr) {
+        writer.add(MessageId::GETADDR);
+    }
+    if (wire::kLegacy != version && m_svrUnknown.family() != 0 && 
+            !m_gotFullCone && !m_peerUnavailable) {
+        writer.add(MessageId::CHKFULLCONE, m_svrUnknown);
+    }
+    if (writer.empty()) {
+        return;
+    }
+    LOGD << "send batch probe to " << m_svr;
+    m_sentNanos = uv_hrtime();
+    m_client.m_udpSvc.send(m_svr, writer.data(), writer.size());
 }
 
-void CheckFullConeTask::stop() {
-    uv_timer_stop(&m_timer);
-    uv_close((uv_handle_t*)&m_timer, onCloseHandle);
-    m_client.m_udpSvc.removeMessageHandler(this);
+uint64_t BatchProbeTask::retransmitMillis() const {
+    // FULLCONE comes back through a second server
+    uint64_t rto = m_client.rtoMillis(m_svr, kBatchProbeIntervalMillis);
+    if (m_svrUnknown.family() != 0) {
+        rto += m_client.rtoMillis(m_svrUnknown, kBatchProbeIntervalMillis);
+    }
+    return Client::retransmitMillis(rto, m_tryCount, 
+                                    kBatchProbeIntervalMillis);
 }
 
-// -----------------------------------------------------------------------------
-// Section: CheckRestrictedConeTask
-// -----------------------------------------------------------------------------
-// static
-void CheckRestrictedConeTask::onTimeout(uv_timer_t* handle) {
-    CheckRestrictedConeTask* self = 
-            CONTAINER_OF(handle, CheckRestrictedConeTask, m_timer);
-    if (self->m_tryCount < kMaxChkRestrictedConeCount) {
-        self->send();
-        self->m_tryCount += 1;
-    } else {
-        self->m_completionHandler(kPortRestrictedCone);
-        self->stop();
+void BatchProbeTask::checkDone() {
+    if (!m_gotAddr) {
+        return;
+    }
+    if (wire::kLegacy == m_version || m_client.isLocalAddress(m_myAddr) || 
+            m_gotFullCone || m_peerUnavailable || 
+            m_svrUnknown.family() == 0) {
+        finish();
     }
 }
 
-void CheckRestrictedConeTask::onCloseHandle(uv_handle_t* handle) {
-    CheckRestrictedConeTask* self = 
-            CONTAINER_OF(handle, CheckRestrictedConeTask, m_timer);
-    delete self;
+void BatchProbeTask::finish() {
+    BatchProbeResult result;
+    result.myAddr = m_gotAddr ? &m_myAddr : nullptr;
+    result.version = m_version;
+    result.fullCone = m_gotFullCone ? kIsFullCone : 
+            (m_peerUnavailable ? kFullConeUntested : kNotFullCone);
+    stop();
+    m_completionHandler(result);
 }
 
-CheckRestrictedConeTask::CheckRestrictedConeTask(Client& client, 
-                                                 const Endpoint& svr, 
-                                                 CompletionHandler&& handler)
-    : m_client(client), m_svr(svr), m_tryCount(0)
-    , m_completionHandler(std::move(handler)) {
-    uv_timer_init(&client.m_loop, &m_timer);
-    uv_timer_start(&m_timer, onTimeout, 0, kChkRestrictedConeIntervalMillis);
-    m_client.m_udpSvc.addMessageHandler(this);
+void BatchProbeTask::cancel() {
+    Timeline::event(m_span, "cancel");
+    stop();
 }
 
+void BatchProbeTask::stop() {
+    Timeline::end(m_span);
+    uv_timer_stop(&m_timer);
+    uv_close((uv_handle_t*)&m_timer, onCloseHandle);
+    m_client.m_udpSvc.removeMessageHandler(this);
+    m_client.removeProbe(this);
+}
 
-void CheckRestrictedConeTask::handleMessage(UdpService& udpSvc, 
-                                            const Endpoint& peer, 
-                                            const char* data, 
-                                            int size) {
-    MessageId msgId = MessageId(data[0]);
-    if ( (MessageId::RESTRICTEDCONE == msgId) && (peer == m_svr) ) {
-        stop();
-        m_completionHandler(kRestrictedCone);
+// -----------------------------------------------------------------------------
+// Section: uplink survey
+// -----------------------------------------------------------------------------
+// Whether datagrams from |ip| to |svr| leave through interface |device|:
+// surely if a socket can be bound to it, otherwise only if the route to
+// |svr| picks |ip| as its source. Without policy routing every socket
+// takes the route of the destination, whichever address it is bound to.
+// |source| gets the source of that route.
+static bool egressMatches(const std::string& device, const std::string& ip, 
+                          const IpPort& svr, std::string& source) {
+    source = ip;
+#ifdef __linux__
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return true;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, device.c_str(), 
+                   socklen_t(device.size())) == 0) {
+        ::close(fd);
+        return true;
+    }
+    Endpoint dest(AF_INET, svr.ip, svr.port);
+    struct sockaddr_storage sa;
+    socklen_t len = sizeof(sa);
+    // a connected UDP socket has its route looked up, nothing is sent
+    if (connect(fd, dest.sockaddr(), sizeof(struct sockaddr_in)) == 0 && 
+            getsockname(fd, (struct sockaddr*)&sa, &len) == 0) {
+        source = Endpoint((const struct sockaddr*)&sa).ip();
     }
+    ::close(fd);
+#endif
+    return source == ip;
 }
 
-void CheckRestrictedConeTask::send() {
-    LOGD << "send CHKRESTRICTEDCONE to " << m_svr;
-    char buf[1];
-    buf[0] = char(MessageId::CHKRESTRICTEDCONE);
-    m_client.m_udpSvc.send(m_svr, buf, 1);
-}
+// Classifies every uplink of a multi-homed host at once: a Client with a
+// socket of its own per IPv4 interface address that is not loopback, all
+// on loop 0 of |group|, bound to |port| of each and to the interface. The
+// table of verdicts goes to stdout once the last one is in, or its
+// deadline passed, and then every client is closed so the loop runs out.
+// |clients| owns them, to be deleted after the group is joined. False if
+// there is no such address.
+static bool surveyUplinks(LoopGroup& group, const InterfaceMap& interfaces, 
+                          uint16_t port, const std::vector<IpPort>& svrList, 
+                          int wireVersion, uint64_t deadlineMillis,
+                          std::vector<std::unique_ptr<Client>>& clients) {
+    std::vector<std::string> names;
+    std::vector<std::string> addrs;
+    std::vector<std::string> notes;
+    for (auto it = interfaces.begin(); it != interfaces.end(); ++it) {
+        const InterfaceAddress& ia = it->second;
+        if (ia.internal) {
+            continue;
+        }
+        for (const Endpoint& addr : ia.addrs4) {
+            std::string source;
+            std::string note;
+            if (!egressMatches(ia.name, addr.ip(), svrList[0], source)) {
+                LOGW << "cannot bind to " << ia.name << " and the route to " 
+                     << svrList[0].ip << " leaves from " << source 
+                     << ", the verdict for " << addr.ip() 
+                     << " may describe that uplink";
+                note = " (routed from " + source + ")";
+            }
+            names.push_back(ia.name);
+            addrs.push_back(addr.ip());
+            notes.push_back(note);
+        }
+    }
+    if (addrs.empty()) {
+        LOGE << "no interface with an IPv4 address to classify";
+        return false;
+    }
+    LOGI << "classifying " << addrs.size() << " uplink(s)";
 
-void CheckRestrictedConeTask::stop() {
-    uv_timer_stop(&m_timer);
-    uv_close((uv_handle_t*)&m_timer, onCloseHandle);
-    m_client.m_udpSvc.removeMessageHandler(this);
+    // clients past their deadline still have probes running
+    WhenAll<std::string> all([&clients, names, addrs, notes](
+                    const std::vector<const std::string*>& verdicts) {
+        printf("%-16s %-16s %s\n", "interface", "address", "verdict");
+        for (size_t i = 0; i < verdicts.size(); i++) {
+            printf("%-16s %-16s %s%s\n", names[i].c_str(), addrs[i].c_str(), 
+                   verdicts[i] ? verdicts[i]->c_str() : "-", 
+                   notes[i].c_str());
+        }
+        fflush(stdout);
+        for (std::unique_ptr<Client>& client : clients) {
+            client->close();
+        }
+    });
+    for (size_t i = 0; i < addrs.size(); i++) {
+        Endpoint listenAddr(AF_INET, addrs[i], port);
+        all.add([&](const WhenAll<std::string>::Part& part) {
+            clients.emplace_back(new Client(
+                    group.loop(0), listenAddr, names[i], interfaces, svrList, 
+                    wireVersion, false, deadlineMillis, 
+                    [part](const char* verdict) {
+                std::string v(verdict);
+                part(&v);
+            }));
+        });
+    }
+    return true;
 }
 
 // -----------------------------------------------------------------------------
@@ -491,6 +1537,13 @@ void CheckRestrictedConeTask::stop() {
 int main(int argc, char* argv[]) {
     std::string listenAddrStr;
     std::string svrAddrListStr;
+    int wireVersion = kWireAuto;
+    std::string traceFile;
+    uint64_t traceRecords = kDefaultTraceRecords;
+    bool statsOnly = false;
+    std::string timelineFile;
+    bool allInterfaces = false;
+    int deadlineMillis = kDefaultSurveyDeadlineMillis;
     int opt;
     while ( (opt = longopt(argc, argv, kOptions)) != LONGOPT_DONE ) {
         if (LONGOPT_NEED_PARAM == opt) {
@@ -508,6 +1561,45 @@ int main(int argc, char* argv[]) {
         case 2:
             svrAddrListStr = optparam;
             break;
+        case 3:
+            if (strcmp(optparam, "auto") == 0) {
+                wireVersion = kWireAuto;
+            } else if (strcmp(optparam, "0") == 0) {
+                wireVersion = wire::kLegacy;
+            } else if (strcmp(optparam, "1") == 0) {
+                wireVersion = wire::kVersion1;
+            } else {
+                LOGE << "invalid wire version " << optparam;
+                return 1;
+            }
+            break;
+        case 4: {
+            int level = TRACE;
+            if (!logging::parseLevel(optparam, level)) {
+                LOGE << "invalid log level " << optparam;
+                return 1;
+            }
+            logging::setLevel(level);
+            break;
+        }
+        case 5:
+            traceFile = optparam;
+            break;
+        case 6:
+            traceRecords = strtoull(optparam, NULL, 10);
+            break;
+        case 7:
+            statsOnly = true;
+            break;
+        case 8:
+            timelineFile = optparam;
+            break;
+        case 9:
+            allInterfaces = true;
+            break;
+        case 10:
+            deadlineMillis = atoi(optparam);
+            break;
         }
     }
 
@@ -515,6 +1607,10 @@ int main(int argc, char* argv[]) {
         print_opt(kOptions);
         return 1;
     }
+    if (statsOnly && allInterfaces) {
+        LOGE << "--stats and --all-interfaces exclude each other";
+        return 1;
+    }
 
     IpPort listenAddr;
     if (listenAddrStr.empty()) {
@@ -531,24 +1627,57 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    uv_loop_t mainloop;
-    uv_loop_init(&mainloop);
+    // always on; the ring stays in memory and -t only decides whether it
+    // ends up in a file
+    PacketTrace* trace = nullptr;
+    if (traceRecords > 0) {
+        trace = PacketTrace::open(std::string(), traceRecords);
+        if (nullptr == trace) {
+            return 1;
+        }
+        PacketTrace::install(trace);
+    }
 
-    AsyncHandler handler(mainloop);
+    Timeline* timeline = nullptr;
+    if (!timelineFile.empty()) {
+        timeline = Timeline::open(timelineFile);
+        if (nullptr == timeline) {
+            return 1;
+        }
+        Timeline::install(timeline);
+    }
 
-    std::thread t([&mainloop]() {
-        uv_run(&mainloop, UV_RUN_DEFAULT);
-        LOGD << "mainloop exied";
-    });
+    InterfaceMap interfaces;
+    if (!statsOnly) {
+        Client::queryInterfaceAddresses(interfaces);
+    }
 
-    handler.post([&]() {
+    // runs until the clients are closed and have left nothing on the loop
+    LoopGroup group(1);
+    std::vector<std::unique_ptr<Client>> clients;
+    if (allInterfaces) {
+        if (!surveyUplinks(group, interfaces, listenAddr.port, svrAddrList, 
+                           wireVersion, uint64_t(std::max(deadlineMillis, 0)),
+                           clients)) {
+            return 1;
+        }
+    } else {
         Endpoint endpoint(AF_INET, listenAddr.ip, listenAddr.port);
-        new Client(mainloop, endpoint, svrAddrList);
-        handler.shutdown([](){});
-    });
+        clients.emplace_back(new Client(group.loop(0), endpoint, std::string(), 
+                                        interfaces, svrAddrList, wireVersion, 
+                                        statsOnly));
+    }
+    group.start();
+    group.join();
+    clients.clear();
 
-    t.join();
-    uv_loop_close(&mainloop);
+    PacketTrace::install(nullptr);
+    if (nullptr != trace && !traceFile.empty()) {
+        trace->save(traceFile);
+    }
+    delete trace;
+    Timeline::install(nullptr);
+    delete timeline;
 
     return 0;
 }
@@ -1,5 +1,6 @@
 #include "endpoint.h"
 #include <string.h>
+#include <stdio.h>
 
 Endpoint::Endpoint() {
   memset(&m_sockAddr, 0, sizeof(m_sockAddr));
@@ -16,9 +17,9 @@ Endpoint::Endpoint(const struct sockaddr* addr) {
 bool Endpoint::init(int af, const std::string& ip, uint16_t port) {
     m_sockAddr.s.sa_family = af;
     if (AF_INET == af) {
-        uv_ip4_addr(ip.c_str(), port, &m_sockAddr.v4);
+        return (0 == uv_ip4_addr(ip.c_str(), port, &m_sockAddr.v4));
     } else if (AF_INET6 == af) {
-        uv_ip6_addr(ip.c_str(), port, &m_sockAddr.v6);
+        return (0 == uv_ip6_addr(ip.c_str(), port, &m_sockAddr.v6));
     }
     return false;
 }
@@ -27,28 +28,57 @@ bool Endpoint::init(const struct sockaddr* addr) {
     m_sockAddr.s.sa_family = addr->sa_family;
     if (AF_INET == addr->sa_family) {
         memcpy(&m_sockAddr.v4, addr, sizeof(struct sockaddr_in));
+        return true;
     } else if (AF_INET6 == addr->sa_family) {
         memcpy(&m_sockAddr.v6, addr, sizeof(struct sockaddr_in6));
+        return true;
     }
     return false;
 }
 
-const std::string& Endpoint::ip() const {
-    if (!m_ip.empty()) {
-        return m_ip;
+bool Endpoint::init(const EndpointKey& key) {
+    memset(&m_sockAddr, 0, sizeof(m_sockAddr));
+    if (AF_INET == key.family) {
+        m_sockAddr.v4.sin_family = AF_INET;
+        m_sockAddr.v4.sin_port = htons(key.port);
+        memcpy(&m_sockAddr.v4.sin_addr, key.addr, 4);
+        return true;
+    } else if (AF_INET6 == key.family) {
+        m_sockAddr.v6.sin6_family = AF_INET6;
+        m_sockAddr.v6.sin6_port = htons(key.port);
+        memcpy(&m_sockAddr.v6.sin6_addr, key.addr, 16);
+        return true;
     }
+    return false;
+}
+
+std::string Endpoint::ip() const {
+    char buf[INET6_ADDRSTRLEN];
+    memset(buf, 0, sizeof(buf));
     if (AF_INET == m_sockAddr.s.sa_family) {
-        char buf[INET_ADDRSTRLEN];
-        memset(buf, 0, sizeof(buf));
         inet_ntop(AF_INET, (void*)&m_sockAddr.v4.sin_addr, buf, sizeof(buf));
-        m_ip = buf;
     } else if (AF_INET6 == m_sockAddr.s.sa_family) {
-        char buf[INET6_ADDRSTRLEN];
-        memset(buf, 0, sizeof(buf));
         inet_ntop(AF_INET6, (void*)&m_sockAddr.v6.sin6_addr, buf, sizeof(buf));
-        m_ip = buf;
     }
-    return m_ip;
+    return std::string(buf);
+}
+
+int Endpoint::format(char* buf, int size) const {
+    if (size <= 0) {
+        return 0;
+    }
+    buf[0] = '\0';
+    if (AF_INET == m_sockAddr.s.sa_family) {
+        inet_ntop(AF_INET, (void*)&m_sockAddr.v4.sin_addr, buf, size);
+    } else if (AF_INET6 == m_sockAddr.s.sa_family) {
+        inet_ntop(AF_INET6, (void*)&m_sockAddr.v6.sin6_addr, buf, size);
+    }
+    int len = (int)strlen(buf);
+    int retval = snprintf(buf + len, size - len, ":%u", (unsigned)port());
+    if (retval < 0) {
+        return len;
+    }
+    return (len + retval < size) ? (len + retval) : (size - 1);
 }
 
 uint16_t Endpoint::port() const {
@@ -81,6 +111,21 @@ const struct sockaddr_in6* Endpoint::v6() const {
     return ( (AF_INET6 == m_sockAddr.s.sa_family) ? &m_sockAddr.v6 : NULL );
 }
 
+bool Endpoint::loopback() const {
+    EndpointKey k = key();
+    if (AF_INET == k.family) {
+        return 127 == k.addr[0];
+    } else if (AF_INET6 == k.family) {
+        static const uint8_t kLoopback6[16] = {
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 };
+        static const uint8_t kMappedPrefix[12] = {
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+        return 0 == memcmp(k.addr, kLoopback6, 16) ||
+               (0 == memcmp(k.addr, kMappedPrefix, 12) && 127 == k.addr[12]);
+    }
+    return false;
+}
+
 int Endpoint::serializeToArray(char* buf, int size) const {
     int sizeReq = 0;
     if (AF_INET == m_sockAddr.s.sa_family) {
@@ -98,11 +143,17 @@ int Endpoint::serializeToArray(char* buf, int size) const {
 }
 
 bool Endpoint::parseFromArray(const char* buf, int size) {
-    const struct sockaddr* sa = (const struct sockaddr*)buf;
+    if (size < (int)sizeof(struct sockaddr_in)) {
+        return false;
+    }
+    struct sockaddr_storage ss;
+    memset(&ss, 0, sizeof(ss));
+    memcpy(&ss, buf, 
+           (size < (int)sizeof(ss)) ? size : (int)sizeof(ss));
     int sizeReq = 0;
-    if (AF_INET == sa->sa_family) {
+    if (AF_INET == ss.ss_family) {
         sizeReq = sizeof(struct sockaddr_in);
-    } else if (AF_INET6 == sa->sa_family) {
+    } else if (AF_INET6 == ss.ss_family) {
         sizeReq = sizeof(struct sockaddr_in6);
     } else {
         return false;
@@ -110,5 +161,6 @@ bool Endpoint::parseFromArray(const char* buf, int size) {
     if (size < sizeReq) {
         return false;
     }
-    return init(sa);
-}
\ No newline at end of file
+    init((const struct sockaddr*)&ss);
+    return true;
+}
@@ -4,8 +4,53 @@
 #include "uv.h"
 #include <string>
 #include <iostream>
+#include <functional>
 #include <string.h>
 
+// Fixed-size, allocation-free identity of an Endpoint, suitable as a key of
+// hash tables and ordered containers. IPv4 addresses occupy the first four
+// bytes of |addr|, the remaining bytes are zero. Port is in host byte order.
+// IPv6 scope id and flow info are not part of the key.
+struct EndpointKey {
+    uint8_t family;     // AF_INET, AF_INET6 or 0 when unspecified
+    uint8_t reserved;
+    uint16_t port;
+    uint8_t addr[16];
+
+    // same address with port cleared, for grouping by host
+    EndpointKey hostOnly() const {
+        EndpointKey k = *this;
+        k.port = 0;
+        return k;
+    }
+
+    size_t hash() const {
+        uint64_t a, b;
+        uint32_t c;
+        memcpy(&a, this, sizeof(a));
+        memcpy(&b, (const char*)this + 8, sizeof(b));
+        memcpy(&c, (const char*)this + 16, sizeof(c));
+        uint64_t h = a * 0x9E3779B97F4A7C15ULL;
+        h ^= (b + 0x7F4A7C15ULL + (h << 6) + (h >> 2)) * 0xC2B2AE3D27D4EB4FULL;
+        h ^= (uint64_t(c) + (h << 6) + (h >> 2)) * 0x165667B19E3779F9ULL;
+        return size_t(h ^ (h >> 32));
+    }
+};
+
+static_assert(sizeof(EndpointKey) == 20, "EndpointKey must be 20 bytes");
+
+inline bool operator<(const EndpointKey& l, const EndpointKey& r) {
+    return memcmp(&l, &r, sizeof(EndpointKey)) < 0;
+}
+
+inline bool operator==(const EndpointKey& l, const EndpointKey& r) {
+    return 0 == memcmp(&l, &r, sizeof(EndpointKey));
+}
+
+inline bool operator!=(const EndpointKey& l, const EndpointKey& r) {
+    return !(l == r);
+}
+
 class Endpoint {
 public:
     typedef const struct sockaddr* ConstSockAddrPtr;
@@ -18,10 +63,22 @@ public:
 
     bool init(int af, const std::string& ip, uint16_t port);
     bool init(const struct sockaddr* addr);
+    bool init(const EndpointKey& key);
 
-    const std::string& ip() const;
+    // Formats the address on every call, intended for log sites only. Use
+    // key() for comparison and lookup.
+    std::string ip() const;
     uint16_t port() const;
 
+    int family() const {
+        return m_sockAddr.s.sa_family;
+    }
+
+    EndpointKey key() const;
+
+    // Writes "<ip>:<port>" into |buf| without allocating, returns the length
+    int format(char* buf, int size) const;
+
     ConstSockAddrPtr sockaddr() const;
     operator ConstSockAddrPtr();
     operator ConstSockAddrPtr() const;
@@ -29,6 +86,9 @@ public:
     const struct sockaddr_in* v4() const;
     const struct sockaddr_in6* v6() const;
 
+    // 127.0.0.0/8, ::1 or an IPv4-mapped 127.0.0.0/8
+    bool loopback() const;
+
     int serializeToArray(char* buf, int size) const;
     bool parseFromArray(const char* buf, int size);
 
@@ -41,34 +101,56 @@ private:
         struct sockaddr_in6 v6;
         struct sockaddr s;
     } m_sockAddr;
-    mutable std::string m_ip;
 };
 
-inline bool operator<(const Endpoint& l, const Endpoint& r) {
-    int retval = l.ip().compare(r.ip());
-    if (0 == retval) {
-        return (l.port() < r.port());
-    } else {
-        return (retval < 0);
+inline EndpointKey Endpoint::key() const {
+    EndpointKey k;
+    memset(&k, 0, sizeof(k));
+    if (AF_INET == m_sockAddr.s.sa_family) {
+        k.family = AF_INET;
+        k.port = ntohs(m_sockAddr.v4.sin_port);
+        memcpy(k.addr, &m_sockAddr.v4.sin_addr, 4);
+    } else if (AF_INET6 == m_sockAddr.s.sa_family) {
+        k.family = AF_INET6;
+        k.port = ntohs(m_sockAddr.v6.sin6_port);
+        memcpy(k.addr, &m_sockAddr.v6.sin6_addr, 16);
     }
+    return k;
+}
+
+inline bool operator<(const Endpoint& l, const Endpoint& r) {
+    return l.key() < r.key();
 }
 
 inline bool operator==(const Endpoint& l, const Endpoint& r) {
-    if (l.m_sockAddr.s.sa_family != r.m_sockAddr.s.sa_family) {
-        return false;
-    } else if (l.m_sockAddr.s.sa_family == AF_INET) {
-        return (0 == memcmp((const void*)&l.m_sockAddr.v4,
-                            (const void*)&r.m_sockAddr.v4,
-                            sizeof(struct sockaddr_in) ) );
-    } else if (l.m_sockAddr.s.sa_family == AF_INET6) {
-        return (0 == memcmp((const void*)&l.m_sockAddr.v6,
-                            (const void*)&r.m_sockAddr.v6,
-                            sizeof(struct sockaddr_in6) ) );
-    }
-    return false;
+    return l.key() == r.key();
+}
+
+inline bool operator!=(const Endpoint& l, const Endpoint& r) {
+    return !(l == r);
 }
 
 inline std::ostream& operator<<(std::ostream& os, const Endpoint& e) {
-    os << e.ip() << ":" << e.port();
+    char buf[INET6_ADDRSTRLEN + 8];
+    int len = e.format(buf, sizeof(buf));
+    os.write(buf, len);
     return os;
-}
\ No newline at end of file
+}
+
+namespace std {
+
+template <>
+struct hash<EndpointKey> {
+    size_t operator()(const EndpointKey& k) const {
+        return k.hash();
+    }
+};
+
+template <>
+struct hash<Endpoint> {
+    size_t operator()(const Endpoint& e) const {
+        return e.key().hash();
+    }
+};
+
+} // namespace std
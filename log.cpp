@@ -0,0 +1,378 @@
+#include "log.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <time.h>
+#include <stdio.h>
+
+namespace logging {
+
+static const uint32_t kRingCapacity = 1024;   // power of two
+static const int kMaxBatchBytes = 64 * 1024;
+// an idle writer waits for a wakeup, the timeout only covers a wakeup lost
+// to a producer that saw the writer busy a moment before it went idle
+static const int kMaxIdleWaitMillis = 50;
+
+std::atomic<int> g_level(TRACE);
+
+bool parseLevel(const char* name, int& level) {
+    static const char* kNames[] = {
+        "trace", "debug", "info", "warn", "error"
+    };
+    for (int i = TRACE; i <= ERROR; i++) {
+        if (strcmp(name, kNames[i]) == 0) {
+            level = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+struct LogRecord {
+    uint64_t timestampNanos;
+    const char* file;
+    const char* func;
+    int line;
+    int level;
+    int len;
+    char text[kMaxLogText];
+};
+
+// -----------------------------------------------------------------------------
+// Section: LogRing
+// -----------------------------------------------------------------------------
+// Single producer (the owning thread), single consumer (the writer thread)
+class LogRing {
+public:
+    LogRing() : m_head(0), m_tail(0), m_dropped(0), m_retired(false) {
+    }
+
+    bool push(int level, const char* file, int line, const char* func,
+              uint64_t timestampNanos, const char* text, int len) {
+        uint32_t head = m_head.load(std::memory_order_relaxed);
+        uint32_t tail = m_tail.load(std::memory_order_acquire);
+        if (head - tail >= kRingCapacity) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        LogRecord& r = m_records[head & (kRingCapacity - 1)];
+        r.timestampNanos = timestampNanos;
+        r.file = file;
+        r.func = func;
+        r.line = line;
+        r.level = level;
+        r.len = (len < kMaxLogText) ? len : kMaxLogText;
+        memcpy(r.text, text, r.len);
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    template <typename Visitor>
+    int drain(Visitor&& visit) {
+        uint32_t tail = m_tail.load(std::memory_order_relaxed);
+        uint32_t head = m_head.load(std::memory_order_acquire);
+        int count = 0;
+        while (tail != head) {
+            visit(m_records[tail & (kRingCapacity - 1)]);
+            tail += 1;
+            count += 1;
+            m_tail.store(tail, std::memory_order_release);
+        }
+        return count;
+    }
+
+    bool empty() const {
+        return m_head.load(std::memory_order_acquire) ==
+               m_tail.load(std::memory_order_acquire);
+    }
+
+    uint64_t dropped() const {
+        return m_dropped.load(std::memory_order_relaxed);
+    }
+
+    void retire() {
+        m_retired.store(true, std::memory_order_release);
+    }
+
+    bool retired() const {
+        return m_retired.load(std::memory_order_acquire);
+    }
+
+private:
+    std::atomic<uint32_t> m_head;
+    std::atomic<uint32_t> m_tail;
+    std::atomic<uint64_t> m_dropped;
+    std::atomic<bool> m_retired;
+    LogRecord m_records[kRingCapacity];
+};
+
+// -----------------------------------------------------------------------------
+// Section: LogBackend
+// -----------------------------------------------------------------------------
+class LogBackend {
+public:
+    static LogBackend& instance() {
+        static LogBackend s_backend;
+        return s_backend;
+    }
+
+    LogBackend()
+        : m_running(true), m_stopped(false), m_idle(false)
+        , m_droppedTotal(0), m_droppedReported(0), m_wakePending(false)
+        , m_exited(false), m_passes(0) {
+        m_thread = std::thread([this]() {
+            run();
+        });
+    }
+
+    ~LogBackend() {
+        m_running.store(false, std::memory_order_release);
+        wake();
+        m_thread.join();
+        m_stopped.store(true, std::memory_order_release);
+    }
+
+    bool stopped() const {
+        return m_stopped.load(std::memory_order_acquire);
+    }
+
+    LogRing* registerRing() {
+        LogRing* ring = new LogRing;
+        std::unique_lock<std::mutex> l(m_ringsMutex);
+        m_rings.push_back(ring);
+        return ring;
+    }
+
+    // Two full passes of the writer: the one under way may have missed
+    // records submitted before the call
+    void flush() {
+        std::unique_lock<std::mutex> l(m_wakeMutex);
+        uint64_t target = m_passes + 2;
+        m_wakePending = true;
+        m_wake.notify_one();
+        m_drained.wait(l, [this, target]() {
+            return m_passes >= target || m_exited;
+        });
+    }
+
+    // Called by producers after a push, cheap unless the writer is idle
+    void notify() {
+        if (m_idle.load()) {
+            wake();
+        }
+    }
+
+    uint64_t dropped() {
+        std::unique_lock<std::mutex> l(m_ringsMutex);
+        return m_droppedTotal + countDropped();
+    }
+
+private:
+    void wake() {
+        {
+            std::unique_lock<std::mutex> l(m_wakeMutex);
+            m_wakePending = true;
+        }
+        m_wake.notify_one();
+    }
+
+    void run() {
+        for (;;) {
+            bool running = m_running.load(std::memory_order_acquire);
+            int count = drainAll();
+            std::unique_lock<std::mutex> l(m_wakeMutex);
+            m_passes += 1;
+            m_drained.notify_all();
+            if (count > 0) {
+                continue;
+            }
+            if (!running) {
+                m_exited = true;
+                m_drained.notify_all();
+                break;
+            }
+            m_idle.store(true);
+            if (!m_wakePending && !pending()) {
+                m_wake.wait_for(l, std::chrono::milliseconds(
+                        kMaxIdleWaitMillis), [this]() {
+                    return m_wakePending;
+                });
+            }
+            m_wakePending = false;
+            m_idle.store(false);
+        }
+    }
+
+    bool pending() {
+        std::unique_lock<std::mutex> l(m_ringsMutex);
+        for (LogRing* ring : m_rings) {
+            if (!ring->empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    uint64_t countDropped() const {
+        uint64_t n = 0;
+        for (LogRing* ring : m_rings) {
+            n += ring->dropped();
+        }
+        return n;
+    }
+
+    // Formats under the lock into m_batch, which is swapped out and written
+    // after the lock is released, so registerRing() and dropped() never
+    // wait for the file
+    int drainAll() {
+        std::unique_lock<std::mutex> l(m_ringsMutex);
+        int count = 0;
+        for (auto it = m_rings.begin(); it != m_rings.end(); ) {
+            LogRing* ring = *it;
+            bool retired = ring->retired();
+            count += ring->drain([this](const LogRecord& r) {
+                format(r);
+            });
+            if (retired && ring->empty()) {
+                m_droppedTotal += ring->dropped();
+                delete ring;
+                it = m_rings.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        uint64_t dropped = m_droppedTotal + countDropped();
+        if (dropped != m_droppedReported) {
+            char line[128];
+            int len = snprintf(line, sizeof(line),
+                               "log: %llu record(s) dropped\n",
+                               (unsigned long long)(dropped -
+                                                    m_droppedReported));
+            append(line, len);
+            m_droppedReported = dropped;
+        }
+        m_writing.swap(m_batch);
+        l.unlock();
+        writeOut();
+        return count;
+    }
+
+    void format(const LogRecord& r) {
+        static const char* kLevelNames[] = {
+            "TRACE", "DEBUG", "INFO ", "WARN ", "ERROR"
+        };
+        time_t secs = time_t(r.timestampNanos / 1000000000ULL);
+        int micros = int( (r.timestampNanos % 1000000000ULL) / 1000 );
+        if (secs != m_cachedSecs) {
+            struct tm tm;
+            localtime_r(&secs, &tm);
+            snprintf(m_cachedTime, sizeof(m_cachedTime),
+                     "%04d/%02d/%02d %02d:%02d:%02d",
+                     tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                     tm.tm_hour, tm.tm_min, tm.tm_sec);
+            m_cachedSecs = secs;
+        }
+        const char* slashPos = strrchr(r.file, '/');
+        const char* level = (r.level >= TRACE && r.level <= ERROR) ?
+                kLevelNames[r.level] : "?????";
+        char prefix[256];
+        int len = snprintf(prefix, sizeof(prefix), "%s.%06d|%s|%s:%d|%s|",
+                           m_cachedTime, micros, level,
+                           slashPos ? slashPos + 1 : r.file, r.line, r.func);
+        if (len >= (int)sizeof(prefix)) {
+            len = sizeof(prefix) - 1;
+        }
+        append(prefix, len);
+        append(r.text, r.len);
+        append("\n", 1);
+    }
+
+    // A full batch is handed over while the lock is held; that happens only
+    // when a single pass formats more than kMaxBatchBytes
+    void append(const char* data, int len) {
+        if (m_batch.size() + len > (size_t)kMaxBatchBytes) {
+            m_writing.swap(m_batch);
+            writeOut();
+        }
+        m_batch.insert(m_batch.end(), data, data + len);
+    }
+
+    // Writer thread only
+    void writeOut() {
+        if (m_writing.empty()) {
+            return;
+        }
+        fwrite(m_writing.data(), 1, m_writing.size(), stdout);
+        fflush(stdout);
+        m_writing.clear();
+    }
+
+    std::atomic<bool> m_running;
+    std::atomic<bool> m_stopped;
+    std::atomic<bool> m_idle;           // writer waiting for a wakeup
+    std::mutex m_ringsMutex;
+    std::vector<LogRing*> m_rings;
+    uint64_t m_droppedTotal;
+    uint64_t m_droppedReported;
+    std::vector<char> m_batch;          // formatted, under m_ringsMutex
+    std::vector<char> m_writing;        // being written, writer thread only
+    std::mutex m_wakeMutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_drained;
+    bool m_wakePending;                 // the rest under m_wakeMutex
+    bool m_exited;
+    uint64_t m_passes;
+    time_t m_cachedSecs = 0;
+    char m_cachedTime[80];
+    std::thread m_thread;
+};
+
+// -----------------------------------------------------------------------------
+// Section: per-thread ring
+// -----------------------------------------------------------------------------
+namespace {
+
+struct ThreadRing {
+    LogRing* ring = nullptr;
+
+    ~ThreadRing() {
+        if (nullptr != ring) {
+            // the writer thread frees it once drained
+            ring->retire();
+        }
+    }
+};
+
+thread_local ThreadRing t_ring;
+
+} // namespace
+
+void submit(int level, const char* file, int line, const char* func,
+            uint64_t timestampNanos, const char* text, int len) {
+    LogBackend& backend = LogBackend::instance();
+    if (backend.stopped()) {
+        // late logging during static destruction, write it directly
+        fwrite(text, 1, len, stdout);
+        fputc('\n', stdout);
+        return;
+    }
+    if (nullptr == t_ring.ring) {
+        t_ring.ring = backend.registerRing();
+    }
+    if (t_ring.ring->push(level, file, line, func, timestampNanos, text, 
+                          len)) {
+        backend.notify();
+    }
+}
+
+void flush() {
+    LogBackend::instance().flush();
+}
+
+uint64_t dropped() {
+    return LogBackend::instance().dropped();
+}
+
+} // namespace logging
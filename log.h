@@ -1,75 +1,116 @@
 #pragma once
 
-#include <sstream>
-#include <iostream>
+#include <ostream>
+#include <streambuf>
 #include <chrono>
+#include <atomic>
+#include <stdint.h>
 #include <string.h>
 
 enum LogSeverity {
-    TRACE, 
-    DEBUG, 
-    INFO, 
-    WARN, 
+    TRACE,
+    DEBUG,
+    INFO,
+    WARN,
     ERROR
 };
 
+// Statements below this level are compiled out, e.g. -DLOG_MIN_LEVEL=INFO
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL TRACE
+#endif
+
+namespace logging {
+
+// Runtime threshold, checked before anything of a log line is built
+extern std::atomic<int> g_level;
+
+inline void setLevel(int level) {
+    g_level.store(level, std::memory_order_relaxed);
+}
+
+inline bool enabled(int level) {
+    return (level >= LOG_MIN_LEVEL) &&
+           (level >= g_level.load(std::memory_order_relaxed));
+}
+
+// Accepts trace, debug, info, warn and error
+bool parseLevel(const char* name, int& level);
+
+// Longest message text kept per record, longer lines are truncated
+static const int kMaxLogText = 384;
+
+// Hands a finished line to the backend. The calling thread only copies it
+// into its own ring buffer; a background thread formats the prefix and
+// writes records out in batches. Records are dropped, and counted, when the
+// ring is full.
+void submit(int level, const char* file, int line, const char* func,
+            uint64_t timestampNanos, const char* text, int len);
+
+// Blocks until every record submitted so far has been written
+void flush();
+
+// Number of records dropped because a ring was full
+uint64_t dropped();
+
+// std::streambuf over a fixed buffer, silently truncates
+class FixedStreamBuf : public std::streambuf {
+public:
+    FixedStreamBuf(char* buf, int size) {
+        setp(buf, buf + size);
+    }
+
+    int size() const {
+        return int(pptr() - pbase());
+    }
+
+protected:
+    int_type overflow(int_type ch) override {
+        return traits_type::eof();
+    }
+};
+
+// Turns the stream expression of a disabled LOG into void, see LOG below
+struct Voidify {
+    void operator&(std::ostream&) {
+    }
+};
+
+} // namespace logging
+
 class Logger {
-    std::stringstream m_ss;
+    int m_level;
+    const char* m_file;
+    int m_line;
+    const char* m_func;
+    uint64_t m_timestampNanos;
+    char m_buf[logging::kMaxLogText];
+    logging::FixedStreamBuf m_sb;
+    std::ostream m_os;
 
 public:
-    Logger(int level, const char* file, int line, const char* func) {
-        auto tpnow = std::chrono::system_clock::now();
-        auto nanosecs = tpnow.time_since_epoch();
-        auto secs = std::chrono::duration_cast<std::chrono::seconds>(nanosecs);
-        auto microsecs = std::chrono::duration_cast<std::chrono::microseconds>(
-                nanosecs - secs).count();
-        auto ts = std::chrono::system_clock::to_time_t(tpnow);
-        auto tm = *std::localtime(&ts);
-        char buf[64];
-        memset(buf, 0, sizeof(buf));
-        int len = snprintf(buf, sizeof(buf), 
-                           "%04d/%02d/%02d %02d:%02d:%02d.%06d",
-                           tm.tm_year + 1900, tm.tm_mon, tm.tm_mday,
-                           tm.tm_hour, tm.tm_min, tm.tm_sec,
-                           static_cast<int>(microsecs));
-        m_ss.write(buf, len);
-        m_ss << "|";
-
-        switch (level) {
-        case TRACE:
-            m_ss << "TRACE";
-            break;
-        case DEBUG:
-            m_ss << "DEBUG";
-            break;
-        case INFO:
-            m_ss << "INFO ";
-            break;
-        case WARN:
-            m_ss << "WARN ";
-            break;
-        case ERROR:
-            m_ss << "ERROR";
-            break;
-        }
-        m_ss << "|";
-
-        const char* slashPos = strrchr(file, '/');
-        m_ss << (slashPos ? slashPos + 1 : file);
-        m_ss << ":" << line << "|" << func << "|";
+    Logger(int level, const char* file, int line, const char* func)
+        : m_level(level), m_file(file), m_line(line), m_func(func)
+        , m_timestampNanos(std::chrono::duration_cast<
+                std::chrono::nanoseconds>(std::chrono::system_clock::now()
+                        .time_since_epoch()).count())
+        , m_sb(m_buf, sizeof(m_buf)), m_os(&m_sb) {
     }
 
     ~Logger() {
-        std::cout << m_ss.str() << std::endl;
+        logging::submit(m_level, m_file, m_line, m_func, m_timestampNanos,
+                        m_buf, m_sb.size());
     }
 
-    std::stringstream& stream() {
-        return m_ss;
+    std::ostream& stream() {
+        return m_os;
     }
 };
 
 #define LOG(LEVEL)                                                            \
-    Logger(LEVEL, __FILE__, __LINE__, __FUNCTION__).stream()
+    !logging::enabled(LEVEL) ? (void)0 :                                      \
+        logging::Voidify() &                                                  \
+        Logger(LEVEL, __FILE__, __LINE__, __FUNCTION__).stream()
 
 #define LOGT LOG(TRACE)
 #define LOGD LOG(DEBUG)
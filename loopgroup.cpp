@@ -0,0 +1,266 @@
+#include "loopgroup.h"
+#include "log.h"
+#include "loopmon.h"
+#include <algorithm>
+
+typedef LoopGroup::Task Task;
+
+static thread_local const LoopGroup* s_group = nullptr;
+static thread_local int s_index = -1;
+
+// -----------------------------------------------------------------------------
+// Section: Mailbox
+// -----------------------------------------------------------------------------
+// Bounded ring of tasks from the thread of one loop to another loop. Only
+// the producer moves |m_tail| and fills the slots ahead of it, only the
+// consumer moves |m_head|; the two sit on cache lines of their own. Once
+// the ring is full, tasks go to a locked overflow list until the consumer
+// takes that over, together with the ring up to where it ended, so newer
+// tasks never overtake older ones.
+class Mailbox {
+public:
+    static const size_t kCapacity = 1024;
+
+    Mailbox() : m_head(0), m_tail(0), m_overflowing(false) {
+    }
+
+    // Producer only
+    void push(Task& task) {
+        if (!m_overflowing.load(std::memory_order_acquire)) {
+            size_t tail = m_tail.load(std::memory_order_relaxed);
+            if (tail - m_head.load(std::memory_order_acquire) < kCapacity) {
+                m_slots[tail & (kCapacity - 1)] = std::move(task);
+                m_tail.store(tail + 1, std::memory_order_release);
+                return;
+            }
+        }
+        std::lock_guard<std::mutex> l(m_overflowMutex);
+        m_overflow.emplace_back(std::move(task));
+        m_overflowing.store(true, std::memory_order_release);
+    }
+
+    // Consumer only, runs the tasks queued when it was called
+    size_t drain() {
+        std::vector<Task> overflow;
+        size_t tail;
+        if (m_overflowing.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> l(m_overflowMutex);
+            tail = m_tail.load(std::memory_order_acquire);
+            m_overflow.swap(overflow);
+            m_overflowing.store(false, std::memory_order_release);
+        } else {
+            tail = m_tail.load(std::memory_order_acquire);
+        }
+        size_t head = m_head.load(std::memory_order_relaxed);
+        for (size_t i = head; i != tail; i++) {
+            Task task(std::move(m_slots[i & (kCapacity - 1)]));
+            m_slots[i & (kCapacity - 1)] = nullptr;
+            m_head.store(i + 1, std::memory_order_release);
+            task();
+        }
+        for (Task& task : overflow) {
+            task();
+        }
+        return (tail - head) + overflow.size();
+    }
+
+private:
+    std::atomic<size_t> m_head;
+    char m_headPad[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> m_tail;
+    std::atomic<bool> m_overflowing;    // |m_overflow| is not empty
+    char m_tailPad[64 - sizeof(std::atomic<size_t>) - 
+                   sizeof(std::atomic<bool>)];
+    Task m_slots[kCapacity];
+    std::mutex m_overflowMutex;
+    std::vector<Task> m_overflow;
+
+    DISALLOW_COPY_MOVE_AND_ASSIGN(Mailbox);
+};
+
+// -----------------------------------------------------------------------------
+// Section: LoopInbox
+// -----------------------------------------------------------------------------
+// Everything posted to one loop: a mailbox per loop of the group and a
+// locked queue for other threads, drained whenever |m_async| fires
+class LoopInbox {
+public:
+    static void onAsync(uv_async_t* handle) {
+        LoopMonitor::Scope scope(LoopMonitor::kAsyncDrain);
+        LoopInbox* self = CONTAINER_OF(handle, LoopInbox, m_async);
+        LoopMonitor::recordBacklog(self->drain());
+    }
+
+    LoopInbox(uv_loop_t& loop, int loopCount) : m_mailboxes(loopCount) {
+        for (Mailbox*& mailbox : m_mailboxes) {
+            mailbox = new Mailbox;
+        }
+        uv_async_init(&loop, &m_async, onAsync);
+        // posted tasks alone do not keep a loop running
+        uv_unref((uv_handle_t*)&m_async);
+    }
+
+    ~LoopInbox() {
+        for (Mailbox* mailbox : m_mailboxes) {
+            delete mailbox;
+        }
+    }
+
+    void post(int from, Task& task) {
+        if (from >= 0) {
+            m_mailboxes[from]->push(task);
+        } else {
+            std::lock_guard<std::mutex> l(m_mutex);
+            m_locked.emplace_back(std::move(task));
+        }
+        uv_async_send(&m_async);
+    }
+
+    size_t drain() {
+        size_t count = 0;
+        for (Mailbox* mailbox : m_mailboxes) {
+            count += mailbox->drain();
+        }
+        std::vector<Task> tasks;
+        {
+            std::lock_guard<std::mutex> l(m_mutex);
+            m_locked.swap(tasks);
+        }
+        for (Task& task : tasks) {
+            task();
+        }
+        return count + tasks.size();
+    }
+
+    void close(uv_close_cb callback) {
+        uv_close((uv_handle_t*)&m_async, callback);
+    }
+
+private:
+    uv_async_t m_async;
+    std::vector<Mailbox*> m_mailboxes;  // indexed by the posting loop
+    std::mutex m_mutex;
+    std::vector<Task> m_locked;
+
+    DISALLOW_COPY_MOVE_AND_ASSIGN(LoopInbox);
+};
+
+// -----------------------------------------------------------------------------
+// Section: LoopGroup
+// -----------------------------------------------------------------------------
+LoopGroup::LoopGroup(int loopCount)
+    : m_stopped(false), m_placed(std::max(loopCount, 1), 0) {
+    loopCount = std::max(loopCount, 1);
+    for (int i = 0; i < loopCount; i++) {
+        uv_loop_t* loop = new uv_loop_t;
+        uv_loop_init(loop);
+        m_loops.push_back(loop);
+        m_inboxes.push_back(new LoopInbox(*loop, loopCount));
+    }
+}
+
+LoopGroup::~LoopGroup() {
+    if (!m_threads.empty()) {
+        stop();
+        join();
+    }
+    for (LoopInbox* inbox : m_inboxes) {
+        delete inbox;
+    }
+    for (uv_loop_t* loop : m_loops) {
+        delete loop;
+    }
+}
+
+int LoopGroup::currentIndex() const {
+    return (this == s_group) ? s_index : -1;
+}
+
+int LoopGroup::place() {
+    std::lock_guard<std::mutex> l(m_placeMutex);
+    int best = 0;
+    for (int i = 1; i < size(); i++) {
+        if (m_placed[i] < m_placed[best]) {
+            best = i;
+        }
+    }
+    m_placed[best] += 1;
+    return best;
+}
+
+void LoopGroup::unplace(int index) {
+    std::lock_guard<std::mutex> l(m_placeMutex);
+    m_placed[index] -= 1;
+}
+
+bool LoopGroup::start(Runner runner, Stopper stopper) {
+    if (!m_threads.empty()) {
+        LOGE << "loop group already started";
+        return false;
+    }
+    m_runner = std::move(runner);
+    m_stopper = std::move(stopper);
+    uv_barrier_init(&m_barrier, unsigned(size()));
+    for (int i = 0; i < size(); i++) {
+        m_threads.emplace_back([this, i]() {
+            runThread(i);
+        });
+    }
+    LOGD << "loop group started " << size() << " loop(s)";
+    return true;
+}
+
+bool LoopGroup::post(int index, Task&& task) {
+    if (m_stopped.load(std::memory_order_acquire)) {
+        return false;
+    }
+    m_inboxes[index]->post(currentIndex(), task);
+    return true;
+}
+
+void LoopGroup::stop() {
+    for (int i = 0; i < size(); i++) {
+        post(i, [this, i]() {
+            if (m_stopper) {
+                m_stopper(i, loop(i));
+            } else {
+                uv_stop(&loop(i));
+            }
+        });
+    }
+}
+
+void LoopGroup::join() {
+    for (std::thread& t : m_threads) {
+        t.join();
+    }
+    if (m_threads.empty()) {
+        return;
+    }
+    m_threads.clear();
+    uv_barrier_destroy(&m_barrier);
+    m_stopped.store(true, std::memory_order_release);
+    for (int i = 0; i < size(); i++) {
+        // whatever threads posted while the others were winding down
+        m_inboxes[i]->drain();
+        m_inboxes[i]->close(nullptr);
+        uv_run(&loop(i), UV_RUN_NOWAIT);
+        uv_loop_close(&loop(i));
+    }
+}
+
+void LoopGroup::runThread(int index) {
+    s_group = this;
+    s_index = index;
+    if (m_runner) {
+        m_runner(index, loop(index));
+    } else {
+        uv_run(&loop(index), UV_RUN_DEFAULT);
+    }
+    LOGD << "loop " << index << " exited";
+    // no loop is torn down while another may still post to it
+    uv_barrier_wait(&m_barrier);
+    m_inboxes[index]->drain();
+    s_group = nullptr;
+    s_index = -1;
+}
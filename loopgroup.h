@@ -0,0 +1,84 @@
+#pragma once
+
+#include "util.h"
+#include "uv.h"
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class LoopInbox;
+
+// -----------------------------------------------------------------------------
+// Section: LoopGroup
+// -----------------------------------------------------------------------------
+// Owns N uv loops and the threads running them. Objects are set up on the
+// loops from the constructing thread before start(), afterwards only
+// through post(). A task posted from a thread of the group goes through a
+// single-producer single-consumer mailbox dedicated to that pair of loops,
+// without locks; other threads, and a mailbox that is full, fall back to
+// a locked queue. Tasks from one thread to one loop run in order.
+//
+// A loop runs until stop() or until nothing keeps it alive. Its thread then
+// waits on a barrier shared by the whole group, so that no loop is torn
+// down while another might still post to it, runs what is left in its
+// mailboxes and exits.
+class LoopGroup {
+public:
+    typedef std::function<void()> Task;
+    // Runs loop |index| on its thread until it is stopped; uv_run()
+    // with UV_RUN_DEFAULT if none is given
+    typedef std::function<void(int index, uv_loop_t& loop)> Runner;
+    // Makes the Runner of loop |index| return, called on its thread;
+    // uv_stop() if none is given
+    typedef std::function<void(int index, uv_loop_t& loop)> Stopper;
+
+    explicit LoopGroup(int loopCount);
+
+    // Stops and joins the threads if that did not happen yet
+    ~LoopGroup();
+
+    int size() const {
+        return int(m_loops.size());
+    }
+
+    uv_loop_t& loop(int index) {
+        return *m_loops[index];
+    }
+
+    // Index of the group loop the calling thread runs, -1 if none
+    int currentIndex() const;
+
+    // The loop carrying the fewest UdpServices so far, ties go to the
+    // lowest index; it counts one more until unplace()
+    int place();
+    void unplace(int index);
+
+    bool start(Runner runner = Runner(), Stopper stopper = Stopper());
+
+    // Runs |task| on loop |index|; false once the group has stopped
+    bool post(int index, Task&& task);
+
+    // Asks every loop to stop, from any thread
+    void stop();
+
+    // Waits for every thread to exit and closes the loops
+    void join();
+
+private:
+    void runThread(int index);
+
+    std::vector<uv_loop_t*> m_loops;
+    std::vector<LoopInbox*> m_inboxes;
+    std::vector<std::thread> m_threads;
+    Runner m_runner;
+    Stopper m_stopper;
+    uv_barrier_t m_barrier;
+    std::atomic<bool> m_stopped;        // tasks are no longer taken
+
+    std::mutex m_placeMutex;
+    std::vector<int> m_placed;          // UdpServices per loop
+
+    DISALLOW_COPY_MOVE_AND_ASSIGN(LoopGroup);
+};
@@ -0,0 +1,141 @@
+#include "loopmon.h"
+#include "log.h"
+#include "metrics.h"
+#include <string.h>
+
+static const char* kHandlerTypeNames[] = {
+    "async drain",
+    "udp recv",
+    "udp send completion",
+    "timer"
+};
+
+static_assert(ARRAY_SIZE(kHandlerTypeNames) == LoopMonitor::kHandlerTypeCount,
+              "a name for every handler type");
+
+thread_local LoopMonitor* LoopMonitor::s_current = nullptr;
+
+// static
+const char* LoopMonitor::handlerTypeName(HandlerType type) {
+    return kHandlerTypeNames[type];
+}
+
+// static
+void LoopMonitor::recordBacklog(size_t handlers) {
+    LoopMonitor* self = s_current;
+    if (nullptr == self) {
+        return;
+    }
+    metrics::record(metrics::Hist::ASYNC_BACKLOG, handlers);
+    if (handlers > self->m_maxBacklog) {
+        self->m_maxBacklog = handlers;
+    }
+}
+
+// static
+void LoopMonitor::onPrepare(uv_prepare_t* handle) {
+    Handles* handles = CONTAINER_OF(handle, Handles, prepare);
+    LoopMonitor* self = handles->owner;
+    uint64_t now = uv_hrtime();
+    // prepare runs right before libuv blocks for I/O, which also ends
+    // the previous iteration
+    if (0 != self->m_iterationStartNanos) {
+        self->endIteration(now);
+    }
+    self->m_iterationStartNanos = now;
+    self->m_pollStartNanos = now;
+    self->m_chargedAtPoll = self->m_charged;
+}
+
+// static
+void LoopMonitor::onCheck(uv_check_t* handle) {
+    Handles* handles = CONTAINER_OF(handle, Handles, check);
+    LoopMonitor* self = handles->owner;
+    // I/O callbacks run inside poll, what they were charged is not waiting
+    uint64_t poll = uv_hrtime() - self->m_pollStartNanos;
+    uint64_t callbacks = self->m_charged - self->m_chargedAtPoll;
+    self->m_waitNanos = (poll > callbacks) ? poll - callbacks : 0;
+}
+
+// static
+void LoopMonitor::onClose(uv_handle_t* handle) {
+    Handles* handles = (Handles*)handle->data;
+    if (--handles->open == 0) {
+        delete handles;
+    }
+}
+
+LoopMonitor::LoopMonitor(uv_loop_t& loop, int stallMillis)
+    : m_handles(new Handles)
+    , m_stallNanos(stallMillis > 0 ? uint64_t(stallMillis) * 1000000 : 0)
+    , m_depth(0), m_iterationStartNanos(0), m_pollStartNanos(0)
+    , m_chargedAtPoll(0), m_waitNanos(0), m_charged(0), m_maxBacklog(0)
+    , m_lastStallLogNanos(0), m_unloggedStalls(0) {
+    memset(m_chargedByType, 0, sizeof(m_chargedByType));
+    m_handles->owner = this;
+    m_handles->open = 2;
+    uv_prepare_init(&loop, &m_handles->prepare);
+    uv_check_init(&loop, &m_handles->check);
+    m_handles->prepare.data = m_handles;
+    m_handles->check.data = m_handles;
+    uv_prepare_start(&m_handles->prepare, onPrepare);
+    uv_check_start(&m_handles->check, onCheck);
+    // watching must not keep the loop alive
+    uv_unref((uv_handle_t*)&m_handles->prepare);
+    uv_unref((uv_handle_t*)&m_handles->check);
+    s_current = this;
+}
+
+LoopMonitor::~LoopMonitor() {
+    if (this == s_current) {
+        s_current = nullptr;
+    }
+    uv_prepare_stop(&m_handles->prepare);
+    uv_check_stop(&m_handles->check);
+    uv_close((uv_handle_t*)&m_handles->prepare, onClose);
+    uv_close((uv_handle_t*)&m_handles->check, onClose);
+}
+
+void LoopMonitor::charge(HandlerType type, uint64_t nanos) {
+    m_charged += nanos;
+    m_chargedByType[type] += nanos;
+}
+
+void LoopMonitor::endIteration(uint64_t now) {
+    uint64_t iteration = now - m_iterationStartNanos;
+    uint64_t busy = (iteration > m_waitNanos) ? iteration - m_waitNanos : 0;
+    metrics::record(metrics::Hist::LOOP_ITERATION, iteration);
+    metrics::record(metrics::Hist::LOOP_BUSY, busy);
+
+    if (0 != m_stallNanos && busy > m_stallNanos) {
+        metrics::add(metrics::Counter::LOOP_STALLS);
+        if (now - m_lastStallLogNanos >= kStallLogIntervalNanos) {
+            int dominant = 0;
+            for (int i = 1; i < kHandlerTypeCount; i++) {
+                if (m_chargedByType[i] > m_chargedByType[dominant]) {
+                    dominant = i;
+                }
+            }
+            uint64_t uncharged = (busy > m_charged) ? busy - m_charged : 0;
+            const char* name = kHandlerTypeNames[dominant];
+            uint64_t nanos = m_chargedByType[dominant];
+            if (uncharged > nanos) {
+                name = "unmonitored callbacks";
+                nanos = uncharged;
+            }
+            LOGW << "event loop stalled " << busy / 1000 << "us, mostly in "
+                 << name << " (" << nanos / 1000 << "us)"
+                 << ", async backlog " << m_maxBacklog
+                 << ", " << m_unloggedStalls << " stall(s) not logged";
+            m_lastStallLogNanos = now;
+            m_unloggedStalls = 0;
+        } else {
+            m_unloggedStalls += 1;
+        }
+    }
+
+    m_waitNanos = 0;
+    m_charged = 0;
+    memset(m_chargedByType, 0, sizeof(m_chargedByType));
+    m_maxBacklog = 0;
+}
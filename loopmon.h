@@ -0,0 +1,99 @@
+#pragma once
+
+#include "util.h"
+#include "uv.h"
+#include <stdint.h>
+
+// -----------------------------------------------------------------------------
+// Section: LoopMonitor
+// -----------------------------------------------------------------------------
+// Watches one uv loop from its own thread via uv_prepare/uv_check hooks.
+// Each iteration is split into the time libuv spent blocked in poll and the
+// busy remainder; callbacks wrapped in a LoopMonitor::Scope are charged to
+// their handler type. An iteration busy for longer than the stall threshold
+// is logged with the handler type that took most of it. Iteration and busy
+// times, stalls and AsyncHandler backlogs are fed into metrics.
+class LoopMonitor {
+public:
+    enum HandlerType {
+        kAsyncDrain,        // AsyncHandler running posted handlers
+        kUdpRecv,           // UdpService receive callback
+        kUdpSendDone,       // UdpService send completion
+        kTimer,             // timer callbacks
+        kHandlerTypeCount
+    };
+
+    // Times one callback and charges it to |type|. Nested scopes are
+    // charged to the outermost one. Costs a thread_local load when no
+    // monitor runs on this thread.
+    class Scope {
+    public:
+        explicit Scope(HandlerType type)
+            : m_monitor(s_current), m_type(type), m_startNanos(0) {
+            if (nullptr != m_monitor && m_monitor->m_depth++ == 0) {
+                m_startNanos = uv_hrtime();
+            }
+        }
+
+        ~Scope() {
+            if (nullptr != m_monitor && --m_monitor->m_depth == 0) {
+                m_monitor->charge(m_type, uv_hrtime() - m_startNanos);
+            }
+        }
+
+    private:
+        LoopMonitor* m_monitor;
+        HandlerType m_type;
+        uint64_t m_startNanos;
+
+        DISALLOW_COPY_MOVE_AND_ASSIGN(Scope);
+    };
+
+    // Records the size of an AsyncHandler drain, if a monitor runs on
+    // this thread
+    static void recordBacklog(size_t handlers);
+
+    static const char* handlerTypeName(HandlerType type);
+
+    // Must be created on the thread that runs |loop|; a |stallMillis| of 0
+    // feeds metrics without logging stalls
+    LoopMonitor(uv_loop_t& loop, int stallMillis);
+    ~LoopMonitor();
+
+private:
+    static const uint64_t kStallLogIntervalNanos = 1000000000ULL;
+
+    struct Handles {
+        uv_prepare_t prepare;
+        uv_check_t check;
+        LoopMonitor* owner;
+        int open;
+    };
+
+    static void onPrepare(uv_prepare_t* handle);
+    static void onCheck(uv_check_t* handle);
+    static void onClose(uv_handle_t* handle);
+
+    void charge(HandlerType type, uint64_t nanos);
+    void endIteration(uint64_t now);
+
+    static thread_local LoopMonitor* s_current;
+
+    Handles* m_handles;
+    uint64_t m_stallNanos;
+    int m_depth;
+
+    // current iteration
+    uint64_t m_iterationStartNanos;     // previous prepare, 0 before
+    uint64_t m_pollStartNanos;
+    uint64_t m_chargedAtPoll;
+    uint64_t m_waitNanos;
+    uint64_t m_charged;
+    uint64_t m_chargedByType[kHandlerTypeCount];
+    size_t m_maxBacklog;
+
+    uint64_t m_lastStallLogNanos;
+    uint64_t m_unloggedStalls;
+
+    DISALLOW_COPY_MOVE_AND_ASSIGN(LoopMonitor);
+};
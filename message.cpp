@@ -0,0 +1,250 @@
+#include "message.h"
+#include "endpoint.h"
+#include <string.h>
+#include <stdlib.h>
+
+static const char* kMessageNames[] = {
+    nullptr,
+    "PING",
+    "GETADDR",
+    "ADDR",
+    "CHKFULLCONE",
+    "SENDFULLCONE",
+    "FULLCONE",
+    "CHKRESTRICTEDCONE",
+    "RESTRICTEDCONE",
+    "GETSTATS",
+    "STATS",
+    "SENDRESTRICTEDCONE",
+    "PONG",
+    "PEER_UNAVAILABLE",
+    "PEER_AUTH"
+};
+
+const char* messageName(MessageId id) {
+    int i = int(id);
+    if (i <= 0 || i >= (int)ARRAY_SIZE(kMessageNames)) {
+        return nullptr;
+    }
+    return kMessageNames[i];
+}
+
+bool parseMessageId(const char* str, MessageId& id) {
+    for (int i = 1; i < (int)ARRAY_SIZE(kMessageNames); i++) {
+        if (strcasecmp(str, kMessageNames[i]) == 0) {
+            id = MessageId(i);
+            return true;
+        }
+    }
+    char* end = nullptr;
+    long value = strtol(str, &end, 10);
+    if (end == str || *end != '\0' || value < 0 || value > 255) {
+        return false;
+    }
+    id = MessageId(value);
+    return true;
+}
+
+namespace wire {
+
+static inline void putU16(char* p, uint16_t v) {
+    p[0] = char(v >> 8);
+    p[1] = char(v & 0xff);
+}
+
+static inline uint16_t getU16(const char* p) {
+    return uint16_t( (uint8_t(p[0]) << 8) | uint8_t(p[1]) );
+}
+
+int encodeAddr(const Endpoint& ep, char* buf, int size) {
+    EndpointKey key = ep.key();
+    int addrLen = 0;
+    if (AF_INET == key.family) {
+        if (size < kAddrV4Size) {
+            return 0;
+        }
+        buf[0] = 4;
+        addrLen = 4;
+    } else if (AF_INET6 == key.family) {
+        if (size < kAddrV6Size) {
+            return 0;
+        }
+        buf[0] = 6;
+        addrLen = 16;
+    } else {
+        return 0;
+    }
+    putU16(buf + 1, key.port);
+    memcpy(buf + 3, key.addr, addrLen);
+    return 3 + addrLen;
+}
+
+bool decodeAddr(const char* buf, int size, Endpoint& ep) {
+    if (size == kAddrV4Size && buf[0] == 4) {
+        struct sockaddr_in sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons(getU16(buf + 1));
+        memcpy(&sa.sin_addr, buf + 3, 4);
+        ep.init((const struct sockaddr*)&sa);
+        return true;
+    } else if (size == kAddrV6Size && buf[0] == 6) {
+        struct sockaddr_in6 sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sin6_family = AF_INET6;
+        sa.sin6_port = htons(getU16(buf + 1));
+        memcpy(&sa.sin6_addr, buf + 3, 16);
+        ep.init((const struct sockaddr*)&sa);
+        return true;
+    }
+    return false;
+}
+
+// -----------------------------------------------------------------------------
+// Section: MessageView
+// -----------------------------------------------------------------------------
+bool MessageView::addr(Endpoint& ep) const {
+    if (kLegacy == version) {
+        return ep.parseFromArray(value, size);
+    }
+    return decodeAddr(value, size, ep);
+}
+
+// -----------------------------------------------------------------------------
+// Section: Reader
+// -----------------------------------------------------------------------------
+Reader::Reader()
+    : m_cur(nullptr), m_end(nullptr), m_version(kLegacy), m_txid(0) {
+}
+
+bool Reader::init(const char* data, int size) {
+    m_cur = m_end = nullptr;
+    if (nullptr == data || size <= 0) {
+        return false;
+    }
+    if ( (uint8_t(data[0]) & kHeaderMarker) == 0 ) {
+        m_version = kLegacy;
+        m_txid = 0;
+        m_cur = data;
+        m_end = data + size;
+        return true;
+    }
+    if (size < kHeaderSize || uint8_t(data[0]) != kHeaderMarker) {
+        return false;
+    }
+    int version = uint8_t(data[1]);
+    if (version != kVersion1) {
+        return false;
+    }
+    const char* p = data + kHeaderSize;
+    const char* end = data + size;
+    if (p == end) {
+        return false;
+    }
+    while (p < end) {
+        if (end - p < kMessageHeaderSize) {
+            return false;
+        }
+        int len = getU16(p + 1);
+        if (end - p - kMessageHeaderSize < len) {
+            return false;
+        }
+        p += kMessageHeaderSize + len;
+    }
+    m_version = version;
+    m_txid = getU16(data + 2);
+    m_cur = data + kHeaderSize;
+    m_end = end;
+    return true;
+}
+
+bool Reader::next(MessageView& msg) {
+    if (m_cur >= m_end) {
+        return false;
+    }
+    msg.version = m_version;
+    msg.id = MessageId(uint8_t(m_cur[0]));
+    if (kLegacy == m_version) {
+        msg.value = m_cur + 1;
+        msg.size = int(m_end - m_cur) - 1;
+        m_cur = m_end;
+        return true;
+    }
+    msg.size = getU16(m_cur + 1);
+    msg.value = m_cur + kMessageHeaderSize;
+    m_cur += kMessageHeaderSize + msg.size;
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Section: Writer
+// -----------------------------------------------------------------------------
+Writer::Writer()
+    : m_buf(nullptr), m_capacity(0), m_size(0), m_version(kLegacy)
+    , m_txid(0), m_count(0), m_ok(false) {
+}
+
+Writer::Writer(char* buf, int size, int version, uint16_t txid)
+    : m_buf(buf), m_capacity(size), m_size(0), m_version(version)
+    , m_txid(txid), m_count(0), m_ok(true) {
+    if (kLegacy == version) {
+        return;
+    }
+    if (size < kHeaderSize) {
+        m_ok = false;
+        return;
+    }
+    buf[0] = char(kHeaderMarker);
+    buf[1] = char(version);
+    putU16(buf + 2, txid);
+    m_size = kHeaderSize;
+}
+
+bool Writer::add(MessageId id, const char* value, int size) {
+    if (!m_ok) {
+        return false;
+    }
+    if (kLegacy == m_version) {
+        if (m_count > 0 || m_capacity - m_size < 1 + size) {
+            m_ok = false;
+            return false;
+        }
+        m_buf[m_size] = char(id);
+        if (size > 0) {
+            memcpy(m_buf + m_size + 1, value, size);
+        }
+        m_size += 1 + size;
+    } else {
+        if (size > 0xffff ||
+                m_capacity - m_size < kMessageHeaderSize + size) {
+            m_ok = false;
+            return false;
+        }
+        char* p = m_buf + m_size;
+        p[0] = char(id);
+        putU16(p + 1, uint16_t(size));
+        if (size > 0) {
+            memcpy(p + kMessageHeaderSize, value, size);
+        }
+        m_size += kMessageHeaderSize + size;
+    }
+    m_count += 1;
+    return true;
+}
+
+bool Writer::add(MessageId id, const Endpoint& addr) {
+    char buf[sizeof(struct sockaddr_in6)];
+    int len = 0;
+    if (kLegacy == m_version) {
+        len = addr.serializeToArray(buf, sizeof(buf));
+    } else {
+        len = encodeAddr(addr, buf, sizeof(buf));
+    }
+    if (len <= 0) {
+        m_ok = false;
+        return false;
+    }
+    return add(id, buf, len);
+}
+
+} // namespace wire
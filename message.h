@@ -1,5 +1,9 @@
 #pragma once
 
+#include <stdint.h>
+
+class Endpoint;
+
 enum class MessageId {
     PING = 1,
     GETADDR,
@@ -8,5 +12,148 @@ enum class MessageId {
     SENDFULLCONE,
     FULLCONE,
     CHKRESTRICTEDCONE,
-    RESTRICTEDCONE
-};
\ No newline at end of file
+    RESTRICTEDCONE,
+    GETSTATS,           // answered from loopback peers only
+    STATS,              // value: text report, "name value" lines
+    SENDRESTRICTEDCONE, // between clustered servers, value: the client's
+                        // | version (1) | txid (2) | addr |
+    PONG,               // answers PING
+    PEER_UNAVAILABLE,   // value: addr of the server a CHKFULLCONE named,
+                        // which is known to be down
+    PEER_AUTH           // closes datagrams between clustered servers,
+                        // value: | clock (8) | HMAC (16) |, see PeerAuth
+};
+
+// "GETADDR" etc, nullptr for unknown ids
+const char* messageName(MessageId id);
+
+// Accepts a name as returned by messageName() or a decimal id
+bool parseMessageId(const char* str, MessageId& id);
+
+// -----------------------------------------------------------------------------
+// Wire format
+//
+// Legacy (version 0) datagrams carry exactly one message: a MessageId byte
+// optionally followed by a host-endian struct sockaddr_in/sockaddr_in6.
+//
+// Version 1 datagrams start with a 4-byte header followed by one or more
+// messages, all multi-byte integers in network byte order. A server answers
+// every message of a datagram and coalesces replies bound for the same
+// destination into one datagram.
+//
+//   header:  | 0x80 | version | txid (2) |
+//   message: | MessageId (1) | length (2) | value (length bytes) |
+//
+// Addresses in version 1 are encoded compactly as
+//
+//   | family (1, 4 or 6) | port (2) | addr (4 or 16) |
+//
+// i.e. 7 bytes for IPv4 and 19 bytes for IPv6. A legacy datagram never has
+// the high bit of its first byte set, which is how the two are told apart.
+// Replies are always encoded in the version of the request they answer.
+// -----------------------------------------------------------------------------
+namespace wire {
+
+enum {
+    kLegacy = 0,
+    kVersion1 = 1,
+    kCurrentVersion = kVersion1
+};
+
+static const uint8_t kHeaderMarker = 0x80;
+static const int kHeaderSize = 4;
+static const int kMessageHeaderSize = 3;
+static const int kAddrV4Size = 7;
+static const int kAddrV6Size = 19;
+static const int kMaxAddrSize = kAddrV6Size;
+static const int kMaxDatagramSize = 512;
+
+// Returns the number of bytes written, 0 if |ep| has no address family or
+// |size| is too small.
+int encodeAddr(const Endpoint& ep, char* buf, int size);
+
+// Returns false unless |buf| holds exactly one well-formed compact address.
+bool decodeAddr(const char* buf, int size, Endpoint& ep);
+
+// A message inside a datagram, pointing into the receive buffer.
+struct MessageView {
+    MessageId id;
+    const char* value;
+    int size;
+    int version;
+
+    // Decodes |value| as an address in the encoding of |version|
+    bool addr(Endpoint& ep) const;
+};
+
+// Zero-copy parser. init() validates the header and the length of every
+// message up front, so next() never reads past the end of the datagram.
+class Reader {
+public:
+    Reader();
+
+    bool init(const char* data, int size);
+
+    int version() const {
+        return m_version;
+    }
+
+    uint16_t txid() const {
+        return m_txid;
+    }
+
+    bool next(MessageView& msg);
+
+private:
+    const char* m_cur;
+    const char* m_end;
+    int m_version;
+    uint16_t m_txid;
+};
+
+// Encodes messages into a caller supplied buffer. A legacy writer accepts
+// a single message only. Once an add() fails the writer stays failed.
+class Writer {
+public:
+    // An unusable writer, assign a real one before adding messages
+    Writer();
+    Writer(char* buf, int size, int version, uint16_t txid);
+
+    bool add(MessageId id, const char* value = nullptr, int size = 0);
+    bool add(MessageId id, const Endpoint& addr);
+
+    int version() const {
+        return m_version;
+    }
+
+    bool ok() const {
+        return m_ok;
+    }
+
+    bool empty() const {
+        return m_count == 0;
+    }
+
+    uint16_t txid() const {
+        return m_txid;
+    }
+
+    const char* data() const {
+        return m_buf;
+    }
+
+    int size() const {
+        return m_size;
+    }
+
+private:
+    char* m_buf;
+    int m_capacity;
+    int m_size;
+    int m_version;
+    uint16_t m_txid;
+    int m_count;
+    bool m_ok;
+};
+
+} // namespace wire
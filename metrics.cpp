@@ -0,0 +1,356 @@
+#include "metrics.h"
+#include <stdio.h>
+#include <string.h>
+
+namespace metrics {
+
+static const char* kCounterNames[] = {
+    "rx_datagrams",
+    "rx_bytes",
+    "tx_datagrams",
+    "tx_bytes",
+    "send_errors",
+    "malformed",
+    "rate_limited",
+    "shed",
+    "relays",
+    "loop_stalls",
+    "kernel_drops",
+    "loop_cpu_ns",
+    "busy_poll_spin_ns",
+    "send_would_block",
+    "peer_unavailable",
+    "relays_capped"
+};
+
+static_assert(ARRAY_SIZE(kCounterNames) == kCounterCount,
+              "a name for every counter");
+
+static const char* kGaugeNames[] = {
+    "async_queue_depth",
+    "message_handlers",
+    "recv_queue_bytes",
+    "send_queue_bytes",
+    "pending_sends",
+    "peers_down"
+};
+
+static_assert(ARRAY_SIZE(kGaugeNames) == kGaugeCount,
+              "a name for every gauge");
+
+static const char* kHistNames[] = {
+    "send_latency_ns",
+    "loop_iteration_ns",
+    "loop_busy_ns",
+    "async_backlog",
+    "reply_latency_ns"
+};
+
+static_assert(ARRAY_SIZE(kHistNames) == kHistCount,
+              "a name for every histogram");
+
+const char* counterName(Counter c) {
+    return kCounterNames[int(c)];
+}
+
+const char* gaugeName(Gauge g) {
+    return kGaugeNames[int(g)];
+}
+
+const char* histName(Hist h) {
+    return kHistNames[int(h)];
+}
+
+// -----------------------------------------------------------------------------
+// Section: Histogram
+// -----------------------------------------------------------------------------
+// static
+uint64_t HistogramLayout::upperBound(int bucket) {
+    if (bucket < kSubBuckets) {
+        return uint64_t(bucket);
+    }
+    int exp = (bucket >> kSubBucketBits) + kSubBucketBits - 1;
+    uint64_t sub = uint64_t(bucket & (kSubBuckets - 1));
+    uint64_t width = uint64_t(1) << (exp - kSubBucketBits);
+    return (uint64_t(1) << exp) + sub * width + (width - 1);
+}
+
+Histogram::Histogram() {
+    for (int i = 0; i < HistogramLayout::kBucketCount; i++) {
+        m_counts[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void HistogramSnapshot::clear() {
+    memset(counts, 0, sizeof(counts));
+}
+
+void HistogramSnapshot::merge(const Histogram& h) {
+    for (int i = 0; i < HistogramLayout::kBucketCount; i++) {
+        counts[i] += h.count(i);
+    }
+}
+
+uint64_t HistogramSnapshot::total() const {
+    uint64_t n = 0;
+    for (int i = 0; i < HistogramLayout::kBucketCount; i++) {
+        n += counts[i];
+    }
+    return n;
+}
+
+uint64_t HistogramSnapshot::percentile(double q) const {
+    uint64_t n = total();
+    if (0 == n) {
+        return 0;
+    }
+    uint64_t rank = uint64_t(q * double(n));
+    if (rank >= n) {
+        rank = n - 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < HistogramLayout::kBucketCount; i++) {
+        seen += counts[i];
+        if (seen > rank) {
+            return HistogramLayout::upperBound(i);
+        }
+    }
+    return max();
+}
+
+uint64_t HistogramSnapshot::max() const {
+    for (int i = HistogramLayout::kBucketCount - 1; i >= 0; i--) {
+        if (counts[i] > 0) {
+            return HistogramLayout::upperBound(i);
+        }
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Section: recording
+// -----------------------------------------------------------------------------
+struct Shard {
+    std::atomic<uint64_t> counters[kCounterCount];
+    // net change of each gauge made by the owning thread, a thread that
+    // queues work raises a gauge the thread running it lowers
+    std::atomic<int64_t> gauges[kGaugeCount];
+    std::atomic<uint64_t> messagesIn[kMessageSlots];
+    std::atomic<uint64_t> messagesOut[kMessageSlots];
+    Histogram processing[kMessageSlots];
+    Histogram histograms[kHistCount];
+
+    Shard() {
+        for (auto& c : counters) {
+            c.store(0, std::memory_order_relaxed);
+        }
+        for (auto& g : gauges) {
+            g.store(0, std::memory_order_relaxed);
+        }
+        for (int i = 0; i < kMessageSlots; i++) {
+            messagesIn[i].store(0, std::memory_order_relaxed);
+            messagesOut[i].store(0, std::memory_order_relaxed);
+        }
+    }
+};
+
+// Shards live as long as the process; threads beyond kMaxShards share the
+// last one and may then lose an occasional update
+static const int kMaxShards = 128;
+static std::atomic<Shard*> s_shards[kMaxShards];
+static std::atomic<int> s_shardCount(0);
+
+static Shard& localShard() {
+    static thread_local Shard* t_shard = nullptr;
+    if (nullptr == t_shard) {
+        int index = s_shardCount.load(std::memory_order_relaxed);
+        while (index < kMaxShards &&
+               !s_shardCount.compare_exchange_weak(index, index + 1)) {
+        }
+        if (index < kMaxShards) {
+            t_shard = new Shard();
+            s_shards[index].store(t_shard, std::memory_order_release);
+        } else {
+            while (nullptr == (t_shard = s_shards[kMaxShards - 1].load(
+                    std::memory_order_acquire))) {
+            }
+        }
+    }
+    return *t_shard;
+}
+
+static inline void bump(std::atomic<uint64_t>& c, uint64_t n) {
+    c.store(c.load(std::memory_order_relaxed) + n,
+            std::memory_order_relaxed);
+}
+
+static inline int slotOf(MessageId id) {
+    int i = int(id);
+    return (i > 0 && i <= kMaxMessageId) ? i : 0;
+}
+
+void add(Counter c, uint64_t n) {
+    bump(localShard().counters[int(c)], n);
+}
+
+void messageIn(MessageId id) {
+    bump(localShard().messagesIn[slotOf(id)], 1);
+}
+
+void messageOut(MessageId id) {
+    bump(localShard().messagesOut[slotOf(id)], 1);
+}
+
+void recordProcessing(MessageId id, uint64_t nanos) {
+    localShard().processing[slotOf(id)].record(nanos);
+}
+
+void record(Hist h, uint64_t value) {
+    localShard().histograms[int(h)].record(value);
+}
+
+void addGauge(Gauge g, int64_t delta) {
+    std::atomic<int64_t>& v = localShard().gauges[int(g)];
+    v.store(v.load(std::memory_order_relaxed) + delta,
+            std::memory_order_relaxed);
+}
+
+int64_t gauge(Gauge g) {
+    int64_t level = 0;
+    int count = s_shardCount.load(std::memory_order_relaxed);
+    for (int s = 0; s < count; s++) {
+        const Shard* shard = s_shards[s].load(std::memory_order_acquire);
+        if (nullptr != shard) {
+            level += shard->gauges[int(g)].load(std::memory_order_relaxed);
+        }
+    }
+    return level;
+}
+
+// -----------------------------------------------------------------------------
+// Section: Snapshot
+// -----------------------------------------------------------------------------
+void snapshot(Snapshot& snap) {
+    memset(snap.counters, 0, sizeof(snap.counters));
+    memset(snap.messagesIn, 0, sizeof(snap.messagesIn));
+    memset(snap.messagesOut, 0, sizeof(snap.messagesOut));
+    for (int i = 0; i < kMessageSlots; i++) {
+        snap.processing[i].clear();
+    }
+    for (int i = 0; i < kHistCount; i++) {
+        snap.histograms[i].clear();
+    }
+    memset(snap.gauges, 0, sizeof(snap.gauges));
+    snap.shards = 0;
+
+    int count = s_shardCount.load(std::memory_order_relaxed);
+    for (int s = 0; s < count; s++) {
+        const Shard* shard = s_shards[s].load(std::memory_order_acquire);
+        if (nullptr == shard) {
+            // claimed but not yet filled in, holds nothing yet
+            continue;
+        }
+        snap.shards += 1;
+        for (int i = 0; i < kCounterCount; i++) {
+            snap.counters[i] +=
+                    shard->counters[i].load(std::memory_order_relaxed);
+        }
+        for (int i = 0; i < kGaugeCount; i++) {
+            snap.gauges[i] += 
+                    shard->gauges[i].load(std::memory_order_relaxed);
+        }
+        for (int i = 0; i < kMessageSlots; i++) {
+            snap.messagesIn[i] +=
+                    shard->messagesIn[i].load(std::memory_order_relaxed);
+            snap.messagesOut[i] +=
+                    shard->messagesOut[i].load(std::memory_order_relaxed);
+            snap.processing[i].merge(shard->processing[i]);
+        }
+        for (int i = 0; i < kHistCount; i++) {
+            snap.histograms[i].merge(shard->histograms[i]);
+        }
+    }
+}
+
+namespace {
+
+// Appends to a fixed buffer, dropping whole lines that do not fit
+class LineWriter {
+    char* m_buf;
+    int m_size;
+    int m_len;
+
+public:
+    LineWriter(char* buf, int size) : m_buf(buf), m_size(size), m_len(0) {
+    }
+
+    template <typename... Args>
+    void line(const char* fmt, Args... args) {
+        int room = m_size - m_len;
+        if (room <= 0) {
+            return;
+        }
+        int n = snprintf(m_buf + m_len, room, fmt, args...);
+        if (n > 0 && n < room) {
+            m_len += n;
+        } else {
+            m_size = m_len;    // full, stop at the previous line
+        }
+    }
+
+    int length() const {
+        return m_len;
+    }
+};
+
+void histogramLine(LineWriter& w, const char* name,
+                   const HistogramSnapshot& h) {
+    uint64_t n = h.total();
+    if (0 == n) {
+        return;
+    }
+    w.line("%s count %llu p50 %llu p90 %llu p99 %llu p999 %llu "
+           "max %llu\n", name, (unsigned long long)n,
+           (unsigned long long)h.percentile(0.50),
+           (unsigned long long)h.percentile(0.90),
+           (unsigned long long)h.percentile(0.99),
+           (unsigned long long)h.percentile(0.999),
+           (unsigned long long)h.max());
+}
+
+} // namespace
+
+int format(const Snapshot& snap, char* buf, int size) {
+    LineWriter w(buf, size);
+    for (int i = 0; i < kCounterCount; i++) {
+        w.line("%s %llu\n", kCounterNames[i],
+               (unsigned long long)snap.counters[i]);
+    }
+    for (int i = 0; i < kGaugeCount; i++) {
+        w.line("%s %lld\n", kGaugeNames[i], (long long)snap.gauges[i]);
+    }
+    for (int i = 0; i < kMessageSlots; i++) {
+        if (0 == snap.messagesIn[i] && 0 == snap.messagesOut[i] &&
+                0 == snap.processing[i].total()) {
+            continue;
+        }
+        const char* name = messageName(MessageId(i));
+        char idStr[16];
+        if (nullptr == name) {
+            snprintf(idStr, sizeof(idStr), "msg%d", i);
+            name = idStr;
+        }
+        w.line("%s in %llu out %llu\n", name,
+               (unsigned long long)snap.messagesIn[i],
+               (unsigned long long)snap.messagesOut[i]);
+        char histName[32];
+        snprintf(histName, sizeof(histName), "%s_processing_ns", name);
+        histogramLine(w, histName, snap.processing[i]);
+    }
+    for (int i = 0; i < kHistCount; i++) {
+        histogramLine(w, kHistNames[i], snap.histograms[i]);
+    }
+    return w.length();
+}
+
+} // namespace metrics
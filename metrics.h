@@ -0,0 +1,181 @@
+#pragma once
+
+#include "util.h"
+#include "message.h"
+#include <atomic>
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// -----------------------------------------------------------------------------
+// Process-wide metrics
+//
+// Every thread that records gets a shard of its own, written without locks
+// or atomic read-modify-write instructions: only the owning thread stores
+// into a shard, readers merge all shards with relaxed loads. A snapshot is
+// therefore not an atomic cut, but every counter in it is exact up to the
+// moment it was read.
+// -----------------------------------------------------------------------------
+namespace metrics {
+
+enum class Counter {
+    RX_DATAGRAMS,
+    RX_BYTES,
+    TX_DATAGRAMS,
+    TX_BYTES,
+    SEND_ERRORS,
+    MALFORMED,
+    RATE_LIMITED,
+    SHED,
+    RELAYS,
+    LOOP_STALLS,
+    KERNEL_DROPS,           // datagrams the kernel dropped, SO_RXQ_OVFL
+    LOOP_CPU_NANOS,         // CPU time of loop threads run by BusyPoll
+    BUSY_POLL_SPIN_NANOS,   // loop iterations that polled and found nothing
+    SEND_WOULD_BLOCK,       // sends refused at UdpService's high-water mark
+    PEER_UNAVAILABLE,       // relays refused because the peer is down
+    RELAYS_CAPPED,          // relay messages past a datagram's allowance
+    kCount
+};
+
+static const int kCounterCount = int(Counter::kCount);
+
+// Process-wide levels rather than totals. Shards hold what their thread
+// added, a level is the sum over all shards.
+enum class Gauge {
+    ASYNC_QUEUE_DEPTH,      // handlers posted to AsyncHandlers, not yet run
+    MESSAGE_HANDLERS,       // IMessageHandlers registered with UdpServices
+    RECV_QUEUE_BYTES,       // kernel receive queues of UdpServices, sampled
+    SEND_QUEUE_BYTES,       // kernel send queues of UdpServices, sampled
+    PENDING_SENDS,          // UdpService sends not completed, sampled
+    PEERS_DOWN,             // cluster peers that stopped answering PING
+    kCount
+};
+
+static const int kGaugeCount = int(Gauge::kCount);
+
+// Distributions other than the per-message processing time
+enum class Hist {
+    SEND_LATENCY,       // ns from UdpService::send() to completion
+    LOOP_ITERATION,     // ns from one loop iteration to the next
+    LOOP_BUSY,          // ns of an iteration not spent waiting for I/O
+    ASYNC_BACKLOG,      // handlers run per AsyncHandler drain
+    REPLY_LATENCY,      // ns from the kernel queueing a request to its
+                        // replies being sent
+    kCount
+};
+
+static const int kHistCount = int(Hist::kCount);
+
+// Message ids above this fold into slot 0 along with unknown ids
+static const int kMaxMessageId = 15;
+static const int kMessageSlots = kMaxMessageId + 1;
+
+const char* counterName(Counter c);
+const char* gaugeName(Gauge g);
+const char* histName(Hist h);
+
+// -----------------------------------------------------------------------------
+// Section: Histogram
+// -----------------------------------------------------------------------------
+// Log-linear buckets in the style of HdrHistogram: values below 8 get exact
+// buckets, every power of two above is split into 8 sub-buckets, so any
+// recorded value is known within 12.5% over the whole 64-bit range.
+struct HistogramLayout {
+    static const int kSubBucketBits = 3;
+    static const int kSubBuckets = 1 << kSubBucketBits;
+    static const int kBucketCount = (64 - kSubBucketBits + 1) * kSubBuckets;
+
+    static inline int highestBit(uint64_t v) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanReverse64(&index, v);
+        return int(index);
+#else
+        return 63 - __builtin_clzll(v);
+#endif
+    }
+
+    static inline int bucketOf(uint64_t v) {
+        if (v < uint64_t(kSubBuckets)) {
+            return int(v);
+        }
+        int exp = highestBit(v);
+        int sub = int( (v >> (exp - kSubBucketBits)) & (kSubBuckets - 1) );
+        return ( (exp - kSubBucketBits + 1) << kSubBucketBits ) + sub;
+    }
+
+    // Largest value that falls into |bucket|
+    static uint64_t upperBound(int bucket);
+};
+
+// Single writer; other threads may read the counts at any time
+class Histogram {
+public:
+    Histogram();
+
+    void record(uint64_t v) {
+        std::atomic<uint64_t>& c = m_counts[HistogramLayout::bucketOf(v)];
+        c.store(c.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+    }
+
+    uint64_t count(int bucket) const {
+        return m_counts[bucket].load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> m_counts[HistogramLayout::kBucketCount];
+
+    DISALLOW_COPY_MOVE_AND_ASSIGN(Histogram);
+};
+
+// Plain copy of one or more merged histograms
+struct HistogramSnapshot {
+    uint64_t counts[HistogramLayout::kBucketCount];
+
+    void clear();
+    void merge(const Histogram& h);
+    uint64_t total() const;
+    // Upper bound of the bucket holding the |q| quantile, 0 when empty
+    uint64_t percentile(double q) const;
+    uint64_t max() const;
+};
+
+// -----------------------------------------------------------------------------
+// Section: recording
+// -----------------------------------------------------------------------------
+void add(Counter c, uint64_t n = 1);
+void messageIn(MessageId id);
+void messageOut(MessageId id);
+// Time spent handling one message, in nanoseconds
+void recordProcessing(MessageId id, uint64_t nanos);
+void record(Hist h, uint64_t value);
+
+void addGauge(Gauge g, int64_t delta);
+int64_t gauge(Gauge g);
+
+// -----------------------------------------------------------------------------
+// Section: Snapshot
+// -----------------------------------------------------------------------------
+// Large (tens of KB), allocate on the heap
+struct Snapshot {
+    uint64_t counters[kCounterCount];
+    int64_t gauges[kGaugeCount];
+    uint64_t messagesIn[kMessageSlots];
+    uint64_t messagesOut[kMessageSlots];
+    HistogramSnapshot processing[kMessageSlots];
+    HistogramSnapshot histograms[kHistCount];
+    int shards;
+};
+
+// Sums all shards into |snap|
+void snapshot(Snapshot& snap);
+
+// Renders |snap| as "name value" lines plus one percentile line per
+// histogram; returns the length written, truncated at a line boundary
+int format(const Snapshot& snap, char* buf, int size);
+
+} // namespace metrics
@@ -0,0 +1,216 @@
+#include "peerauth.h"
+#include "message.h"
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+
+// -----------------------------------------------------------------------------
+// Section: Sha256
+// -----------------------------------------------------------------------------
+// FIPS 180-4, enough of it for HMAC over datagrams
+namespace {
+
+class Sha256 {
+public:
+    Sha256() : m_length(0), m_used(0) {
+        static const uint32_t kInit[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+            0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+        };
+        memcpy(m_state, kInit, sizeof(m_state));
+    }
+
+    void update(const void* data, size_t size) {
+        const uint8_t* p = (const uint8_t*)data;
+        m_length += size;
+        while (size > 0) {
+            size_t n = std::min(size, sizeof(m_block) - m_used);
+            memcpy(m_block + m_used, p, n);
+            m_used += n;
+            p += n;
+            size -= n;
+            if (sizeof(m_block) == m_used) {
+                compress();
+                m_used = 0;
+            }
+        }
+    }
+
+    void finish(uint8_t digest[32]) {
+        uint64_t bits = m_length * 8;
+        uint8_t pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while (m_used != 56) {
+            update(&pad, 1);
+        }
+        uint8_t len[8];
+        for (int i = 0; i < 8; i++) {
+            len[i] = uint8_t(bits >> (56 - 8 * i));
+        }
+        update(len, sizeof(len));
+        for (int i = 0; i < 8; i++) {
+            for (int j = 0; j < 4; j++) {
+                digest[4 * i + j] = uint8_t(m_state[i] >> (24 - 8 * j));
+            }
+        }
+    }
+
+private:
+    static uint32_t rotr(uint32_t x, int n) {
+        return (x >> n) | (x << (32 - n));
+    }
+
+    void compress() {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b,
+            0x59f111f1, 0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01,
+            0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7,
+            0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+            0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152,
+            0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+            0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+            0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819,
+            0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116, 0x1e376c08,
+            0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f,
+            0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+            0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+        };
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t(m_block[4 * i]) << 24) | 
+                   (uint32_t(m_block[4 * i + 1]) << 16) |
+                   (uint32_t(m_block[4 * i + 2]) << 8) | 
+                   uint32_t(m_block[4 * i + 3]);
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ 
+                          (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ 
+                          (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = m_state[0], b = m_state[1], c = m_state[2];
+        uint32_t d = m_state[3], e = m_state[4], f = m_state[5];
+        uint32_t g = m_state[6], h = m_state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+            uint32_t ch = (e & f) ^ (~e & g);
+            uint32_t t1 = h + s1 + ch + k[i] + w[i];
+            uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+            uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t t2 = s0 + maj;
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        m_state[0] += a;
+        m_state[1] += b;
+        m_state[2] += c;
+        m_state[3] += d;
+        m_state[4] += e;
+        m_state[5] += f;
+        m_state[6] += g;
+        m_state[7] += h;
+    }
+
+    uint32_t m_state[8];
+    uint64_t m_length;
+    uint8_t m_block[64];
+    size_t m_used;
+};
+
+uint64_t wallClockMillis() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+// -----------------------------------------------------------------------------
+// Section: PeerAuth
+// -----------------------------------------------------------------------------
+PeerAuth::PeerAuth(const std::string& secret) {
+    uint8_t key[64];
+    memset(key, 0, sizeof(key));
+    if (secret.size() > sizeof(key)) {
+        Sha256 sha;
+        sha.update(secret.data(), secret.size());
+        sha.finish(key);
+    } else {
+        memcpy(key, secret.data(), secret.size());
+    }
+    for (size_t i = 0; i < sizeof(key); i++) {
+        m_innerPad[i] = key[i] ^ 0x36;
+        m_outerPad[i] = key[i] ^ 0x5c;
+    }
+}
+
+void PeerAuth::mac(const char* data, int size, const char* clock, 
+                   uint8_t out[32]) const {
+    uint8_t inner[32];
+    Sha256 sha;
+    sha.update(m_innerPad, sizeof(m_innerPad));
+    sha.update(data, size);
+    sha.update(clock, kClockSize);
+    sha.finish(inner);
+    Sha256 outer;
+    outer.update(m_outerPad, sizeof(m_outerPad));
+    outer.update(inner, sizeof(inner));
+    outer.finish(out);
+}
+
+int PeerAuth::sign(char* buf, int size, int capacity) const {
+    if (capacity - size < kMessageSize || size < wire::kHeaderSize) {
+        return 0;
+    }
+    char* p = buf + size;
+    p[0] = char(MessageId::PEER_AUTH);
+    p[1] = char(kValueSize >> 8);
+    p[2] = char(kValueSize & 0xff);
+    char* clock = p + 3;
+    uint64_t now = wallClockMillis();
+    for (int i = 0; i < kClockSize; i++) {
+        clock[i] = char(now >> (56 - 8 * i));
+    }
+    uint8_t digest[32];
+    mac(buf, size, clock, digest);
+    memcpy(clock + kClockSize, digest, kMacSize);
+    return size + kMessageSize;
+}
+
+bool PeerAuth::verify(const char* data, int size) const {
+    // the message is last, so it sits at a fixed distance from the end
+    int offset = size - kMessageSize;
+    if (offset < wire::kHeaderSize || 
+            uint8_t(data[0]) != wire::kHeaderMarker ||
+            uint8_t(data[offset]) != uint8_t(MessageId::PEER_AUTH) ||
+            uint8_t(data[offset + 1]) != (kValueSize >> 8) ||
+            uint8_t(data[offset + 2]) != (kValueSize & 0xff)) {
+        return false;
+    }
+    const char* clock = data + offset + 3;
+    uint8_t digest[32];
+    mac(data, offset, clock, digest);
+    // in constant time, a mismatch must not tell how much matched
+    uint8_t diff = 0;
+    for (int i = 0; i < kMacSize; i++) {
+        diff |= digest[i] ^ uint8_t(clock[kClockSize + i]);
+    }
+    if (diff != 0) {
+        return false;
+    }
+    uint64_t sent = 0;
+    for (int i = 0; i < kClockSize; i++) {
+        sent = (sent << 8) | uint8_t(clock[i]);
+    }
+    uint64_t now = wallClockMillis();
+    uint64_t skew = (now > sent) ? now - sent : sent - now;
+    return skew <= kMaxSkewMillis;
+}
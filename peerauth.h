@@ -0,0 +1,45 @@
+#pragma once
+
+#include "util.h"
+#include <string>
+#include <stdint.h>
+
+// -----------------------------------------------------------------------------
+// Section: PeerAuth
+// -----------------------------------------------------------------------------
+// Signs and checks the datagrams clustered servers exchange, with HMAC-SHA256
+// keyed by a secret every member of the cluster shares. The signature is a
+// PEER_AUTH message closing the datagram:
+//
+//   | sender's wall clock, ms (8) | HMAC (16) |
+//
+// over everything ahead of the message plus the clock value. A datagram
+// older or younger than kMaxSkewMillis is refused, which bounds how long a
+// captured one can be sent again.
+class PeerAuth {
+public:
+    static const int kClockSize = 8;
+    static const int kMacSize = 16;                 // HMAC-SHA256, truncated
+    static const int kValueSize = kClockSize + kMacSize;
+    // room a writer leaves for sign()
+    static const int kMessageSize = 3 + kValueSize;
+    static const uint64_t kMaxSkewMillis = 30 * 1000;
+
+    explicit PeerAuth(const std::string& secret);
+
+    // Appends PEER_AUTH to the version 1 datagram of |size| bytes in |buf|;
+    // the new size, 0 if |capacity| has no room for it
+    int sign(char* buf, int size, int capacity) const;
+
+    // True if the datagram ends in a PEER_AUTH message that checks out
+    bool verify(const char* data, int size) const;
+
+private:
+    void mac(const char* data, int size, const char* clock, 
+             uint8_t out[32]) const;
+
+    uint8_t m_innerPad[64];
+    uint8_t m_outerPad[64];
+
+    DISALLOW_COPY_MOVE_AND_ASSIGN(PeerAuth);
+};
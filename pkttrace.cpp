@@ -0,0 +1,166 @@
+#include "pkttrace.h"
+#include "log.h"
+#include "message.h"
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+std::atomic<PacketTrace*> PacketTrace::s_current(nullptr);
+
+// static
+PacketTrace* PacketTrace::open(const std::string& path, uint64_t capacity) {
+    if (capacity == 0) {
+        return nullptr;
+    }
+    size_t size = sizeof(PacketTraceHeader) +
+                  capacity * sizeof(PacketTraceRecord);
+    if (path.empty()) {
+        void* addr = calloc(1, size);
+        if (nullptr == addr) {
+            LOGE << "no memory for a packet trace of " << capacity 
+                 << " records";
+            return nullptr;
+        }
+        PacketTraceHeader* header = (PacketTraceHeader*)addr;
+        initHeader(header, capacity);
+        LOGD << "tracing packets in memory, " << capacity << " records";
+        return new PacketTrace(header, size, false);
+    }
+#ifdef _WIN32
+    LOGE << "packet trace files are not supported on this platform";
+    return nullptr;
+#else
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        LOGE << "open " << path << ": " << strerror(errno);
+        return nullptr;
+    }
+    if (ftruncate(fd, off_t(size)) != 0) {
+        LOGE << "ftruncate " << path << ": " << strerror(errno);
+        ::close(fd);
+        return nullptr;
+    }
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, 0);
+    ::close(fd);
+    if (MAP_FAILED == addr) {
+        LOGE << "mmap " << path << ": " << strerror(errno);
+        return nullptr;
+    }
+    PacketTraceHeader* header = (PacketTraceHeader*)addr;
+    initHeader(header, capacity);
+    LOGI << "tracing packets to " << path << ", " << capacity
+         << " records";
+    return new PacketTrace(header, size, true);
+#endif
+}
+
+// static
+void PacketTrace::initHeader(PacketTraceHeader* header, uint64_t capacity) {
+    memcpy(header->magic, "NATCHKTR", sizeof(header->magic));
+    header->version = kPacketTraceVersion;
+    header->recordSize = sizeof(PacketTraceRecord);
+    header->capacity = capacity;
+    header->realtimeAnchorNanos = std::chrono::duration_cast<
+            std::chrono::nanoseconds>(std::chrono::system_clock::now()
+                    .time_since_epoch()).count();
+    header->monotonicAnchorNanos = uv_hrtime();
+    header->writeIndex.store(0, std::memory_order_release);
+}
+
+// static
+void PacketTrace::install(PacketTrace* trace) {
+    s_current.store(trace, std::memory_order_release);
+}
+
+PacketTrace::PacketTrace(PacketTraceHeader* header, size_t size, 
+                         bool mapped)
+    : m_header(header), m_records((PacketTraceRecord*)(header + 1))
+    , m_size(size), m_mapped(mapped) {
+}
+
+PacketTrace::~PacketTrace() {
+    PacketTrace* self = this;
+    s_current.compare_exchange_strong(self, nullptr);
+    if (!m_mapped) {
+        free(m_header);
+        return;
+    }
+#ifndef _WIN32
+    munmap(m_header, m_size);
+#endif
+}
+
+bool PacketTrace::save(const std::string& path) const {
+    FILE* file = fopen(path.c_str(), "wb");
+    if (nullptr == file) {
+        LOGE << "open " << path << ": " << strerror(errno);
+        return false;
+    }
+    bool ok = fwrite(m_header, 1, m_size, file) == m_size;
+    ok = (fclose(file) == 0) && ok;
+    if (!ok) {
+        LOGE << "write " << path << ": " << strerror(errno);
+        return false;
+    }
+    LOGI << "packet trace of " 
+         << std::min(m_header->writeIndex.load(std::memory_order_relaxed), 
+                     m_header->capacity)
+         << " records saved to " << path;
+    return true;
+}
+
+void PacketTrace::append(int direction, const Endpoint& local,
+                         const Endpoint& peer, const uv_buf_t* bufs, 
+                         int count) {
+    // enough of the front for the message id and the prefix
+    char head[16];
+    int headLen = 0;
+    int size = 0;
+    for (int i = 0; i < count; i++) {
+        int len = int(bufs[i].len);
+        int n = std::min(len, int(sizeof(head)) - headLen);
+        memcpy(head + headLen, bufs[i].base, n);
+        headLen += n;
+        size += len;
+    }
+    append(direction, local, peer, head, headLen, size);
+}
+
+void PacketTrace::append(int direction, const Endpoint& local,
+                         const Endpoint& peer, const char* head, int headLen,
+                         int size) {
+    uint64_t index = m_header->writeIndex.fetch_add(
+            1, std::memory_order_relaxed);
+    PacketTraceRecord& r = m_records[index % m_header->capacity];
+    // invalidate first, so a reader never takes a half-written record for
+    // the previous occupant of the slot
+    r.seq = 0;
+    std::atomic_thread_fence(std::memory_order_release);
+    r.timestampNanos = uv_hrtime();
+    r.length = uint16_t(size);
+    r.direction = uint8_t(direction);
+    if (headLen > wire::kHeaderSize && 
+            (uint8_t(head[0]) & wire::kHeaderMarker) != 0) {
+        r.msgId = uint8_t(head[wire::kHeaderSize]);
+    } else {
+        r.msgId = (headLen > 0) ? uint8_t(head[0]) : 0;
+    }
+    r.local = local.key();
+    r.peer = peer.key();
+    int prefixLen = (headLen < (int)sizeof(r.prefix)) ? 
+            headLen : sizeof(r.prefix);
+    memset(r.prefix, 0, sizeof(r.prefix));
+    memcpy(r.prefix, head, prefixLen);
+    std::atomic_thread_fence(std::memory_order_release);
+    r.seq = uint32_t(index + 1);
+}
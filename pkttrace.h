@@ -0,0 +1,108 @@
+#pragma once
+
+#include "util.h"
+#include "endpoint.h"
+#include "uv.h"
+#include <atomic>
+#include <string>
+
+// -----------------------------------------------------------------------------
+// Packet trace file layout
+//
+// A fixed-size file mapped into memory: a 64-byte header followed by a ring
+// of 64-byte records. Writers claim a slot by incrementing |writeIndex| and
+// stamp the record with the low 32 bits of (index + 1) last, so a reader
+// can tell complete records from torn or overwritten ones.
+// -----------------------------------------------------------------------------
+struct PacketTraceHeader {
+    char magic[8];                  // "NATCHKTR"
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t capacity;              // number of records in the ring
+    uint64_t realtimeAnchorNanos;   // wall clock when the file was created
+    uint64_t monotonicAnchorNanos;  // uv_hrtime() at the same moment
+    std::atomic<uint64_t> writeIndex;
+    uint8_t reserved[16];
+};
+
+struct PacketTraceRecord {
+    uint64_t timestampNanos;        // uv_hrtime()
+    uint32_t seq;                   // low 32 bits of index + 1, written last
+    uint16_t length;                // datagram length
+    uint8_t direction;              // kTraceIn or kTraceOut
+    uint8_t msgId;                  // first MessageId in the datagram
+    EndpointKey local;
+    EndpointKey peer;
+    uint8_t prefix[8];              // first bytes of the datagram
+};
+
+static_assert(sizeof(PacketTraceHeader) == 64, "trace header is 64 bytes");
+static_assert(sizeof(PacketTraceRecord) == 64, "trace record is 64 bytes");
+
+enum {
+    kTraceIn = 0,
+    kTraceOut = 1
+};
+
+static const uint32_t kPacketTraceVersion = 1;
+static const uint64_t kDefaultTraceRecords = 65536;
+
+// -----------------------------------------------------------------------------
+// Section: PacketTrace
+// -----------------------------------------------------------------------------
+// Always-on, low overhead recorder of every datagram a UdpService sends or
+// receives. Recording is a relaxed fetch_add and a 64-byte store into the
+// ring, safe from any thread. Install one per process.
+class PacketTrace {
+public:
+    // Creates or truncates |path| to hold |capacity| records and maps the
+    // ring onto it; an empty |path| keeps the ring in memory, see save()
+    static PacketTrace* open(const std::string& path, uint64_t capacity);
+
+    // Writes the ring as it is to |path| in the trace file layout. Records
+    // being written meanwhile come out torn and are skipped by readers.
+    bool save(const std::string& path) const;
+
+    // Makes |trace| the process-wide recorder, nullptr stops recording
+    static void install(PacketTrace* trace);
+
+    static inline void record(int direction, const Endpoint& local,
+                              const Endpoint& peer, const char* data,
+                              int size) {
+        PacketTrace* trace = s_current.load(std::memory_order_acquire);
+        if (nullptr != trace) {
+            trace->append(direction, local, peer, data, size, size);
+        }
+    }
+
+    // A datagram handed over as |count| pieces
+    static inline void record(int direction, const Endpoint& local,
+                              const Endpoint& peer, const uv_buf_t* bufs,
+                              int count) {
+        PacketTrace* trace = s_current.load(std::memory_order_acquire);
+        if (nullptr != trace) {
+            trace->append(direction, local, peer, bufs, count);
+        }
+    }
+
+    ~PacketTrace();
+
+private:
+    PacketTrace(PacketTraceHeader* header, size_t size, bool mapped);
+    static void initHeader(PacketTraceHeader* header, uint64_t capacity);
+
+    // |head| holds the first |headLen| of the datagram's |size| bytes
+    void append(int direction, const Endpoint& local, const Endpoint& peer,
+                const char* head, int headLen, int size);
+    void append(int direction, const Endpoint& local, const Endpoint& peer,
+                const uv_buf_t* bufs, int count);
+
+    static std::atomic<PacketTrace*> s_current;
+
+    PacketTraceHeader* m_header;
+    PacketTraceRecord* m_records;
+    size_t m_size;
+    bool m_mapped;                  // onto a file, heap memory otherwise
+
+    DISALLOW_COPY_MOVE_AND_ASSIGN(PacketTrace);
+};
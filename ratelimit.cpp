@@ -0,0 +1,200 @@
+#include "ratelimit.h"
+#include "log.h"
+#include "loopmon.h"
+#include <string.h>
+
+// -----------------------------------------------------------------------------
+// Section: RateLimiter
+// -----------------------------------------------------------------------------
+RateLimiter::RateLimiter(int ratePerSec, int burst, int capacity,
+                         int idleMillis)
+    : m_mask(0), m_ratePerSec(ratePerSec > 0 ? ratePerSec : 0)
+    , m_maxTokens(uint32_t(burst > 0 ? burst : 1) * kTokenScale)
+    , m_idleMillis(idleMillis > 0 ? idleMillis : 0) {
+    memset(&m_stats, 0, sizeof(m_stats));
+    if (!enabled()) {
+        return;
+    }
+    uint32_t size = kMaxProbe;
+    while (size < uint32_t(capacity)) {
+        size <<= 1;
+    }
+    m_table.resize(size);
+    memset(&m_table[0], 0, sizeof(Entry) * size);
+    m_mask = size - 1;
+}
+
+bool RateLimiter::allow(const Endpoint& peer, uint64_t nowMillis) {
+    if (!enabled()) {
+        return true;
+    }
+    Entry* e = lookup(peer.key().hostOnly(), nowMillis);
+    if (nowMillis > e->lastMillis) {
+        uint64_t elapsed = nowMillis - e->lastMillis;
+        uint64_t tokens = e->tokens + elapsed * m_ratePerSec;
+        e->tokens = uint32_t(tokens < m_maxTokens ? tokens : m_maxTokens);
+        e->lastMillis = nowMillis;
+    }
+    if (e->tokens < kTokenScale) {
+        m_stats.limited += 1;
+        return false;
+    }
+    e->tokens -= kTokenScale;
+    m_stats.allowed += 1;
+    return true;
+}
+
+RateLimiter::Entry* RateLimiter::lookup(const EndpointKey& key,
+                                        uint64_t nowMillis) {
+    uint32_t idx = uint32_t(key.hash()) & m_mask;
+    Entry* freeSlot = nullptr;
+    Entry* oldest = nullptr;
+    for (int i = 0; i < kMaxProbe; i++) {
+        Entry& e = m_table[(idx + i) & m_mask];
+        if (e.key == key) {
+            return &e;
+        }
+        if (nullptr != freeSlot) {
+            continue;
+        }
+        if (0 == e.key.family || (nowMillis > e.lastMillis && 
+                                  nowMillis - e.lastMillis > m_idleMillis)) {
+            freeSlot = &e;
+        } else if (nullptr == oldest || e.lastMillis < oldest->lastMillis) {
+            oldest = &e;
+        }
+    }
+    Entry* e = freeSlot;
+    if (nullptr == e) {
+        e = oldest;
+        m_stats.evicted += 1;
+    } else if (0 != e->key.family) {
+        m_stats.aged += 1;
+    }
+    e->key = key;
+    e->tokens = m_maxTokens;
+    e->lastMillis = nowMillis;
+    return e;
+}
+
+// -----------------------------------------------------------------------------
+// Section: SharedRateLimiter
+// -----------------------------------------------------------------------------
+SharedRateLimiter::SharedRateLimiter(int ratePerSec, int burst, int capacity,
+                                     int idleMillis, int shards)
+    : m_enabled(ratePerSec > 0) {
+    if (shards < 1) {
+        shards = 1;
+    }
+    for (int i = 0; i < shards; i++) {
+        m_shards.emplace_back(new Shard(ratePerSec, burst, capacity / shards,
+                                        idleMillis));
+    }
+}
+
+bool SharedRateLimiter::allow(const Endpoint& peer, uint64_t nowMillis) {
+    if (!m_enabled) {
+        return true;
+    }
+    // the high bits, RateLimiter indexes its table with the low ones
+    uint64_t hash = peer.key().hostOnly().hash();
+    Shard& shard = *m_shards[(hash >> 32) % m_shards.size()];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return shard.limiter.allow(peer, nowMillis);
+}
+
+RateLimiter::Stats SharedRateLimiter::stats() const {
+    RateLimiter::Stats total;
+    memset(&total, 0, sizeof(total));
+    for (const std::unique_ptr<Shard>& shard : m_shards) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        const RateLimiter::Stats& s = shard->limiter.stats();
+        total.allowed += s.allowed;
+        total.limited += s.limited;
+        total.aged += s.aged;
+        total.evicted += s.evicted;
+    }
+    return total;
+}
+
+// -----------------------------------------------------------------------------
+// Section: OverloadDetector
+// -----------------------------------------------------------------------------
+// static
+void OverloadDetector::onTimer(uv_timer_t* handle) {
+    LoopMonitor::Scope scope(LoopMonitor::kTimer);
+    TimerHandle* timer = CONTAINER_OF(handle, TimerHandle, handle);
+    OverloadDetector* self = timer->owner;
+    uint64_t now = uv_hrtime();
+    uint64_t lag = 0;
+    if (now > self->m_expectedNanos) {
+        lag = (now - self->m_expectedNanos) / 1000000;
+    }
+    self->m_expectedNanos = now + kProbeIntervalMillis * 1000000ULL;
+    self->update(lag);
+}
+
+// static
+void OverloadDetector::onClose(uv_handle_t* handle) {
+    TimerHandle* timer = CONTAINER_OF(handle, TimerHandle, handle);
+    delete timer;
+}
+
+OverloadDetector::OverloadDetector(uv_loop_t& loop, int maxLagMillis)
+    : m_timer(nullptr), m_expectedNanos(0)
+    , m_maxLagMillis(maxLagMillis > 0 ? maxLagMillis : 0)
+    , m_keepOneIn(1), m_counter(0) {
+    memset(&m_stats, 0, sizeof(m_stats));
+    if (0 == m_maxLagMillis) {
+        return;
+    }
+    m_timer = new TimerHandle;
+    m_timer->owner = this;
+    uv_timer_init(&loop, &m_timer->handle);
+    m_expectedNanos = uv_hrtime() + kProbeIntervalMillis * 1000000ULL;
+    uv_timer_start(&m_timer->handle, onTimer,
+                   kProbeIntervalMillis, kProbeIntervalMillis);
+    // the probe alone must not keep the loop alive
+    uv_unref((uv_handle_t*)&m_timer->handle);
+}
+
+OverloadDetector::~OverloadDetector() {
+    if (nullptr != m_timer) {
+        uv_timer_stop(&m_timer->handle);
+        uv_close((uv_handle_t*)&m_timer->handle, onClose);
+    }
+}
+
+bool OverloadDetector::admit() {
+    if (m_keepOneIn <= 1) {
+        return true;
+    }
+    m_counter += 1;
+    if (m_counter % m_keepOneIn == 0) {
+        return true;
+    }
+    m_stats.shed += 1;
+    return false;
+}
+
+void OverloadDetector::update(uint64_t lagMillis) {
+    if (lagMillis > m_stats.maxLagMillis) {
+        m_stats.maxLagMillis = lagMillis;
+    }
+    if (lagMillis > m_maxLagMillis) {
+        int keepOneIn = int(lagMillis / m_maxLagMillis) + 1;
+        if (keepOneIn > kMaxKeepOneIn) {
+            keepOneIn = kMaxKeepOneIn;
+        }
+        if (m_keepOneIn <= 1) {
+            m_stats.overloadEvents += 1;
+            LOGW << "event loop lagging " << lagMillis
+                 << "ms, shedding load";
+        }
+        m_keepOneIn = keepOneIn;
+    } else if (m_keepOneIn > 1 && lagMillis < m_maxLagMillis / 2) {
+        LOGI << "event loop recovered, " << m_stats.shed
+             << " datagram(s) shed so far";
+        m_keepOneIn = 1;
+    }
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include "util.h"
+#include "endpoint.h"
+#include <uv.h>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// -----------------------------------------------------------------------------
+// Section: RateLimiter
+// -----------------------------------------------------------------------------
+// Per source IP token buckets kept in a fixed-size open-addressing table.
+// Lookups scan a bounded probe window; slots idle for longer than the
+// configured age are reused in place, otherwise the least recently seen
+// slot of the window is evicted. Memory use never grows with the number
+// of sources. Not thread-safe, see SharedRateLimiter. Times that go
+// backwards, as the cached clocks of different loops may, count as no time.
+class RateLimiter {
+public:
+    struct Stats {
+        uint64_t allowed;
+        uint64_t limited;
+        uint64_t aged;
+        uint64_t evicted;
+    };
+
+    // |ratePerSec| of 0 disables limiting. |capacity| is rounded up to a
+    // power of two.
+    RateLimiter(int ratePerSec, int burst, int capacity, int idleMillis);
+
+    // Charges one token to the bucket of |peer|'s IP address
+    bool allow(const Endpoint& peer, uint64_t nowMillis);
+
+    bool enabled() const {
+        return m_ratePerSec > 0;
+    }
+
+    const Stats& stats() const {
+        return m_stats;
+    }
+
+private:
+    static const int kMaxProbe = 8;
+    static const uint32_t kTokenScale = 1000;
+
+    struct Entry {
+        EndpointKey key;
+        uint32_t tokens;    // in 1/kTokenScale tokens
+        uint64_t lastMillis;
+    };
+
+    Entry* lookup(const EndpointKey& key, uint64_t nowMillis);
+
+    std::vector<Entry> m_table;
+    uint32_t m_mask;
+    uint32_t m_ratePerSec;
+    uint32_t m_maxTokens;
+    uint64_t m_idleMillis;
+    Stats m_stats;
+
+    DISALLOW_COPY_MOVE_AND_ASSIGN(RateLimiter);
+};
+
+// -----------------------------------------------------------------------------
+// Section: SharedRateLimiter
+// -----------------------------------------------------------------------------
+// One RateLimiter for the loops of a LoopGroup: the table is split into
+// mutex-guarded shards by source IP, so a source is charged to a single
+// bucket whichever loop its datagrams arrive on, and loops contend only
+// when their sources hash to the same shard.
+class SharedRateLimiter {
+public:
+    // |capacity| is shared among |shards| RateLimiters
+    SharedRateLimiter(int ratePerSec, int burst, int capacity, int idleMillis,
+                      int shards);
+
+    // From any thread
+    bool allow(const Endpoint& peer, uint64_t nowMillis);
+
+    bool enabled() const {
+        return m_enabled;
+    }
+
+    // Totals over the shards
+    RateLimiter::Stats stats() const;
+
+private:
+    struct Shard {
+        std::mutex mutex;
+        RateLimiter limiter;
+
+        Shard(int ratePerSec, int burst, int capacity, int idleMillis)
+            : limiter(ratePerSec, burst, capacity, idleMillis) {
+        }
+    };
+
+    std::vector<std::unique_ptr<Shard>> m_shards;
+    bool m_enabled;
+
+    DISALLOW_COPY_MOVE_AND_ASSIGN(SharedRateLimiter);
+};
+
+// -----------------------------------------------------------------------------
+// Section: OverloadDetector
+// -----------------------------------------------------------------------------
+// Measures event loop lag with a periodic timer. Once the lag exceeds
+// |maxLagMillis| the loop is considered overloaded until it drops below
+// half of that again; meanwhile admit() lets only a fraction of datagrams
+// through, fewer the further behind the loop is.
+class OverloadDetector {
+public:
+    struct Stats {
+        uint64_t overloadEvents;
+        uint64_t shed;
+        uint64_t maxLagMillis;
+    };
+
+    // |maxLagMillis| of 0 disables shedding
+    OverloadDetector(uv_loop_t& loop, int maxLagMillis);
+    ~OverloadDetector();
+
+    bool admit();
+
+    bool overloaded() const {
+        return m_keepOneIn > 1;
+    }
+
+    const Stats& stats() const {
+        return m_stats;
+    }
+
+private:
+    static const int kProbeIntervalMillis = 100;
+    static const int kMaxKeepOneIn = 16;
+
+    static void onTimer(uv_timer_t* handle);
+    static void onClose(uv_handle_t* handle);
+
+    void update(uint64_t lagMillis);
+
+    struct TimerHandle {
+        uv_timer_t handle;
+        OverloadDetector* owner;
+    };
+
+    TimerHandle* m_timer;
+    uint64_t m_expectedNanos;
+    uint64_t m_maxLagMillis;
+    int m_keepOneIn;
+    uint32_t m_counter;
+    Stats m_stats;
+
+    DISALLOW_COPY_MOVE_AND_ASSIGN(OverloadDetector);
+};
@@ -0,0 +1,531 @@
+#include "longopt.h"
+#include "log.h"
+#include "util.h"
+#include "async.h"
+#include "endpoint.h"
+#include "message.h"
+#include "udpsvc.h"
+#include "capture.h"
+#include <uv.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const option_t kOptions[] = {
+    { '-', NULL, 0, NULL, "arguments:" },
+    { 'f', "file", LONGOPT_REQUIRE, NULL, "capture file written by natchk-svr --capture"},
+    { 's', "servers", LONGOPT_REQUIRE, NULL, "replay to <ip>:<port>,...; the n-th captured server address maps to the n-th entry (default: as captured)"},
+    { 'l', "listen-udp", LONGOPT_REQUIRE, NULL, "<ip>:<port> of the first source socket, the others take the following ports (default 0.0.0.0:40000)"},
+    { 'n', "sockets", LONGOPT_REQUIRE, NULL, "number of source sockets (default: one per captured peer, at most 1024); they share one IP, so a target running with -r limits them together"},
+    { 'x', "speed", LONGOPT_REQUIRE, NULL, "replay speed, 1 for real time, N for N times faster, 0 for as fast as possible (default 1)"},
+    { 'w', "wait", LONGOPT_REQUIRE, NULL, "milliseconds to wait for replies after the last send (default 1000)"},
+    { 'v', "log-level", LONGOPT_REQUIRE, NULL, "trace(default), debug, info, warn or error"},
+    { 0, "relays", LONGOPT_REQUIRE, NULL, "CHKFULLCONE, SENDFULLCONE and SENDRESTRICTEDCONE: rewrite (default) the address they carry to the sending socket, skip them, or keep them as captured"},
+    { 0, NULL, 0, NULL, NULL }
+};
+
+static const int kMaxSockets = 1024;
+static const int kTickMillis = 1;
+// datagrams sent per tick at full speed, leaves room for receiving replies
+static const int kMaxSendsPerTick = 1024;
+static const int kDefaultWaitMillis = 1000;
+// sends a source socket queues before the replay waits for it to drain
+static const int kMaxPendingSends = 4096;
+// largest datagram the relay rewrite produces, as large as any received
+static const int kMaxRewriteSize = 64 * 1024;
+
+// What becomes of messages that make the target send to an address they
+// carry. Replayed as captured they would have the target relay to clients
+// and servers of the capture, third parties to the replay.
+enum RelayMode {
+    kRelayRewrite,      // point them at the sending socket
+    kRelaySkip,         // leave them out
+    kRelayKeep          // as captured, for isolated setups only
+};
+
+static bool isRelay(MessageId id) {
+    return MessageId::CHKFULLCONE == id || MessageId::SENDFULLCONE == id ||
+           MessageId::SENDRESTRICTEDCONE == id;
+}
+
+// -----------------------------------------------------------------------------
+// Section: Replayer
+// -----------------------------------------------------------------------------
+class Replayer {
+public:
+    Replayer(uv_loop_t& loop, const CaptureReader& capture,
+             const std::vector<Endpoint>& targets, const IpPort& listenAddr,
+             int socketCount, double speed, int waitMillis, 
+             RelayMode relayMode);
+    ~Replayer();
+
+private:
+    struct Socket : UdpService::IMessageHandler {
+        Replayer* replayer;
+        UdpService* udpSvc;
+        Endpoint addr;
+        Endpoint relayAddr;             // what relay messages carry
+
+        void handleMessage(UdpService& udpSvc, const Endpoint& peer,
+                           const char* data, int size, 
+                           uint64_t recvNanos) override {
+            replayer->handleReply(*this, peer, data, size, recvNanos);
+        }
+    };
+
+    void handleReply(Socket& sock, const Endpoint& peer,
+                     const char* data, int size, uint64_t recvNanos);
+    int rewrite(const CapturedPacket& pkt, const Endpoint& self, 
+                int& relays);
+    void sendDue();
+    void finish();
+    void report();
+
+    static void onTick(uv_timer_t* handle);
+    static void onWaitDone(uv_timer_t* handle);
+
+    uv_loop_t& m_loop;
+    const CaptureReader& m_capture;
+    std::vector<Endpoint> m_targets;   // indexed by captured endpoint id
+    std::vector<Socket> m_sockets;
+    double m_speed;
+    int m_waitMillis;
+    RelayMode m_relayMode;
+    std::vector<char> m_rewriteBuf;
+    uv_timer_t m_timer;
+
+    size_t m_next;
+    uint64_t m_startNanos;
+    uint64_t m_lastSendNanos;
+    uint64_t m_lastReplyNanos;
+
+    bool m_blocked;                     // waiting for a socket to drain
+    uint64_t m_sendBlocked;
+    uint64_t m_sendFailed;
+    uint64_t m_relaysRewritten;
+    uint64_t m_relaysSkipped;
+    uint64_t m_replies;
+    uint64_t m_malformed;
+    uint64_t m_addrCorrect;
+    uint64_t m_addrWrong;
+    uint64_t m_sentById[256];
+    uint64_t m_recvById[256];
+};
+
+Replayer::Replayer(uv_loop_t& loop, const CaptureReader& capture,
+                   const std::vector<Endpoint>& targets,
+                   const IpPort& listenAddr, int socketCount, double speed,
+                   int waitMillis, RelayMode relayMode)
+    : m_loop(loop), m_capture(capture), m_speed(speed)
+    , m_waitMillis(waitMillis), m_relayMode(relayMode)
+    , m_rewriteBuf(kMaxRewriteSize), m_next(0), m_startNanos(0)
+    , m_lastSendNanos(0), m_lastReplyNanos(0), m_blocked(false)
+    , m_sendBlocked(0), m_sendFailed(0), m_relaysRewritten(0)
+    , m_relaysSkipped(0), m_replies(0), m_malformed(0), m_addrCorrect(0), m_addrWrong(0) {
+    memset(m_sentById, 0, sizeof(m_sentById));
+    memset(m_recvById, 0, sizeof(m_recvById));
+
+    // the n-th distinct server address in the capture goes to targets[n]
+    m_targets.resize(capture.endpoints().size());
+    std::vector<bool> mapped(capture.endpoints().size(), false);
+    size_t localCount = 0;
+    for (const CapturedPacket& pkt : capture.packets()) {
+        if (mapped[pkt.localId]) {
+            continue;
+        }
+        mapped[pkt.localId] = true;
+        Endpoint captured;
+        captured.init(capture.endpoints()[pkt.localId]);
+        if (targets.empty()) {
+            m_targets[pkt.localId] = captured;
+        } else {
+            m_targets[pkt.localId] = targets[localCount % targets.size()];
+        }
+        LOGI << "replaying datagrams for " << captured << " to "
+             << m_targets[pkt.localId];
+        localCount += 1;
+    }
+
+    m_sockets.resize(socketCount);
+    for (int i = 0; i < socketCount; i++) {
+        Socket& sock = m_sockets[i];
+        sock.replayer = this;
+        sock.addr.init(AF_INET, listenAddr.ip, uint16_t(listenAddr.port + i));
+        // a wildcard socket has no address to give, loopback keeps
+        // whatever the target sends on its own host
+        sock.relayAddr.init(AF_INET, (listenAddr.ip == "0.0.0.0") ? 
+                            "127.0.0.1" : listenAddr.ip, sock.addr.port());
+        UdpService::Options options;
+        options.maxPendingSends = kMaxPendingSends;
+        sock.udpSvc = new UdpService(m_loop, sock.addr, options);
+        sock.udpSvc->addMessageHandler(&sock);
+        sock.udpSvc->start();
+    }
+
+    uv_timer_init(&m_loop, &m_timer);
+    uv_timer_start(&m_timer, onTick, kTickMillis, kTickMillis);
+}
+
+Replayer::~Replayer() {
+    for (Socket& sock : m_sockets) {
+        delete sock.udpSvc;
+    }
+}
+
+// static
+void Replayer::onTick(uv_timer_t* handle) {
+    Replayer* self = CONTAINER_OF(handle, Replayer, m_timer);
+    self->sendDue();
+}
+
+// static
+void Replayer::onWaitDone(uv_timer_t* handle) {
+    Replayer* self = CONTAINER_OF(handle, Replayer, m_timer);
+    self->finish();
+}
+
+void Replayer::sendDue() {
+    if (m_blocked) {
+        return;
+    }
+    const std::vector<CapturedPacket>& packets = m_capture.packets();
+    uint64_t now = uv_hrtime();
+    if (0 == m_startNanos) {
+        m_startNanos = now;
+    }
+    uint64_t due = (m_speed > 0) ?
+            uint64_t( double(now - m_startNanos) * m_speed ) : UINT64_MAX;
+    int budget = (m_speed > 0) ? INT32_MAX : kMaxSendsPerTick;
+    while (m_next < packets.size() && budget > 0 &&
+           packets[m_next].offsetNanos <= due) {
+        const CapturedPacket& pkt = packets[m_next++];
+        // a captured peer keeps its source socket, so per-peer state on
+        // the server (rate limits, relay suppression) sees the same mix
+        Socket& sock = m_sockets[pkt.peerId % m_sockets.size()];
+        int relays = 0;
+        int rewritten = rewrite(pkt, sock.relayAddr, relays);
+        uint64_t& relayCount = (kRelaySkip == m_relayMode) ? 
+                m_relaysSkipped : m_relaysRewritten;
+        if (0 == rewritten) {
+            relayCount += relays;
+            continue;
+        }
+        const char* data = pkt.payload.data();
+        int size = int(pkt.payload.size());
+        UdpService::SendStatus status;
+        if (rewritten > 0) {
+            data = m_rewriteBuf.data();
+            size = rewritten;
+            status = sock.udpSvc->send(m_targets[pkt.localId], data, size);
+        } else {
+            // the capture outlives the replay, payloads are sent in place
+            uv_buf_t buf = uv_buf_init((char*)data, size);
+            status = sock.udpSvc->send(m_targets[pkt.localId], &buf, 1, 
+                                       nullptr);
+        }
+        if (UdpService::kSendWouldBlock == status) {
+            // retried once the socket has drained, ticks skip until then
+            m_next -= 1;
+            m_sendBlocked += 1;
+            m_blocked = true;
+            sock.udpSvc->whenWritable([this]() {
+                m_blocked = false;
+                sendDue();
+            });
+            return;
+        } else if (UdpService::kSendQueued != status) {
+            m_sendFailed += 1;
+        }
+        relayCount += relays;
+        wire::Reader reader;
+        wire::MessageView msg;
+        if (reader.init(data, size)) {
+            while (reader.next(msg)) {
+                m_sentById[uint8_t(msg.id)] += 1;
+            }
+        }
+        budget -= 1;
+    }
+    if (m_next == packets.size()) {
+        m_lastSendNanos = uv_hrtime();
+        uv_timer_stop(&m_timer);
+        uv_timer_start(&m_timer, onWaitDone, m_waitMillis, 0);
+    }
+}
+
+// Copies |pkt| into m_rewriteBuf with its relay messages handled as
+// m_relayMode says and returns the size; -1 if it goes out as captured,
+// 0 if nothing is left of it. |self| replaces the addresses carried,
+// |relays| counts the relay messages rewritten or left out.
+int Replayer::rewrite(const CapturedPacket& pkt, const Endpoint& self, 
+                      int& relays) {
+    wire::Reader reader;
+    wire::MessageView msg;
+    if (kRelayKeep == m_relayMode || 
+            !reader.init(pkt.payload.data(), int(pkt.payload.size()))) {
+        return -1;
+    }
+    bool any = false;
+    while (!any && reader.next(msg)) {
+        any = isRelay(msg.id);
+    }
+    if (!any) {
+        return -1;
+    }
+    reader.init(pkt.payload.data(), int(pkt.payload.size()));
+    wire::Writer writer(m_rewriteBuf.data(), int(m_rewriteBuf.size()), 
+                        reader.version(), reader.txid());
+    while (reader.next(msg)) {
+        if (!isRelay(msg.id)) {
+            writer.add(msg.id, msg.value, msg.size);
+        } else if (kRelaySkip == m_relayMode) {
+            relays += 1;
+        } else if (MessageId::SENDRESTRICTEDCONE == msg.id) {
+            // | version (1) | txid (2) | addr |
+            char value[3 + wire::kMaxAddrSize];
+            int len = (msg.size >= 3) ? 
+                    wire::encodeAddr(self, value + 3, sizeof(value) - 3) : 0;
+            if (len > 0) {
+                memcpy(value, msg.value, 3);
+                writer.add(msg.id, value, 3 + len);
+            }
+            relays += 1;
+        } else {
+            writer.add(msg.id, self);
+            relays += 1;
+        }
+    }
+    return (writer.ok() && !writer.empty()) ? writer.size() : 0;
+}
+
+void Replayer::handleReply(Socket& sock, const Endpoint& peer,
+                           const char* data, int size, uint64_t recvNanos) {
+    m_replies += 1;
+    m_lastReplyNanos = recvNanos;
+    wire::Reader reader;
+    if (!reader.init(data, size)) {
+        m_malformed += 1;
+        return;
+    }
+    wire::MessageView msg;
+    while (reader.next(msg)) {
+        m_recvById[uint8_t(msg.id)] += 1;
+        if (MessageId::ADDR != msg.id) {
+            continue;
+        }
+        // the server must report the address we sent from; a wildcard
+        // source socket can only be checked by port
+        Endpoint addr;
+        bool correct = msg.addr(addr) && addr.port() == sock.addr.port();
+        if (correct && sock.addr.ip() != "0.0.0.0") {
+            correct = (addr == sock.addr);
+        }
+        if (correct) {
+            m_addrCorrect += 1;
+        } else {
+            m_addrWrong += 1;
+            LOGD << "wrong ADDR " << addr << " from " << peer << " for "
+                 << sock.addr;
+        }
+    }
+}
+
+void Replayer::finish() {
+    report();
+    uv_close((uv_handle_t*)&m_timer, nullptr);
+    for (Socket& sock : m_sockets) {
+        sock.udpSvc->removeMessageHandler(&sock);
+        sock.udpSvc->shutdown([](){});
+    }
+}
+
+void Replayer::report() {
+    const std::vector<CapturedPacket>& packets = m_capture.packets();
+    double sendSecs = double(m_lastSendNanos - m_startNanos) / 1e9;
+    double captureSecs = packets.empty() ?
+            0 : double(packets.back().offsetNanos) / 1e9;
+    uint64_t lastReply = (m_lastReplyNanos > m_startNanos) ?
+            m_lastReplyNanos : m_startNanos;
+    double replySecs = double(lastReply - m_startNanos) / 1e9;
+
+    printf("replayed %zu datagram(s) from %zu socket(s) in %.3fs "
+           "(captured over %.3fs)\n", packets.size(), m_sockets.size(),
+           sendSecs, captureSecs);
+    printf("queue rate %.0f datagrams/s, %llu send failure(s), "
+           "%llu wait(s) for a full socket\n",
+           (sendSecs > 0) ? double(packets.size()) / sendSecs : 0.0,
+           (unsigned long long)m_sendFailed,
+           (unsigned long long)m_sendBlocked);
+    printf("reply rate %.0f datagrams/s, %llu repl%s, %llu malformed\n",
+           (replySecs > 0) ? double(m_replies) / replySecs : 0.0,
+           (unsigned long long)m_replies, (m_replies == 1) ? "y" : "ies",
+           (unsigned long long)m_malformed);
+    printf("%-20s %12s %12s\n", "message", "sent", "received");
+    for (int id = 0; id < 256; id++) {
+        if (0 == m_sentById[id] && 0 == m_recvById[id]) {
+            continue;
+        }
+        const char* name = messageName(MessageId(id));
+        char idStr[8];
+        if (nullptr == name) {
+            snprintf(idStr, sizeof(idStr), "%d", id);
+            name = idStr;
+        }
+        printf("%-20s %12llu %12llu\n", name,
+               (unsigned long long)m_sentById[id],
+               (unsigned long long)m_recvById[id]);
+    }
+    printf("relay messages: %llu rewritten, %llu skipped\n",
+           (unsigned long long)m_relaysRewritten,
+           (unsigned long long)m_relaysSkipped);
+    printf("ADDR replies: %llu correct, %llu wrong\n",
+           (unsigned long long)m_addrCorrect,
+           (unsigned long long)m_addrWrong);
+}
+
+// -----------------------------------------------------------------------------
+// Section: main
+// -----------------------------------------------------------------------------
+int main(int argc, char* argv[]) {
+    std::string captureFile;
+    std::string svrAddrListStr;
+    std::string listenAddrStr;
+    int socketCount = 0;
+    double speed = 1;
+    int waitMillis = kDefaultWaitMillis;
+    RelayMode relayMode = kRelayRewrite;
+    int opt;
+    while ( (opt = longopt(argc, argv, kOptions)) != LONGOPT_DONE ) {
+        if (LONGOPT_NEED_PARAM == opt) {
+            const option_t& ent = kOptions[errindex];
+            LOGE << "missing parameter for -" << char(ent.val)
+                 << "--" << ent.name;
+            exit(1);
+        } else if (opt <= 0 || opt >= (int)ARRAY_SIZE(kOptions)) {
+            continue;
+        }
+        switch (opt) {
+        case 1:
+            captureFile = optparam;
+            break;
+        case 2:
+            svrAddrListStr = optparam;
+            break;
+        case 3:
+            listenAddrStr = optparam;
+            break;
+        case 4:
+            socketCount = atoi(optparam);
+            break;
+        case 5:
+            speed = atof(optparam);
+            break;
+        case 6:
+            waitMillis = atoi(optparam);
+            break;
+        case 7: {
+            int level = TRACE;
+            if (!logging::parseLevel(optparam, level)) {
+                LOGE << "invalid log level " << optparam;
+                return 1;
+            }
+            logging::setLevel(level);
+            break;
+        }
+        case 8:
+            if (strcmp(optparam, "rewrite") == 0) {
+                relayMode = kRelayRewrite;
+            } else if (strcmp(optparam, "skip") == 0) {
+                relayMode = kRelaySkip;
+            } else if (strcmp(optparam, "keep") == 0) {
+                relayMode = kRelayKeep;
+            } else {
+                LOGE << "invalid relay mode " << optparam;
+                return 1;
+            }
+            break;
+        }
+    }
+
+    if (captureFile.empty()) {
+        print_opt(kOptions);
+        return 1;
+    }
+
+    IpPort listenAddr;
+    if (listenAddrStr.empty()) {
+        listenAddr.ip = "0.0.0.0";
+        listenAddr.port = 40000;
+    } else if (!util::parseIpPort(listenAddrStr, listenAddr)) {
+        LOGE << "invalid argument " << listenAddrStr;
+        return 1;
+    }
+
+    std::vector<Endpoint> targets;
+    if (!svrAddrListStr.empty()) {
+        std::vector<IpPort> svrAddrList;
+        if (!util::parseIpPortList(svrAddrListStr, svrAddrList)) {
+            LOGE << "invalid argument " << svrAddrListStr;
+            return 1;
+        }
+        for (const IpPort& addr : svrAddrList) {
+            targets.emplace_back(AF_INET, addr.ip, addr.port);
+        }
+    }
+
+    CaptureReader capture;
+    if (!capture.load(captureFile)) {
+        LOGE << captureFile << " is not a capture of version "
+             << int(kCaptureVersion);
+        return 1;
+    }
+    if (capture.packets().empty()) {
+        LOGE << captureFile << " holds no datagrams";
+        return 1;
+    }
+
+    if (socketCount <= 0) {
+        std::vector<bool> seen(capture.endpoints().size(), false);
+        for (const CapturedPacket& pkt : capture.packets()) {
+            if (!seen[pkt.peerId]) {
+                seen[pkt.peerId] = true;
+                socketCount += 1;
+            }
+        }
+    }
+    if (socketCount > kMaxSockets) {
+        socketCount = kMaxSockets;
+    }
+    if (listenAddr.port == 0 ||
+            listenAddr.port + socketCount - 1 > UINT16_MAX) {
+        LOGE << "no room for " << socketCount << " source ports from "
+             << listenAddr.port;
+        return 1;
+    }
+
+    uv_loop_t mainloop;
+    uv_loop_init(&mainloop);
+
+    AsyncHandler handler(mainloop);
+
+    std::thread t([&mainloop]() {
+        uv_run(&mainloop, UV_RUN_DEFAULT);
+    });
+
+    Replayer* replayer = nullptr;
+    handler.post([&]() {
+        replayer = new Replayer(mainloop, capture, targets, listenAddr,
+                                socketCount, speed, waitMillis, relayMode);
+        handler.shutdown([](){});
+    });
+
+    t.join();
+    uv_loop_close(&mainloop);
+    delete replayer;
+
+    logging::flush();
+    return 0;
+}
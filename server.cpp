@@ -1,104 +1,876 @@
 #include "longopt.h"
 #include "log.h"
 #include "util.h"
-#include "async.h"
+#include "loopgroup.h"
 #include "endpoint.h"
 #include "message.h"
 #include "udpsvc.h"
-#include <thread>
+#include "pkttrace.h"
+#include "capture.h"
+#include "statshm.h"
+#include "loopmon.h"
+#include "busypoll.h"
+#include "ratelimit.h"
+#include "metrics.h"
+#include "peerauth.h"
+#include <atomic>
+#include <memory>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
 
 static const option_t kOptions[] = {
     { '-', NULL, 0, NULL, "arguments:" },
     { 'l', "listen-udp", LONGOPT_REQUIRE, NULL, "<ip>:<port>,<ip>:<port>,..."},
+    { 'r', "rate", LONGOPT_REQUIRE, NULL, "datagrams per second per source IP, 0 for no per-source limit (default 0), --max-lag shedding applies either way"},
+    { 'b', "burst", LONGOPT_REQUIRE, NULL, "burst size per source IP (default 40)"},
+    { 0, "max-lag", LONGOPT_REQUIRE, NULL, "event loop lag in ms that triggers load shedding, 0 to disable (default 200)"},
+    { 'v', "log-level", LONGOPT_REQUIRE, NULL, "trace(default), debug, info, warn or error"},
+    { 't', "trace", LONGOPT_REQUIRE, NULL, "keep the packet trace ring in this file rather than in memory"},
+    { 0, "trace-records", LONGOPT_REQUIRE, NULL, "packet trace ring size in records, 0 to turn tracing off (default 65536)"},
+    { 0, "capture", LONGOPT_REQUIRE, NULL, "save every inbound datagram to this file for natchk-replay"},
+    { 0, "stats-file", LONGOPT_REQUIRE, NULL, "publish metrics to this memory-mapped file for natchk-stat"},
+    { 0, "stats-interval", LONGOPT_REQUIRE, NULL, "milliseconds between stats file updates (default 1000)"},
+    { 0, "stall-threshold", LONGOPT_REQUIRE, NULL, "log event loop iterations busy for longer than this many milliseconds, 0 to disable (default 50)"},
+    { 0, "rcvbuf", LONGOPT_REQUIRE, NULL, "socket receive buffer in bytes (default: system)"},
+    { 0, "sndbuf", LONGOPT_REQUIRE, NULL, "socket send buffer in bytes (default: system)"},
+    { 0, "io-uring", LONGOPT_NOPARAM, NULL, "receive and send through io_uring, falls back to recvmmsg on kernels without multishot recvmsg (before 6.0)"},
+    { 0, "cpu", LONGOPT_REQUIRE, NULL, "pin the thread of event loop N to this core plus N"},
+    { 0, "busy-poll", LONGOPT_REQUIRE, NULL, "microseconds the loop keeps polling after a datagram before it blocks, also set as SO_BUSY_POLL (default 0)"},
+    { 0, "max-pending-sends", LONGOPT_REQUIRE, NULL, "replies queued per socket before further ones are dropped, 0 for no limit (default 16384)"},
+    { 0, "peers", LONGOPT_REQUIRE, NULL, "<ip>:<port>,... of other natchk-svr processes; those on a listen IP of this one, at ports clients do not list, answer its CHKRESTRICTEDCONE"},
+    { 0, "peer-secret-file", LONGOPT_REQUIRE, NULL, "file whose first line is the secret all --peers share, required with --peers"},
+    { 0, "loops", LONGOPT_REQUIRE, NULL, "event loops, each on a thread of its own, the listen addresses are spread over (default 1)"},
+    { 0, "trace-dump", LONGOPT_REQUIRE, NULL, "file SIGUSR1 saves the packet trace to (default natchk-svr-<pid>.trace)"},
     { 0, NULL, 0, NULL, NULL }
 };
 
+// Per-source rate limiting is opt-in, many clients may share one CGNAT
+// address; shedding on loop lag stays on
+static const int kDefaultRatePerSec = 0;
+static const int kDefaultBurst = 40;
+static const int kDefaultMaxLagMillis = 200;
+static const int kRateLimiterCapacity = 16384;
+static const int kRateLimiterIdleMillis = 60 * 1000;
+// mutexes the loops' lookups are spread over
+static const int kRateLimiterShards = 16;
+static const int kAdmissionReportIntervalMillis = 60 * 1000;
+// SENDFULLCONE and SENDRESTRICTEDCONE acted on per datagram, so one datagram
+// cannot fan out into many; Cluster never packs more
+static const int kMaxRelaysPerDatagram = 16;
+static const int kDefaultStallMillis = 50;
+static const int kDefaultMaxPendingSends = 16384;
+// STATS replies go to loopback only and may exceed kMaxDatagramSize
+static const int kMaxStatsReplySize = 8192;
+
+// -----------------------------------------------------------------------------
+// Section: AdmissionControl
+// -----------------------------------------------------------------------------
+// Decides whether a datagram is handled at all: the overload detector sheds
+// a share of the loop's traffic while it lags, the rate limiter, shared by
+// all loops, drops excess datagrams of individual sources. Counters are
+// logged periodically when anything was dropped, the rate limiter's by the
+// AdmissionControl of the first loop only.
+class AdmissionControl {
+    uv_loop_t& m_loop;
+    SharedRateLimiter& m_rateLimiter;
+    bool m_reportRateLimiter;
+    OverloadDetector m_overload;
+    uv_timer_t m_reportTimer;
+    uint64_t m_lastDropped;
+
+public:
+    static void onReport(uv_timer_t* handle) {
+        LoopMonitor::Scope scope(LoopMonitor::kTimer);
+        AdmissionControl* self = 
+                CONTAINER_OF(handle, AdmissionControl, m_reportTimer);
+        self->report();
+    }
+
+    AdmissionControl(uv_loop_t& loop, SharedRateLimiter& rateLimiter, 
+                     bool reportRateLimiter, int maxLagMillis)
+        : m_loop(loop), m_rateLimiter(rateLimiter)
+        , m_reportRateLimiter(reportRateLimiter)
+        , m_overload(loop, maxLagMillis), m_lastDropped(0) {
+        uv_timer_init(&loop, &m_reportTimer);
+        uv_timer_start(&m_reportTimer, onReport, 
+                       kAdmissionReportIntervalMillis, 
+                       kAdmissionReportIntervalMillis);
+        uv_unref((uv_handle_t*)&m_reportTimer);
+    }
+
+    bool admit(const Endpoint& peer) {
+        if (!m_overload.admit()) {
+            metrics::add(metrics::Counter::SHED);
+            return false;
+        }
+        if (!m_rateLimiter.allow(peer, uv_now(&m_loop))) {
+            metrics::add(metrics::Counter::RATE_LIMITED);
+            return false;
+        }
+        return true;
+    }
+
+private:
+    void report() {
+        RateLimiter::Stats rl;
+        memset(&rl, 0, sizeof(rl));
+        if (m_reportRateLimiter) {
+            rl = m_rateLimiter.stats();
+        }
+        const OverloadDetector::Stats& ol = m_overload.stats();
+        uint64_t dropped = rl.limited + ol.shed;
+        if (dropped == m_lastDropped) {
+            return;
+        }
+        m_lastDropped = dropped;
+        if (!m_reportRateLimiter) {
+            LOGI << "admission: shed " << ol.shed 
+                 << ", overload events " << ol.overloadEvents 
+                 << ", max lag " << ol.maxLagMillis << "ms";
+            return;
+        }
+        LOGI << "admission: allowed " << rl.allowed 
+             << ", rate limited " << rl.limited 
+             << ", shed " << ol.shed 
+             << ", overload events " << ol.overloadEvents 
+             << ", max lag " << ol.maxLagMillis << "ms" 
+             << ", buckets aged " << rl.aged 
+             << ", evicted " << rl.evicted;
+    }
+};
+
+// -----------------------------------------------------------------------------
+// Section: ReplyBatch
+// -----------------------------------------------------------------------------
+// Collects the replies produced while handling one datagram, so that
+// messages leaving the same socket for the same destination share a
+// single datagram. Legacy replies always get a datagram of their own.
+class ReplyBatch {
+    static const int kMaxEntries = 8;
+
+    struct Entry {
+        UdpService* udpSvc;
+        Endpoint dest;
+        wire::Writer writer;
+        char buf[wire::kMaxDatagramSize];
+    };
+
+    Entry m_entries[kMaxEntries];
+    int m_count;
+    int m_version;
+    uint16_t m_txid;
+
+public:
+    ReplyBatch(int version, uint16_t txid)
+        : m_count(0), m_version(version), m_txid(txid) {
+    }
+
+    ~ReplyBatch() {
+        flush();
+    }
+
+    bool add(UdpService& udpSvc, const Endpoint& dest, MessageId id) {
+        return addImpl(udpSvc, dest, id, nullptr);
+    }
+
+    bool add(UdpService& udpSvc, const Endpoint& dest, MessageId id, 
+             const Endpoint& addr) {
+        return addImpl(udpSvc, dest, id, &addr);
+    }
+
+    int pending() const {
+        return m_count;
+    }
+
+    void flush() {
+        for (int i = 0; i < m_count; i++) {
+            send(m_entries[i]);
+        }
+        m_count = 0;
+    }
+
+private:
+    // straight from the entry's buffer, the batch is on the stack of
+    // the loop thread; past the high-water mark the reply is dropped and
+    // counted as send_would_block
+    static void send(Entry& e) {
+        if (!e.writer.empty()) {
+            uv_buf_t buf = uv_buf_init((char*)e.writer.data(), 
+                                       e.writer.size());
+            e.udpSvc->sendInPlace(e.dest, &buf, 1);
+        }
+    }
+
+    static bool append(wire::Writer& writer, MessageId id, 
+                       const Endpoint* addr) {
+        if (!(addr ? writer.add(id, *addr) : writer.add(id))) {
+            return false;
+        }
+        metrics::messageOut(id);
+        return true;
+    }
+
+    bool addImpl(UdpService& udpSvc, const Endpoint& dest, MessageId id, 
+                 const Endpoint* addr) {
+        if (wire::kLegacy != m_version) {
+            for (int i = 0; i < m_count; i++) {
+                Entry& e = m_entries[i];
+                if (e.udpSvc != &udpSvc || e.dest != dest) {
+                    continue;
+                }
+                if (append(e.writer, id, addr)) {
+                    return true;
+                }
+                // full, ship what we have and start over in place
+                send(e);
+                e.writer = wire::Writer(e.buf, sizeof(e.buf), 
+                                        m_version, m_txid);
+                return append(e.writer, id, addr);
+            }
+        }
+        if (m_count == kMaxEntries) {
+            flush();
+        }
+        Entry& e = m_entries[m_count++];
+        e.udpSvc = &udpSvc;
+        e.dest = dest;
+        e.writer = wire::Writer(e.buf, sizeof(e.buf), m_version, m_txid);
+        return append(e.writer, id, addr);
+    }
+};
+
+// -----------------------------------------------------------------------------
+// Section: PeerHealth
+// -----------------------------------------------------------------------------
+// Whether each cluster peer answers, one view for the Clusters of all
+// loops. Every peer is sent a PING each kPeerPingIntervalMillis from the
+// loop PeerHealth is created on; one that has not answered with PONG for
+// kPeerDownMillis is down until it answers again. Only that loop writes,
+// the others read the down flags.
+class PeerHealth {
+    struct Peer {
+        Endpoint addr;
+        uint64_t lastPongMillis;
+        std::atomic<bool> down;
+    };
+
+    uv_loop_t& m_loop;
+    std::vector<Peer> m_peers;
+    uv_timer_t m_pingTimer;
+    UdpService* m_pingSvc;              // where PINGs leave from
+    const PeerAuth* m_auth;             // nullptr without peers
+
+public:
+    static void onPingTimer(uv_timer_t* handle) {
+        LoopMonitor::Scope scope(LoopMonitor::kTimer);
+        PeerHealth* self = CONTAINER_OF(handle, PeerHealth, m_pingTimer);
+        self->ping();
+    }
+
+    PeerHealth(uv_loop_t& loop, const std::vector<IpPort>& peers, 
+               const PeerAuth* auth)
+        : m_loop(loop), m_peers(peers.size()), m_pingSvc(nullptr)
+        , m_auth(auth) {
+        for (size_t i = 0; i < peers.size(); i++) {
+            Peer& peer = m_peers[i];
+            peer.addr = Endpoint(AF_INET, peers[i].ip, peers[i].port);
+            // a grace period for peers that start after us
+            peer.lastPongMillis = uv_now(&loop);
+            peer.down = false;
+        }
+        uv_timer_init(&loop, &m_pingTimer);
+        if (!m_peers.empty()) {
+            uv_timer_start(&m_pingTimer, onPingTimer, 0, 
+                           kPeerPingIntervalMillis);
+        }
+        uv_unref((uv_handle_t*)&m_pingTimer);
+    }
+
+    // The first server on our loop to attach sends the PINGs
+    void attach(UdpService& udpSvc, uv_loop_t& loop) {
+        if (nullptr == m_pingSvc && &loop == &m_loop) {
+            m_pingSvc = &udpSvc;
+        }
+    }
+
+    size_t size() const {
+        return m_peers.size();
+    }
+
+    const Endpoint& addr(int index) const {
+        return m_peers[index].addr;
+    }
+
+    // -1 if |addr| is not a peer
+    int find(const Endpoint& addr) const {
+        for (size_t i = 0; i < m_peers.size(); i++) {
+            if (m_peers[i].addr == addr) {
+                return int(i);
+            }
+        }
+        return -1;
+    }
+
+    bool down(int index) const {
+        return m_peers[index].down.load(std::memory_order_relaxed);
+    }
+
+    // PONGs answer PINGs from |m_pingSvc|, those arriving on another
+    // |loop| are stray and ignored
+    void onPong(const Endpoint& addr, uv_loop_t& loop) {
+        int index = find(addr);
+        if (index < 0 || &loop != &m_loop) {
+            return;
+        }
+        Peer& peer = m_peers[index];
+        peer.lastPongMillis = uv_now(&m_loop);
+        if (peer.down) {
+            peer.down = false;
+            metrics::addGauge(metrics::Gauge::PEERS_DOWN, -1);
+            LOGI << "peer " << addr << " is back";
+        }
+    }
+
+    // Closes the datagram of |size| bytes in |buf| with PEER_AUTH and sends
+    // it from |udpSvc|
+    void sendSigned(UdpService& udpSvc, const Endpoint& addr, char* buf, 
+                    int size, int capacity) const {
+        size = m_auth->sign(buf, size, capacity);
+        if (0 == size) {
+            return;
+        }
+        uv_buf_t piece = uv_buf_init(buf, size);
+        udpSvc.sendInPlace(addr, &piece, 1);
+    }
+
+    // True if the datagram comes from a peer's address and carries its
+    // signature
+    bool authentic(const Endpoint& addr, const char* data, int size) const {
+        return nullptr != m_auth && find(addr) >= 0 && 
+               m_auth->verify(data, size);
+    }
+
+private:
+    static const uint64_t kPeerPingIntervalMillis = 1000;
+    static const uint64_t kPeerDownMillis = 3000;
+
+    void ping() {
+        if (nullptr == m_pingSvc) {
+            return;
+        }
+        uint64_t now = uv_now(&m_loop);
+        char buf[wire::kHeaderSize + wire::kMessageHeaderSize + 
+                 PeerAuth::kMessageSize];
+        for (Peer& peer : m_peers) {
+            if (!peer.down && now - peer.lastPongMillis > kPeerDownMillis) {
+                peer.down = true;
+                metrics::addGauge(metrics::Gauge::PEERS_DOWN, 1);
+                LOGW << "peer " << peer.addr << " did not answer PING for " 
+                     << now - peer.lastPongMillis << "ms, marked down";
+            }
+            // signed anew each time, the clock moves on
+            wire::Writer writer(buf, sizeof(buf), wire::kCurrentVersion, 0);
+            writer.add(MessageId::PING);
+            sendSigned(*m_pingSvc, peer.addr, buf, writer.size(), sizeof(buf));
+            metrics::messageOut(MessageId::PING);
+        }
+    }
+
+    DISALLOW_COPY_MOVE_AND_ASSIGN(PeerHealth);
+};
+
+// -----------------------------------------------------------------------------
+// Section: Cluster
+// -----------------------------------------------------------------------------
+// Other natchk-svr processes, as seen from one loop. One listening on the
+// IP of a server without a sibling there sends RESTRICTEDCONE on its
+// behalf: the test asks whether the NAT admits the probed IP through
+// another port, so a peer on another IP cannot answer it. Nor can one at
+// a port the client contacts itself, its GETADDR opens that very port;
+// --peers must name ports clients do not list. Forwarded requests queue up per peer and leave once per loop
+// iteration, so a burst of clients costs a single SENDRESTRICTEDCONE
+// datagram per peer, of at most kMaxRelaysPerDatagram. Datagrams between
+// peers are signed by PeerAuth; an unsigned one from a peer's address is
+// treated like any client's, and peers go through admission control like
+// clients do.
+//
+// Down peers, as the shared PeerHealth has it, are neither forwarded to
+// nor relayed to.
+class Cluster {
+    // | version (1) | txid (2) | compact addr |
+    static const int kForwardSize = 3 + wire::kMaxAddrSize;
+
+    // SENDRESTRICTEDCONEs queued for a peer
+    struct Queue {
+        UdpService* udpSvc;
+        wire::Writer writer;
+        int forwards;
+        char buf[wire::kMaxDatagramSize];
+    };
+
+    uv_loop_t& m_loop;
+    PeerHealth& m_health;
+    std::vector<Queue> m_queues;
+    uv_check_t m_flushCheck;
+
+public:
+    static void onFlush(uv_check_t* handle) {
+        Cluster* self = CONTAINER_OF(handle, Cluster, m_flushCheck);
+        self->flush();
+    }
+
+    Cluster(uv_loop_t& loop, PeerHealth& health)
+        : m_loop(loop), m_health(health), m_queues(health.size()) {
+        for (Queue& queue : m_queues) {
+            queue.udpSvc = nullptr;
+            queue.forwards = 0;
+        }
+        uv_check_init(&loop, &m_flushCheck);
+        uv_check_start(&m_flushCheck, onFlush);
+        uv_unref((uv_handle_t*)&m_flushCheck);
+    }
+
+    void attach(UdpService& udpSvc) {
+        m_health.attach(udpSvc, m_loop);
+    }
+
+    bool isPeer(const Endpoint& addr) const {
+        return m_health.find(addr) >= 0;
+    }
+
+    bool authentic(const Endpoint& addr, const char* data, int size) const {
+        return m_health.authentic(addr, data, size);
+    }
+
+    // False for a peer that is down; servers outside the cluster are
+    // not watched and taken to be up
+    bool available(const Endpoint& addr) const {
+        int index = m_health.find(addr);
+        return index < 0 || !m_health.down(index);
+    }
+
+    void onPong(const Endpoint& addr) {
+        m_health.onPong(addr, m_loop);
+    }
+
+    // Answers the PING of a peer with a signed PONG
+    void pong(UdpService& udpSvc, const Endpoint& addr, uint16_t txid) {
+        char buf[wire::kHeaderSize + wire::kMessageHeaderSize + 
+                 PeerAuth::kMessageSize];
+        wire::Writer writer(buf, sizeof(buf), wire::kCurrentVersion, txid);
+        writer.add(MessageId::PONG);
+        m_health.sendSigned(udpSvc, addr, buf, writer.size(), sizeof(buf));
+        metrics::messageOut(MessageId::PONG);
+    }
+
+    // A peer that is up and on the IP of |local|, chosen by
+    // |client| so that its retransmissions land on the same peer; -1 if
+    // there is none
+    int pickPeer(const Endpoint& local, const Endpoint& client) const {
+        size_t count = 0;
+        for (size_t i = 0; i < m_queues.size(); i++) {
+            count += eligible(int(i), local) ? 1 : 0;
+        }
+        if (0 == count) {
+            return -1;
+        }
+        size_t nth = client.key().hash() % count;
+        for (size_t i = 0; i < m_queues.size(); i++) {
+            if (eligible(int(i), local) && 0 == nth--) {
+                return int(i);
+            }
+        }
+        return -1;
+    }
+
+    const Endpoint& peer(int index) const {
+        return m_health.addr(index);
+    }
+
+    // Queues SENDRESTRICTEDCONE for |client| to peer |index|, sent from
+    // |udpSvc| before the loop blocks again
+    bool forward(UdpService& udpSvc, int index, const Endpoint& client,
+                 int version, uint16_t txid) {
+        char value[kForwardSize];
+        value[0] = char(version);
+        value[1] = char(txid >> 8);
+        value[2] = char(txid & 0xff);
+        int len = wire::encodeAddr(client, value + 3, sizeof(value) - 3);
+        if (0 == len) {
+            return false;
+        }
+        Queue& queue = m_queues[index];
+        if (queue.udpSvc != &udpSvc) {
+            send(index);
+            queue.udpSvc = &udpSvc;
+        }
+        if (queue.writer.empty() || queue.forwards >= kMaxRelaysPerDatagram ||
+                !queue.writer.add(MessageId::SENDRESTRICTEDCONE, value, 
+                                  3 + len)) {
+            // unused or full, ship what we have and start over in place,
+            // leaving room for the signature
+            send(index);
+            queue.writer = wire::Writer(queue.buf, sizeof(queue.buf) - 
+                                        PeerAuth::kMessageSize, 
+                                        wire::kCurrentVersion, 0);
+            if (!queue.writer.add(MessageId::SENDRESTRICTEDCONE, value, 
+                                  3 + len)) {
+                return false;
+            }
+        }
+        queue.forwards++;
+        metrics::messageOut(MessageId::SENDRESTRICTEDCONE);
+        return true;
+    }
+
+    // Decodes the value of a SENDRESTRICTEDCONE
+    static bool parseForward(const wire::MessageView& msg, Endpoint& client,
+                             int& version, uint16_t& txid) {
+        if (msg.size < 3) {
+            return false;
+        }
+        const uint8_t* p = (const uint8_t*)msg.value;
+        version = p[0];
+        txid = uint16_t((p[1] << 8) | p[2]);
+        return (wire::kLegacy == version || wire::kVersion1 == version) &&
+               wire::decodeAddr(msg.value + 3, msg.size - 3, client);
+    }
+
+private:
+    // RESTRICTEDCONE must come from the probed IP through another port
+    bool eligible(int index, const Endpoint& local) const {
+        const Endpoint& addr = m_health.addr(index);
+        return !m_health.down(index) && addr != local &&
+               addr.key().hostOnly() == local.key().hostOnly();
+    }
+
+    void send(int index) {
+        Queue& queue = m_queues[index];
+        if (queue.udpSvc && !queue.writer.empty()) {
+            m_health.sendSigned(*queue.udpSvc, m_health.addr(index), 
+                                queue.buf, queue.writer.size(), 
+                                sizeof(queue.buf));
+        }
+        queue.writer = wire::Writer();
+        queue.forwards = 0;
+    }
+
+    void flush() {
+        for (size_t i = 0; i < m_queues.size(); i++) {
+            send(int(i));
+        }
+    }
+};
+
+// -----------------------------------------------------------------------------
+// Section: Server
+// -----------------------------------------------------------------------------
 class Server : public UdpService::IMessageHandler {
     uv_loop_t& m_loop;
     UdpService m_udpSvc;
+    Endpoint m_listenAddr;
+    AdmissionControl& m_admission;
+    Cluster& m_cluster;
 
     static std::vector<Server*> s_servers;
 
 public:
-    Server(uv_loop_t& loop, const Endpoint& listenAddr) 
-        : m_loop(loop), m_udpSvc(loop, listenAddr) {
+    // On loop |index| of |group|, which siblings on other loops relay to
+    // through its mailboxes
+    Server(LoopGroup& group, int index, const Endpoint& listenAddr, 
+           AdmissionControl& admission, Cluster& cluster, 
+           const UdpService::Options& options) 
+        : m_loop(group.loop(index))
+        , m_udpSvc(group, index, listenAddr, options)
+        , m_listenAddr(listenAddr)
+        , m_admission(admission), m_cluster(cluster) {
         m_udpSvc.addMessageHandler(this);
         m_udpSvc.start();
+        m_cluster.attach(m_udpSvc);
         s_servers.push_back(this);
     }
 
     void handleMessage(UdpService& udpSvc, const Endpoint& peer, 
-                       const char* data, int size) override {
-        MessageId msgId = MessageId(data[0]);
-        switch (msgId) {
-        case MessageId::GETADDR:
-            LOGD << "recv GETADDR from " << peer.ip() << ":" << peer.port();
-            sendAddr(peer);
-            break;
-        case MessageId::CHKFULLCONE:
-            LOGD << "recv CHKFULLCONE from " << peer.ip() << ":" << peer.port();
-            onCheckFullCone(peer, data, size);
-            break;
-        case MessageId::SENDFULLCONE:
-            LOGD << "recv SENDFULLCONE from " << peer.ip() 
-                 << ":" << peer.port();
-            onSendFullCone(data, size);
-            break;
-        case MessageId::CHKRESTRICTEDCONE:
-            LOGD << "recv CHKRESTRICTEDCONE from " << peer.ip() 
-                 << ":" << peer.port();
-            onCheckRestrictedCone(peer);
-        default:
-            break;
+                       const char* data, int size, 
+                       uint64_t recvNanos) override {
+        if (!isSibling(peer) && !m_admission.admit(peer)) {
+            return;
+        }
+        wire::Reader reader;
+        if (!reader.init(data, size)) {
+            LOGW << "malformed datagram of " << size << " bytes from " 
+                 << peer;
+            metrics::add(metrics::Counter::MALFORMED);
+            return;
+        }
+        // every message is answered in one pass, replies leave when
+        // |replies| goes out of scope
+        ReplyBatch replies(reader.version(), reader.txid());
+        bool fromPeer = m_cluster.authentic(peer, data, size);
+        int relays = 0;
+        wire::MessageView msg;
+        while (reader.next(msg)) {
+            uint64_t startNanos = uv_hrtime();
+            metrics::messageIn(msg.id);
+            switch (msg.id) {
+            case MessageId::PING:
+                LOGT << "recv PING from " << peer;
+                if (fromPeer) {
+                    m_cluster.pong(m_udpSvc, peer, reader.txid());
+                } else {
+                    replies.add(m_udpSvc, peer, MessageId::PONG);
+                }
+                break;
+            case MessageId::PONG:
+                LOGT << "recv PONG from " << peer;
+                if (fromPeer) {
+                    m_cluster.onPong(peer);
+                }
+                break;
+            case MessageId::GETADDR:
+                LOGD << "recv GETADDR from " << peer;
+                sendAddr(peer, replies);
+                break;
+            case MessageId::CHKFULLCONE:
+                LOGD << "recv CHKFULLCONE from " << peer;
+                onCheckFullCone(peer, msg, replies);
+                break;
+            case MessageId::SENDFULLCONE:
+                LOGD << "recv SENDFULLCONE from " << peer;
+                if (relayAllowed(peer, relays)) {
+                    onSendFullCone(msg, replies);
+                }
+                break;
+            case MessageId::CHKRESTRICTEDCONE:
+                LOGD << "recv CHKRESTRICTEDCONE from " << peer;
+                onCheckRestrictedCone(peer, reader, replies);
+                break;
+            case MessageId::SENDRESTRICTEDCONE:
+                LOGD << "recv SENDRESTRICTEDCONE from " << peer;
+                if (relayAllowed(peer, relays)) {
+                    onSendRestrictedCone(peer, fromPeer, msg);
+                }
+                break;
+            case MessageId::GETSTATS:
+                LOGD << "recv GETSTATS from " << peer;
+                onGetStats(peer, reader);
+                break;
+            default:
+                break;
+            }
+            metrics::recordProcessing(msg.id, uv_hrtime() - startNanos);
+        }
+        if (replies.pending() > 0) {
+            replies.flush();
+            metrics::record(metrics::Hist::REPLY_LATENCY, 
+                            uv_hrtime() - recvNanos);
         }
     }
 
 private:
-    void sendAddr(const Endpoint& peer) {
-        char buf[1 + sizeof(struct sockaddr_in6)];
-        memset(buf, 0, sizeof(buf));
-        buf[0] = char(MessageId::ADDR);
-        int size = peer.serializeToArray(buf + 1, sizeof(struct sockaddr_in6));
-        m_udpSvc.send(peer, buf, 1 + size);
-    }
-
-    void onCheckFullCone(const Endpoint& peer, const char* data, int size) {
-        Endpoint anotherSvr((const struct sockaddr*)(data + 1));
-        char buf[1 + sizeof(struct sockaddr_in6)];
-        memset(buf, 0, sizeof(buf));
-        buf[0] = char(MessageId::SENDFULLCONE);
-        int len = peer.serializeToArray(buf + 1, sizeof(struct sockaddr_in6));
-        m_udpSvc.send(anotherSvr, buf, 1 + len);
-        LOGD << "send SENDFULLCONE to " << anotherSvr.ip() 
-             << ":" << anotherSvr.port();
-    }
-
-    void onSendFullCone(const char* data, int size) {
-        Endpoint endpoint((const struct sockaddr*)(data + 1));
-        char buf[1];
-        buf[0] = char(MessageId::FULLCONE);
-        m_udpSvc.send(endpoint, buf, 1);
-        LOGD << "send FULLCONE to " << endpoint.ip() << ":" << endpoint.port();
-    }
-
-    void onCheckRestrictedCone(const Endpoint& peer) {
+    // relays between servers of this process are never throttled; they
+    // leave from the listen sockets, so only those endpoints match
+    static bool isSibling(const Endpoint& peer) {
         for (Server* svr : s_servers) {
-            if (svr != this) {
-                char buf[1];
-                buf[0] = char(MessageId::RESTRICTEDCONE);
-                svr->m_udpSvc.send(peer, buf, 1);
-                LOGD << "send RESTRICTEDCONE to " << peer.ip() 
-                     << ":" << peer.port();
-                break;
+            if (svr->m_listenAddr == peer) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Counts a relay message of the datagram against kMaxRelaysPerDatagram
+    static bool relayAllowed(const Endpoint& peer, int& relays) {
+        if (++relays <= kMaxRelaysPerDatagram) {
+            return true;
+        }
+        if (kMaxRelaysPerDatagram + 1 == relays) {
+            LOGW << "more than " << kMaxRelaysPerDatagram << " relays in a "
+                 << "datagram from " << peer << ", the rest ignored";
+        }
+        metrics::add(metrics::Counter::RELAYS_CAPPED);
+        return false;
+    }
+
+    void sendAddr(const Endpoint& peer, ReplyBatch& replies) {
+        replies.add(m_udpSvc, peer, MessageId::ADDR, peer);
+    }
+
+    void onCheckFullCone(const Endpoint& peer, const wire::MessageView& req, 
+                         ReplyBatch& replies) {
+        Endpoint anotherSvr;
+        if (!req.addr(anotherSvr)) {
+            LOGW << "invalid CHKFULLCONE from " << peer;
+            return;
+        }
+        // tell the client at once rather than let it time out into "not
+        // FULL CONE"; legacy clients would not understand
+        if (wire::kLegacy != req.version && !isSibling(anotherSvr) && 
+                !m_cluster.available(anotherSvr)) {
+            replies.add(m_udpSvc, peer, MessageId::PEER_UNAVAILABLE, 
+                        anotherSvr);
+            metrics::add(metrics::Counter::PEER_UNAVAILABLE);
+            LOGD << "send PEER_UNAVAILABLE " << anotherSvr << " to " << peer;
+            return;
+        }
+        // every retransmission is relayed: the server cannot tell a lost
+        // relay from a FULLCONE lost or filtered on its way to the client
+        replies.add(m_udpSvc, anotherSvr, MessageId::SENDFULLCONE, peer);
+        metrics::add(metrics::Counter::RELAYS);
+        LOGD << "send SENDFULLCONE to " << anotherSvr;
+    }
+
+    void onSendFullCone(const wire::MessageView& req, ReplyBatch& replies) {
+        Endpoint endpoint;
+        if (!req.addr(endpoint)) {
+            LOGW << "invalid SENDFULLCONE";
+            return;
+        }
+        replies.add(m_udpSvc, endpoint, MessageId::FULLCONE);
+        LOGD << "send FULLCONE to " << endpoint;
+    }
+
+    // Answered directly rather than through ReplyBatch, the report does not
+    // fit a regular datagram
+    void onGetStats(const Endpoint& peer, const wire::Reader& reader) {
+        if (!peer.loopback()) {
+            LOGW << "GETSTATS from non-loopback " << peer << " ignored";
+            return;
+        }
+        std::unique_ptr<metrics::Snapshot> snap(new metrics::Snapshot);
+        metrics::snapshot(*snap);
+        std::unique_ptr<char[]> text(new char[kMaxStatsReplySize]);
+        int len = metrics::format(*snap, text.get(), kMaxStatsReplySize - 
+                                  wire::kHeaderSize - wire::kMessageHeaderSize);
+        std::unique_ptr<char[]> buf(new char[kMaxStatsReplySize]);
+        wire::Writer writer(buf.get(), kMaxStatsReplySize, reader.version(), 
+                            reader.txid());
+        if (writer.add(MessageId::STATS, text.get(), len)) {
+            metrics::messageOut(MessageId::STATS);
+            // the reply keeps |buf| until it is sent
+            uv_buf_t piece = uv_buf_init(buf.get(), writer.size());
+            char* data = buf.get();
+            if (m_udpSvc.send(peer, &piece, 1, [data]() { delete[] data; }) 
+                    == UdpService::kSendQueued) {
+                buf.release();
             }
         }
     }
+
+    // RESTRICTED CONE lets in what comes from the probed IP through another
+    // port, PORT RESTRICTED does not; an answer from any other IP tests a
+    // different filter. A sibling of this process on our IP answers when
+    // there is one, a cluster peer otherwise.
+    void onCheckRestrictedCone(const Endpoint& peer, const wire::Reader& reader,
+                               ReplyBatch& replies) {
+        EndpointKey host = m_listenAddr.key().hostOnly();
+        for (Server* svr : s_servers) {
+            if (svr != this && svr->m_listenAddr.key().hostOnly() == host) {
+                replies.add(svr->m_udpSvc, peer, MessageId::RESTRICTEDCONE);
+                LOGD << "send RESTRICTEDCONE to " << peer;
+                return;
+            }
+        }
+        int index = m_cluster.pickPeer(m_listenAddr, peer);
+        if (index < 0) {
+            // an answer from elsewhere would test another filter
+            LOGW << "no server on " << m_listenAddr.ip() 
+                 << " to answer CHKRESTRICTEDCONE, not forwarded";
+            return;
+        }
+        if (m_cluster.forward(m_udpSvc, index, peer, reader.version(), 
+                              reader.txid())) {
+            metrics::add(metrics::Counter::RELAYS);
+            LOGD << "send SENDRESTRICTEDCONE to " << m_cluster.peer(index);
+        }
+    }
+
+    // Answers in the version and txid of the client's CHKRESTRICTEDCONE
+    void onSendRestrictedCone(const Endpoint& peer, bool fromPeer,
+                              const wire::MessageView& req) {
+        if (!fromPeer) {
+            LOGW << "SENDRESTRICTEDCONE from " << peer 
+                 << ", not signed by a cluster peer, ignored";
+            return;
+        }
+        Endpoint client;
+        int version = wire::kLegacy;
+        uint16_t txid = 0;
+        if (!Cluster::parseForward(req, client, version, txid)) {
+            LOGW << "invalid SENDRESTRICTEDCONE from " << peer;
+            return;
+        }
+        ReplyBatch replies(version, txid);
+        replies.add(m_udpSvc, client, MessageId::RESTRICTEDCONE);
+        LOGD << "send RESTRICTEDCONE to " << client;
+    }
 };
 
 std::vector<Server*> Server::s_servers;
 
+// SIGINT/SIGTERM leave the loop so main can close the capture and trace
+static uv_signal_t s_sigint;
+static uv_signal_t s_sigterm;
+
+static void onStopSignal(uv_signal_t* handle, int signum) {
+    LOGI << "signal " << signum << " received, stopping";
+    ((LoopGroup*)handle->data)->stop();
+}
+
+#ifdef SIGUSR1
+// SIGUSR1 saves the always-on packet trace for natchk-trace
+static uv_signal_t s_sigusr1;
+static std::string s_traceDumpFile;
+
+static void onDumpSignal(uv_signal_t* handle, int signum) {
+    ((PacketTrace*)handle->data)->save(s_traceDumpFile);
+}
+#endif
+
+// The first line of |path|, which must not be empty
+static bool readSecret(const std::string& path, std::string& secret) {
+    FILE* fp = fopen(path.c_str(), "r");
+    if (nullptr == fp) {
+        LOGE << "fopen " << path << ": " << strerror(errno);
+        return false;
+    }
+    char line[1024];
+    if (nullptr != fgets(line, sizeof(line), fp)) {
+        secret = line;
+    }
+    fclose(fp);
+    while (!secret.empty() && 
+            ('\n' == secret.back() || '\r' == secret.back())) {
+        secret.pop_back();
+    }
+    if (secret.empty()) {
+        LOGE << "no secret in " << path;
+        return false;
+    }
+    return true;
+}
+
 int main(int argc, char* argv[]) {
     std::string listenAddrListStr;
+    int ratePerSec = kDefaultRatePerSec;
+    int burst = kDefaultBurst;
+    int maxLagMillis = kDefaultMaxLagMillis;
+    std::string traceFile;
+    uint64_t traceRecords = kDefaultTraceRecords;
+    std::string traceDumpFile;
+    std::string captureFile;
+    std::string statsFile;
+    int statsIntervalMillis = kDefaultStatsIntervalMillis;
+    int stallMillis = kDefaultStallMillis;
+    UdpService::Options udpOptions;
+    // reply_latency counts from the kernel receive time
+    udpOptions.kernelTimestamps = true;
+    udpOptions.maxPendingSends = kDefaultMaxPendingSends;
+    int cpu = -1;
+    std::string peersStr;
+    std::string peerSecretFile;
+    int loopCount = 1;
     int opt;
     while ( (opt = longopt(argc, argv, kOptions)) != LONGOPT_DONE ) {
         if (LONGOPT_NEED_PARAM == opt) {
@@ -113,6 +885,72 @@ int main(int argc, char* argv[]) {
         case 1:
             listenAddrListStr = optparam;
             break;
+        case 2:
+            ratePerSec = atoi(optparam);
+            break;
+        case 3:
+            burst = atoi(optparam);
+            break;
+        case 4:
+            maxLagMillis = atoi(optparam);
+            break;
+        case 5: {
+            int level = TRACE;
+            if (!logging::parseLevel(optparam, level)) {
+                LOGE << "invalid log level " << optparam;
+                return 1;
+            }
+            logging::setLevel(level);
+            break;
+        }
+        case 6:
+            traceFile = optparam;
+            break;
+        case 7:
+            traceRecords = strtoull(optparam, NULL, 10);
+            break;
+        case 8:
+            captureFile = optparam;
+            break;
+        case 9:
+            statsFile = optparam;
+            break;
+        case 10:
+            statsIntervalMillis = atoi(optparam);
+            break;
+        case 11:
+            stallMillis = atoi(optparam);
+            break;
+        case 12:
+            udpOptions.recvBufferSize = atoi(optparam);
+            break;
+        case 13:
+            udpOptions.sendBufferSize = atoi(optparam);
+            break;
+        case 14:
+            udpOptions.ioUring = true;
+            break;
+        case 15:
+            cpu = atoi(optparam);
+            break;
+        case 16:
+            udpOptions.busyPollMicros = atoi(optparam);
+            break;
+        case 17:
+            udpOptions.maxPendingSends = atoi(optparam);
+            break;
+        case 18:
+            peersStr = optparam;
+            break;
+        case 19:
+            peerSecretFile = optparam;
+            break;
+        case 20:
+            loopCount = atoi(optparam);
+            break;
+        case 21:
+            traceDumpFile = optparam;
+            break;
         }
     }
 
@@ -127,24 +965,110 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    uv_loop_t mainloop;
-    uv_loop_init(&mainloop);
+    std::vector<IpPort> peerList;
+    if (!peersStr.empty() && !util::parseIpPortList(peersStr, peerList)) {
+        LOGE << "invalid argument " << peersStr;
+        return 1;
+    }
 
-    AsyncHandler handler(mainloop);
+    // without a shared secret anyone could pose as a peer
+    std::unique_ptr<PeerAuth> peerAuth;
+    if (!peerList.empty()) {
+        std::string secret;
+        if (peerSecretFile.empty()) {
+            LOGE << "--peers requires --peer-secret-file";
+            return 1;
+        }
+        if (!readSecret(peerSecretFile, secret)) {
+            return 1;
+        }
+        peerAuth.reset(new PeerAuth(secret));
+    }
 
-    std::thread t([&mainloop]() {
-        uv_run(&mainloop, UV_RUN_DEFAULT);
-    });
+    // always on, in memory unless a file is given
+    PacketTrace* trace = nullptr;
+    if (traceRecords > 0) {
+        trace = PacketTrace::open(traceFile, traceRecords);
+        if (nullptr == trace) {
+            return 1;
+        }
+        PacketTrace::install(trace);
+    }
+
+    PacketCapture* capture = nullptr;
+    if (!captureFile.empty()) {
+        capture = PacketCapture::open(captureFile);
+        if (nullptr == capture) {
+            return 1;
+        }
+        PacketCapture::install(capture);
+    }
+
+    StatsSegment* stats = nullptr;
+    if (!statsFile.empty()) {
+        stats = StatsSegment::open(statsFile, statsIntervalMillis);
+        if (nullptr == stats) {
+            return 1;
+        }
+    }
+
+    // a source is rate limited and a peer's health judged once for the
+    // process, overload and forward queues are per loop; the servers are
+    // set up before the threads start
+    LoopGroup group(loopCount);
+    SharedRateLimiter rateLimiter(ratePerSec, burst, kRateLimiterCapacity, 
+                                  kRateLimiterIdleMillis, kRateLimiterShards);
+    PeerHealth peerHealth(group.loop(0), peerList, peerAuth.get());
+    std::vector<std::unique_ptr<BusyPoll>> busyPolls;
+    std::vector<AdmissionControl*> admissions;
+    std::vector<Cluster*> clusters;
+    for (int i = 0; i < group.size(); i++) {
+        uv_loop_t& loop = group.loop(i);
+        busyPolls.emplace_back(new BusyPoll(loop, udpOptions.busyPollMicros));
+        admissions.push_back(new AdmissionControl(loop, rateLimiter, 0 == i,
+                                                  maxLagMillis));
+        clusters.push_back(new Cluster(loop, peerHealth));
+    }
+    uv_signal_init(&group.loop(0), &s_sigint);
+    s_sigint.data = &group;
+    uv_signal_start(&s_sigint, onStopSignal, SIGINT);
+    uv_signal_init(&group.loop(0), &s_sigterm);
+    s_sigterm.data = &group;
+    uv_signal_start(&s_sigterm, onStopSignal, SIGTERM);
+#ifdef SIGUSR1
+    if (nullptr != trace) {
+        s_traceDumpFile = traceDumpFile.empty() ? 
+                "natchk-svr-" + std::to_string(uv_os_getpid()) + ".trace" : 
+                traceDumpFile;
+        uv_signal_init(&group.loop(0), &s_sigusr1);
+        s_sigusr1.data = trace;
+        uv_signal_start(&s_sigusr1, onDumpSignal, SIGUSR1);
+    }
+#endif
+    for (const IpPort& addr : listenAddrList) {
+        Endpoint endpoint(AF_INET, addr.ip, addr.port);
+        int i = group.place();
+        new Server(group, i, endpoint, *admissions[i], *clusters[i], 
+                   udpOptions);
+    }
 
-    handler.post([&]() {
-        for (const IpPort& addr : listenAddrList) {
-            Endpoint endpoint(AF_INET, addr.ip, addr.port);
-            new Server(mainloop, endpoint);
+    group.start([&](int index, uv_loop_t& loop) {
+        if (cpu >= 0) {
+            BusyPoll::pinThread(cpu + index);
         }
+        new LoopMonitor(loop, stallMillis);
+        busyPolls[index]->run();
+    }, [&](int index, uv_loop_t& loop) {
+        busyPolls[index]->stop();
+        (void)loop;
     });
+    group.join();
 
-    t.join();
-    uv_loop_close(&mainloop);
+    PacketTrace::install(nullptr);
+    delete trace;
+    PacketCapture::install(nullptr);
+    delete capture;
+    delete stats;
 
     return 0;
 }
@@ -0,0 +1,212 @@
+#include "statshm.h"
+#include "log.h"
+#include <chrono>
+#include <string.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static const char kStatsMagic[8] = { 'N', 'A', 'T', 'C', 'H', 'K', 'S', 'T' };
+static const int kMaxReadRetries = 1000;
+
+static uint64_t realtimeNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// -----------------------------------------------------------------------------
+// Section: StatsSegment
+// -----------------------------------------------------------------------------
+// static
+StatsSegment* StatsSegment::open(const std::string& path, int intervalMillis) {
+#ifdef _WIN32
+    LOGE << "stats segment is not supported on this platform";
+    return nullptr;
+#else
+    if (intervalMillis <= 0) {
+        return nullptr;
+    }
+    size_t size = sizeof(StatsSegmentHeader) + sizeof(StatsSegmentBody);
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        LOGE << "open " << path << ": " << strerror(errno);
+        return nullptr;
+    }
+    if (ftruncate(fd, off_t(size)) != 0) {
+        LOGE << "ftruncate " << path << ": " << strerror(errno);
+        ::close(fd);
+        return nullptr;
+    }
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, 0);
+    ::close(fd);
+    if (MAP_FAILED == addr) {
+        LOGE << "mmap " << path << ": " << strerror(errno);
+        return nullptr;
+    }
+    StatsSegmentHeader* header = (StatsSegmentHeader*)addr;
+    header->version = kStatsSegmentVersion;
+    header->headerSize = sizeof(StatsSegmentHeader);
+    header->bodySize = sizeof(StatsSegmentBody);
+    header->counterCount = metrics::kCounterCount;
+    header->gaugeCount = metrics::kGaugeCount;
+    header->messageSlots = metrics::kMessageSlots;
+    header->bucketCount = metrics::HistogramLayout::kBucketCount;
+    header->histCount = metrics::kHistCount;
+    header->reserved0 = 0;
+    header->pid = uint32_t(getpid());
+    header->intervalMillis = uint64_t(intervalMillis);
+    header->startRealtimeNanos = realtimeNanos();
+    header->seq.store(0, std::memory_order_relaxed);
+    header->updates = 0;
+    // the magic goes last, a reader never sees a half-initialized header
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(header->magic, kStatsMagic, sizeof(header->magic));
+    LOGI << "publishing stats to " << path << " every " << intervalMillis
+         << "ms";
+    return new StatsSegment(header, size);
+#endif
+}
+
+StatsSegment::StatsSegment(StatsSegmentHeader* header, size_t mappedSize)
+    : m_header(header), m_body((StatsSegmentBody*)(header + 1))
+    , m_mappedSize(mappedSize), m_snapshot(new metrics::Snapshot)
+    , m_stop(false) {
+    publish();
+    m_thread = std::thread([this]() {
+        run();
+    });
+}
+
+StatsSegment::~StatsSegment() {
+    {
+        std::unique_lock<std::mutex> l(m_mutex);
+        m_stop = true;
+    }
+    m_cond.notify_one();
+    m_thread.join();
+    publish();
+#ifndef _WIN32
+    munmap(m_header, m_mappedSize);
+#endif
+    delete m_snapshot;
+}
+
+void StatsSegment::run() {
+    std::chrono::milliseconds interval(m_header->intervalMillis);
+    std::unique_lock<std::mutex> l(m_mutex);
+    while (!m_cond.wait_for(l, interval, [this]() { return m_stop; })) {
+        l.unlock();
+        publish();
+        l.lock();
+    }
+}
+
+void StatsSegment::publish() {
+    // merge outside the write section to keep it short
+    metrics::snapshot(*m_snapshot);
+    const metrics::Snapshot& snap = *m_snapshot;
+
+    uint64_t seq = m_header->seq.load(std::memory_order_relaxed);
+    m_header->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    memcpy(m_body->counters, snap.counters, sizeof(m_body->counters));
+    memcpy(m_body->gauges, snap.gauges, sizeof(m_body->gauges));
+    memcpy(m_body->messagesIn, snap.messagesIn, sizeof(m_body->messagesIn));
+    memcpy(m_body->messagesOut, snap.messagesOut,
+           sizeof(m_body->messagesOut));
+    for (int i = 0; i < metrics::kMessageSlots; i++) {
+        memcpy(m_body->processing[i], snap.processing[i].counts,
+               sizeof(m_body->processing[i]));
+    }
+    for (int i = 0; i < metrics::kHistCount; i++) {
+        memcpy(m_body->histograms[i], snap.histograms[i].counts,
+               sizeof(m_body->histograms[i]));
+    }
+    m_header->updateRealtimeNanos = realtimeNanos();
+    m_header->updates += 1;
+
+    m_header->seq.store(seq + 2, std::memory_order_release);
+}
+
+// -----------------------------------------------------------------------------
+// Section: StatsSegmentReader
+// -----------------------------------------------------------------------------
+StatsSegmentReader::StatsSegmentReader()
+    : m_header(nullptr), m_mappedSize(0) {
+}
+
+StatsSegmentReader::~StatsSegmentReader() {
+#ifndef _WIN32
+    if (nullptr != m_header) {
+        munmap((void*)m_header, m_mappedSize);
+    }
+#endif
+}
+
+bool StatsSegmentReader::open(const std::string& path) {
+#ifdef _WIN32
+    return false;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    size_t size = sizeof(StatsSegmentHeader) + sizeof(StatsSegmentBody);
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < size) {
+        ::close(fd);
+        return false;
+    }
+    void* addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (MAP_FAILED == addr) {
+        return false;
+    }
+    const StatsSegmentHeader* header = (const StatsSegmentHeader*)addr;
+    if (memcmp(header->magic, kStatsMagic, sizeof(header->magic)) != 0 ||
+            header->version != kStatsSegmentVersion ||
+            header->headerSize != sizeof(StatsSegmentHeader) ||
+            header->bodySize != sizeof(StatsSegmentBody) ||
+            header->counterCount != uint32_t(metrics::kCounterCount) ||
+            header->gaugeCount != uint32_t(metrics::kGaugeCount) ||
+            header->messageSlots != uint32_t(metrics::kMessageSlots) ||
+            header->bucketCount !=
+                    uint32_t(metrics::HistogramLayout::kBucketCount) ||
+            header->histCount != uint32_t(metrics::kHistCount)) {
+        munmap(addr, size);
+        return false;
+    }
+    m_header = header;
+    m_mappedSize = size;
+    return true;
+#endif
+}
+
+bool StatsSegmentReader::read(StatsSegmentBody& body,
+                              uint64_t* updateRealtimeNanos) {
+    const StatsSegmentBody* src = (const StatsSegmentBody*)(m_header + 1);
+    for (int i = 0; i < kMaxReadRetries; i++) {
+        uint64_t before = m_header->seq.load(std::memory_order_acquire);
+        if (before & 1) {
+            std::this_thread::yield();
+            continue;
+        }
+        memcpy(&body, src, sizeof(body));
+        uint64_t updated = m_header->updateRealtimeNanos;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (m_header->seq.load(std::memory_order_relaxed) == before) {
+            if (nullptr != updateRealtimeNanos) {
+                *updateRealtimeNanos = updated;
+            }
+            return true;
+        }
+    }
+    return false;
+}
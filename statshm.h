@@ -0,0 +1,114 @@
+#pragma once
+
+#include "util.h"
+#include "metrics.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// -----------------------------------------------------------------------------
+// Stats segment layout
+//
+// A memory-mapped file holding the latest metrics::Snapshot of a process:
+// a 128-byte header followed by StatsSegmentBody. The publisher bumps |seq|
+// to an odd value, rewrites the body and bumps it to even again; a reader
+// copies the body and retries unless |seq| was the same even value before
+// and after the copy. The dimensions in the header must match the reader's
+// own build.
+// -----------------------------------------------------------------------------
+struct StatsSegmentHeader {
+    char magic[8];                  // "NATCHKST"
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t bodySize;
+    uint32_t counterCount;
+    uint32_t gaugeCount;
+    uint32_t messageSlots;
+    uint32_t bucketCount;
+    uint32_t histCount;
+    uint32_t pid;
+    uint32_t reserved0;
+    uint64_t intervalMillis;
+    uint64_t startRealtimeNanos;
+    std::atomic<uint64_t> seq;
+    uint64_t updateRealtimeNanos;   // written inside the seqlock
+    uint64_t updates;               // written inside the seqlock
+    uint8_t reserved[40];
+};
+
+struct StatsSegmentBody {
+    uint64_t counters[metrics::kCounterCount];
+    int64_t gauges[metrics::kGaugeCount];
+    uint64_t messagesIn[metrics::kMessageSlots];
+    uint64_t messagesOut[metrics::kMessageSlots];
+    uint64_t processing[metrics::kMessageSlots]
+                       [metrics::HistogramLayout::kBucketCount];
+    uint64_t histograms[metrics::kHistCount]
+                       [metrics::HistogramLayout::kBucketCount];
+};
+
+static_assert(sizeof(StatsSegmentHeader) == 128, "stats header is 128 bytes");
+
+static const uint32_t kStatsSegmentVersion = 6;
+static const int kDefaultStatsIntervalMillis = 1000;
+
+// -----------------------------------------------------------------------------
+// Section: StatsSegment
+// -----------------------------------------------------------------------------
+// Publishes metrics::snapshot() into the segment from a thread of its own,
+// so scraping never costs the event loop anything.
+class StatsSegment {
+public:
+    // Creates or truncates |path| and starts publishing every
+    // |intervalMillis|
+    static StatsSegment* open(const std::string& path, int intervalMillis);
+
+    // Publishes once more and stops the thread
+    ~StatsSegment();
+
+private:
+    StatsSegment(StatsSegmentHeader* header, size_t mappedSize);
+
+    void run();
+    void publish();
+
+    StatsSegmentHeader* m_header;
+    StatsSegmentBody* m_body;
+    size_t m_mappedSize;
+    metrics::Snapshot* m_snapshot;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    bool m_stop;
+    std::thread m_thread;
+
+    DISALLOW_COPY_MOVE_AND_ASSIGN(StatsSegment);
+};
+
+// -----------------------------------------------------------------------------
+// Section: StatsSegmentReader
+// -----------------------------------------------------------------------------
+class StatsSegmentReader {
+public:
+    StatsSegmentReader();
+    ~StatsSegmentReader();
+
+    // Maps |path| read-only, false if it is not a compatible segment
+    bool open(const std::string& path);
+
+    // Copies a consistent body into |body|, false if the publisher kept
+    // the segment busy for too long
+    bool read(StatsSegmentBody& body, uint64_t* updateRealtimeNanos);
+
+    const StatsSegmentHeader& header() const {
+        return *m_header;
+    }
+
+private:
+    const StatsSegmentHeader* m_header;
+    size_t m_mappedSize;
+
+    DISALLOW_COPY_MOVE_AND_ASSIGN(StatsSegmentReader);
+};
@@ -0,0 +1,202 @@
+#include "longopt.h"
+#include "log.h"
+#include "util.h"
+#include "metrics.h"
+#include "statshm.h"
+#include <chrono>
+#include <time.h>
+#include <memory>
+#include <string>
+#include <thread>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const option_t kOptions[] = {
+    { '-', NULL, 0, NULL, "arguments:" },
+    { 'f', "file", LONGOPT_REQUIRE, NULL, "stats segment written by natchk-svr --stats-file"},
+    { 'i', "interval", LONGOPT_REQUIRE, NULL, "seconds between rows (default 1)"},
+    { 'c', "count", LONGOPT_REQUIRE, NULL, "number of rows, 0 for no limit (default 0)"},
+    { 'a', "all", LONGOPT_NOPARAM, NULL, "print every counter and histogram once and exit"},
+    { 0, NULL, 0, NULL, NULL }
+};
+
+static const int kRowsPerHeader = 20;
+
+typedef metrics::Counter Counter;
+
+// Turns a segment body back into a snapshot for metrics::format() and
+// the percentile helpers
+static void toSnapshot(const StatsSegmentBody& body, metrics::Snapshot& snap) {
+    memcpy(snap.counters, body.counters, sizeof(snap.counters));
+    memcpy(snap.gauges, body.gauges, sizeof(snap.gauges));
+    memcpy(snap.messagesIn, body.messagesIn, sizeof(snap.messagesIn));
+    memcpy(snap.messagesOut, body.messagesOut, sizeof(snap.messagesOut));
+    for (int i = 0; i < metrics::kMessageSlots; i++) {
+        memcpy(snap.processing[i].counts, body.processing[i],
+               sizeof(snap.processing[i].counts));
+    }
+    for (int i = 0; i < metrics::kHistCount; i++) {
+        memcpy(snap.histograms[i].counts, body.histograms[i],
+               sizeof(snap.histograms[i].counts));
+    }
+    snap.shards = 0;
+}
+
+// Histogram of what was recorded between |prev| and |cur|
+static void histogramDelta(const uint64_t* cur, const uint64_t* prev,
+                           metrics::HistogramSnapshot& out) {
+    for (int i = 0; i < metrics::HistogramLayout::kBucketCount; i++) {
+        out.counts[i] += cur[i] - prev[i];
+    }
+}
+
+static void printHeader() {
+    printf("%-8s %8s %8s %8s %8s %6s %6s %6s %6s %6s %6s %5s %5s %6s %6s "
+           "%5s %8s %8s %8s %9s %8s %5s %5s\n",
+           "time", "rx/s", "tx/s", "rxKB/s", "txKB/s", "err", "bad",
+           "limit", "shed", "relay", "kdrop", "queue", "hdlr", "rxqKB",
+           "txqKB", "stall",
+           "proc50us", "proc99us", "send99us", "busyMaxus", "reply99us",
+           "cpu%", "spin%");
+}
+
+static void printRow(const StatsSegmentBody& cur, const StatsSegmentBody& prev,
+                     double secs, metrics::HistogramSnapshot& scratch) {
+    auto delta = [&](Counter c) {
+        return cur.counters[int(c)] - prev.counters[int(c)];
+    };
+    auto rate = [&](Counter c) {
+        return (secs > 0) ? double(delta(c)) / secs : 0.0;
+    };
+
+    scratch.clear();
+    for (int i = 0; i < metrics::kMessageSlots; i++) {
+        histogramDelta(cur.processing[i], prev.processing[i], scratch);
+    }
+    double proc50 = double(scratch.percentile(0.50)) / 1000;
+    double proc99 = double(scratch.percentile(0.99)) / 1000;
+    scratch.clear();
+    int send = int(metrics::Hist::SEND_LATENCY);
+    histogramDelta(cur.histograms[send], prev.histograms[send], scratch);
+    double send99 = double(scratch.percentile(0.99)) / 1000;
+    scratch.clear();
+    int busy = int(metrics::Hist::LOOP_BUSY);
+    histogramDelta(cur.histograms[busy], prev.histograms[busy], scratch);
+    double busyMax = double(scratch.max()) / 1000;
+    scratch.clear();
+    int reply = int(metrics::Hist::REPLY_LATENCY);
+    histogramDelta(cur.histograms[reply], prev.histograms[reply], scratch);
+    double reply99 = double(scratch.percentile(0.99)) / 1000;
+    // loop thread CPU and spinning, as a share of one core
+    double cpu = rate(Counter::LOOP_CPU_NANOS) / 1e7;
+    double spin = rate(Counter::BUSY_POLL_SPIN_NANOS) / 1e7;
+
+    char ts[16];
+    time_t now = time(nullptr);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    strftime(ts, sizeof(ts), "%H:%M:%S", &tm);
+    printf("%-8s %8.0f %8.0f %8.1f %8.1f %6llu %6llu %6llu %6llu %6llu %6llu "
+           "%5lld %5lld %6lld %6lld %5llu %8.1f %8.1f %8.1f %9.1f %8.1f "
+           "%5.0f %5.0f\n", ts,
+           rate(Counter::RX_DATAGRAMS), rate(Counter::TX_DATAGRAMS),
+           rate(Counter::RX_BYTES) / 1024, rate(Counter::TX_BYTES) / 1024,
+           (unsigned long long)delta(Counter::SEND_ERRORS),
+           (unsigned long long)delta(Counter::MALFORMED),
+           (unsigned long long)delta(Counter::RATE_LIMITED),
+           (unsigned long long)delta(Counter::SHED),
+           (unsigned long long)delta(Counter::RELAYS),
+           (unsigned long long)delta(Counter::KERNEL_DROPS),
+           (long long)cur.gauges[int(metrics::Gauge::ASYNC_QUEUE_DEPTH)],
+           (long long)cur.gauges[int(metrics::Gauge::MESSAGE_HANDLERS)],
+           (long long)cur.gauges[int(metrics::Gauge::RECV_QUEUE_BYTES)] / 1024,
+           (long long)cur.gauges[int(metrics::Gauge::SEND_QUEUE_BYTES)] / 1024,
+           (unsigned long long)delta(Counter::LOOP_STALLS),
+           proc50, proc99, send99, busyMax, reply99, cpu, spin);
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+    std::string statsFile;
+    double intervalSecs = 1;
+    long count = 0;
+    bool all = false;
+    int opt;
+    while ( (opt = longopt(argc, argv, kOptions)) != LONGOPT_DONE ) {
+        if (LONGOPT_NEED_PARAM == opt) {
+            const option_t& ent = kOptions[errindex];
+            LOGE << "missing parameter for -" << char(ent.val)
+                 << "--" << ent.name;
+            exit(1);
+        } else if (opt <= 0 || opt >= (int)ARRAY_SIZE(kOptions)) {
+            continue;
+        }
+        switch (opt) {
+        case 1:
+            statsFile = optparam;
+            break;
+        case 2:
+            intervalSecs = atof(optparam);
+            break;
+        case 3:
+            count = atol(optparam);
+            break;
+        case 4:
+            all = true;
+            break;
+        }
+    }
+
+    if (statsFile.empty() || intervalSecs <= 0) {
+        print_opt(kOptions);
+        return 1;
+    }
+
+    StatsSegmentReader reader;
+    if (!reader.open(statsFile)) {
+        LOGE << statsFile << " is not a stats segment of version "
+             << kStatsSegmentVersion << " with this build's layout";
+        return 1;
+    }
+
+    std::unique_ptr<StatsSegmentBody> prev(new StatsSegmentBody);
+    std::unique_ptr<StatsSegmentBody> cur(new StatsSegmentBody);
+    uint64_t prevUpdate = 0;
+    if (!reader.read(*prev, &prevUpdate)) {
+        LOGE << "segment stayed busy, is the publisher stuck?";
+        return 1;
+    }
+
+    if (all) {
+        std::unique_ptr<metrics::Snapshot> snap(new metrics::Snapshot);
+        toSnapshot(*prev, *snap);
+        std::unique_ptr<char[]> text(new char[64 * 1024]);
+        int len = metrics::format(*snap, text.get(), 64 * 1024);
+        printf("pid %u, %llu update(s)\n", reader.header().pid,
+               (unsigned long long)reader.header().updates);
+        fwrite(text.get(), 1, len, stdout);
+        return 0;
+    }
+
+    std::unique_ptr<metrics::HistogramSnapshot> scratch(
+            new metrics::HistogramSnapshot);
+    for (long row = 0; 0 == count || row < count; row++) {
+        if (row % kRowsPerHeader == 0) {
+            printHeader();
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(
+                int64_t(intervalSecs * 1e6)));
+        uint64_t curUpdate = 0;
+        if (!reader.read(*cur, &curUpdate)) {
+            LOGW << "segment stayed busy, row skipped";
+            continue;
+        }
+        // rates are per publishing interval, not per sampling interval
+        double secs = double(curUpdate - prevUpdate) / 1e9;
+        prevUpdate = curUpdate;
+        printRow(*cur, *prev, secs, *scratch);
+        std::swap(prev, cur);
+    }
+    return 0;
+}
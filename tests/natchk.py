@@ -0,0 +1,145 @@
+"""Loopback helpers for the natchk-svr tests: the version 1 wire format, see
+message.h, and a server process that lives for the duration of a test."""
+
+import socket
+import struct
+import subprocess
+import sys
+import time
+
+PING = 1
+GETADDR = 2
+ADDR = 3
+CHKFULLCONE = 4
+SENDFULLCONE = 5
+FULLCONE = 6
+CHKRESTRICTEDCONE = 7
+RESTRICTEDCONE = 8
+GETSTATS = 9
+STATS = 10
+SENDRESTRICTEDCONE = 11
+PONG = 12
+PEER_UNAVAILABLE = 13
+PEER_AUTH = 14
+
+
+def encode_addr(addr):
+    ip, port = addr
+    return struct.pack("!BH", 4, port) + socket.inet_aton(ip)
+
+
+def decode_addr(value):
+    family, port = struct.unpack("!BH", value[:3])
+    if family != 4 or len(value) != 7:
+        raise ValueError("not an IPv4 compact address")
+    return socket.inet_ntoa(value[3:7]), port
+
+
+def datagram(txid, *messages):
+    """messages are (id, value) pairs"""
+    data = struct.pack("!BBH", 0x80, 1, txid)
+    for msg_id, value in messages:
+        data += struct.pack("!BH", msg_id, len(value)) + value
+    return data
+
+
+def parse(data):
+    """(txid, [(id, value), ...]) of a version 1 datagram"""
+    marker, version, txid = struct.unpack("!BBH", data[:4])
+    if marker != 0x80 or version != 1:
+        raise ValueError("not a version 1 datagram")
+    messages = []
+    pos = 4
+    while pos < len(data):
+        msg_id, length = struct.unpack("!BH", data[pos:pos + 3])
+        messages.append((msg_id, data[pos + 3:pos + 3 + length]))
+        pos += 3 + length
+    return txid, messages
+
+
+def udp_socket(ip):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind((ip, 0))
+    return sock
+
+
+def free_port(ip):
+    sock = udp_socket(ip)
+    port = sock.getsockname()[1]
+    sock.close()
+    return port
+
+
+def recv(sock, timeout):
+    """(txid, messages, source) of the next datagram, None on timeout"""
+    sock.settimeout(timeout)
+    try:
+        data, source = sock.recvfrom(65536)
+    except socket.timeout:
+        return None
+    txid, messages = parse(data)
+    return txid, messages, source
+
+
+def expect(sock, msg_id, timeout):
+    """(txid, value, source) of the first message |msg_id| to arrive"""
+    deadline = time.time() + timeout
+    while True:
+        left = deadline - time.time()
+        got = recv(sock, left) if left > 0 else None
+        if got is None:
+            return None
+        txid, messages, source = got
+        for mid, value in messages:
+            if mid == msg_id:
+                return txid, value, source
+
+
+class Server(object):
+    """natchk-svr listening on |addr| and any |siblings|, up once |addr|
+    answers PING"""
+
+    def __init__(self, binary, addr, *args, **kwargs):
+        self.addr = addr
+        listen = [addr] + list(kwargs.get("siblings", ()))
+        self.proc = subprocess.Popen(
+            [binary, "-l", ",".join("%s:%d" % a for a in listen),
+             "-v", "info"] + list(args),
+            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        sock = udp_socket(addr[0])
+        try:
+            for _ in range(50):
+                if self.proc.poll() is not None:
+                    raise RuntimeError("natchk-svr on %s:%d exited with %d"
+                                       % (addr + (self.proc.returncode,)))
+                sock.sendto(datagram(0, (PING, b"")), addr)
+                if expect(sock, PONG, 0.1) is not None:
+                    return
+            raise RuntimeError("natchk-svr on %s:%d does not answer"
+                               % addr)
+        finally:
+            sock.close()
+
+    def stop(self):
+        if self.proc.poll() is None:
+            self.proc.terminate()
+            self.proc.wait()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.stop()
+
+
+def run(test):
+    """Calls test(binary) with the natchk-svr path from the command line"""
+    if len(sys.argv) != 2:
+        sys.stderr.write("usage: %s <natchk-svr>\n" % sys.argv[0])
+        sys.exit(2)
+    try:
+        test(sys.argv[1])
+    except AssertionError as e:
+        sys.stderr.write("FAIL: %s\n" % e)
+        sys.exit(1)
+    print("PASS")
@@ -0,0 +1,128 @@
+"""Two natchk-svr processes on one IP clustered with --peers:
+CHKRESTRICTEDCONE sent to one is answered by the other through its port,
+never by a peer on another IP, datagrams between them must carry a PEER_AUTH
+signature, and a peer that stops answering PING is reported through
+PEER_UNAVAILABLE."""
+
+import hashlib
+import hmac
+import struct
+import tempfile
+import time
+
+import natchk
+
+SECRET = b"natchk cluster test"
+# kPeerDownMillis plus a PING interval
+PEER_DOWN = 4.5
+
+
+def sign(data):
+    """|data| closed by the PEER_AUTH message PeerAuth::sign appends"""
+    clock = struct.pack("!Q", int(time.time() * 1000))
+    mac = hmac.new(SECRET, data + clock, hashlib.sha256).digest()[:16]
+    return data + struct.pack("!BH", natchk.PEER_AUTH, 24) + clock + mac
+
+
+def signed(data):
+    """True if |data| ends in a PEER_AUTH that checks out against SECRET"""
+    head, tail = data[:-27], data[-27:]
+    if tail[:3] != struct.pack("!BH", natchk.PEER_AUTH, 24):
+        return False
+    clock, mac = tail[3:11], tail[11:]
+    expected = hmac.new(SECRET, head + clock, hashlib.sha256).digest()[:16]
+    return hmac.compare_digest(mac, expected)
+
+
+def forward(txid, client):
+    """SENDRESTRICTEDCONE for |client|'s version 1 request |txid|"""
+    value = struct.pack("!BH", 1, txid) + natchk.encode_addr(client)
+    return natchk.datagram(0, (natchk.SENDRESTRICTEDCONE, value))
+
+
+def test(binary):
+    a_addr = ("127.0.0.1", natchk.free_port("127.0.0.1"))
+    b_addr = ("127.0.0.1", natchk.free_port("127.0.0.1"))
+    # a peer of B's on another IP, played by this script
+    fake = natchk.udp_socket("127.0.0.3")
+    fake_addr = fake.getsockname()
+
+    with tempfile.NamedTemporaryFile(suffix=".secret") as secret:
+        secret.write(SECRET + b"\n")
+        secret.flush()
+        b = natchk.Server(binary, b_addr,
+                          "--peers", "%s:%d,%s:%d" % (a_addr + fake_addr),
+                          "--peer-secret-file", secret.name)
+        try:
+            with natchk.Server(binary, a_addr,
+                               "--peers", "%s:%d" % b_addr,
+                               "--peer-secret-file", secret.name):
+                # not on a listen IP, so not taken for a sibling
+                client = natchk.udp_socket("127.0.0.5")
+                client_addr = client.getsockname()
+
+                # B signs its PINGs with the shared secret
+                fake.settimeout(2.0)
+                data, _ = fake.recvfrom(65536)
+                while natchk.PING not in [m[0] for m in
+                                          natchk.parse(data)[1]]:
+                    data, _ = fake.recvfrom(65536)
+                assert signed(data), "PING of B is not signed by the secret"
+
+                # A forwards to B, B answers from the same IP through
+                # another port, in the client's txid
+                client.sendto(natchk.datagram(
+                    0x4321, (natchk.CHKRESTRICTEDCONE, b"")), a_addr)
+                got = natchk.expect(client, natchk.RESTRICTEDCONE, 2.0)
+                assert got is not None, "CHKRESTRICTEDCONE was not forwarded"
+                assert got[0] == 0x4321, "RESTRICTEDCONE in the wrong txid"
+                assert got[2] == b_addr, "RESTRICTEDCONE not from B"
+
+                # B forwards to A on its IP, never to the peer on another
+                for txid in range(0x4400, 0x4408):
+                    other = natchk.udp_socket("127.0.0.5")
+                    other.sendto(natchk.datagram(
+                        txid, (natchk.CHKRESTRICTEDCONE, b"")), b_addr)
+                    got = natchk.expect(other, natchk.RESTRICTEDCONE, 1.0)
+                    assert got is not None and got[2] == a_addr, \
+                        "CHKRESTRICTEDCONE to B not answered by A"
+                    other.close()
+                got = natchk.expect(fake, natchk.SENDRESTRICTEDCONE, 0.2)
+                assert got is None, "forwarded to a peer on another IP"
+
+                # the address of a peer alone is not enough
+                fake.sendto(forward(0x1111, client_addr), b_addr)
+                got = natchk.expect(client, natchk.RESTRICTEDCONE, 0.5)
+                assert got is None, "unsigned SENDRESTRICTEDCONE was relayed"
+                # nor is the secret from elsewhere
+                client.sendto(sign(forward(0x2222, client_addr)), b_addr)
+                got = natchk.expect(client, natchk.RESTRICTEDCONE, 0.5)
+                assert got is None, "signed SENDRESTRICTEDCONE from a " \
+                                    "non-peer was relayed"
+                fake.sendto(sign(forward(0x3333, client_addr)), b_addr)
+                got = natchk.expect(client, natchk.RESTRICTEDCONE, 1.0)
+                assert got is not None, "signed SENDRESTRICTEDCONE from a " \
+                                        "peer was ignored"
+                assert got[0] == 0x3333
+
+                # signed PONGs keep B up past the grace period
+                time.sleep(PEER_DOWN)
+                check_b = natchk.datagram(
+                    0x5555, (natchk.CHKFULLCONE, natchk.encode_addr(b_addr)))
+                client.sendto(check_b, a_addr)
+                got = natchk.expect(client, natchk.FULLCONE, 1.0)
+                assert got is not None, "B was taken down while it answers"
+
+                b.stop()
+                time.sleep(PEER_DOWN)
+                client.sendto(check_b, a_addr)
+                got = natchk.expect(client, natchk.PEER_UNAVAILABLE, 1.0)
+                assert got is not None, "no PEER_UNAVAILABLE for a down peer"
+                assert natchk.decode_addr(got[1]) == b_addr
+        finally:
+            b.stop()
+            fake.close()
+
+
+if __name__ == "__main__":
+    natchk.run(test)
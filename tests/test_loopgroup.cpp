@@ -0,0 +1,84 @@
+// LoopGroup::post() between loops: 600k tasks from three loops to a fourth,
+// far more than a Mailbox holds, so most of them overflow. Every task must
+// arrive exactly once and in the order its loop posted it. Build with
+// -fsanitize=thread to check the mailboxes for races as well.
+
+#include "loopgroup.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+static const int kProducers = 3;
+static const uint32_t kPostsPerProducer = 200000;
+static const uint64_t kTimeoutMillis = 60000;
+
+// Loop 0 only
+struct Consumer {
+    uv_timer_t timeout;             // keeps loop 0 running until done
+    std::vector<uint32_t> next;     // sequence expected per producer
+    uint32_t received;
+    bool ordered;
+    bool timedOut;
+
+    Consumer() : next(kProducers + 1, 0), received(0), ordered(true)
+               , timedOut(false) {
+    }
+
+    void take(int from, uint32_t seq) {
+        if (seq != next[from]) {
+            fprintf(stderr, "FAIL: task %u of loop %d arrived as %u\n",
+                    next[from], from, seq);
+            ordered = false;
+        }
+        next[from] = seq + 1;
+        if (++received == kProducers * kPostsPerProducer && !timedOut) {
+            uv_close((uv_handle_t*)&timeout, nullptr);
+        }
+    }
+
+    static void onTimeout(uv_timer_t* handle) {
+        Consumer* self = CONTAINER_OF(handle, Consumer, timeout);
+        self->timedOut = true;
+        uv_close((uv_handle_t*)handle, nullptr);
+    }
+};
+
+int main() {
+    LoopGroup group(kProducers + 1);
+    Consumer consumer;
+    uv_timer_init(&group.loop(0), &consumer.timeout);
+    uv_timer_start(&consumer.timeout, Consumer::onTimeout, kTimeoutMillis, 0);
+
+    std::atomic<bool> posted(true);
+    group.start([&](int index, uv_loop_t& loop) {
+        if (0 == index) {
+            uv_run(&loop, UV_RUN_DEFAULT);
+            return;
+        }
+        // as fast as this thread goes, loop 0 cannot keep up
+        for (uint32_t seq = 0; seq < kPostsPerProducer; seq++) {
+            if (!group.post(0, [&consumer, index, seq]() {
+                    consumer.take(index, seq);
+                })) {
+                posted = false;
+            }
+        }
+    });
+    group.join();
+
+    if (!posted) {
+        fprintf(stderr, "FAIL: post() refused a task\n");
+        return 1;
+    }
+    if (consumer.timedOut) {
+        fprintf(stderr, "FAIL: %u of %u tasks arrived\n", consumer.received,
+                kProducers * kPostsPerProducer);
+        return 1;
+    }
+    if (!consumer.ordered) {
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,35 @@
+"""Every CHKFULLCONE a client retransmits is relayed again, an immediate
+duplicate included: the server cannot tell a lost relay from a FULLCONE
+lost or filtered on its way to the client, and only a fresh relay lets the
+retry succeed."""
+
+import natchk
+
+
+def test(binary):
+    server_addr = ("127.0.0.1", natchk.free_port("127.0.0.1"))
+    with natchk.Server(binary, server_addr):
+        client = natchk.udp_socket("127.0.0.5")
+        # stands in for the server on another IP the relay goes through
+        unknown = natchk.udp_socket("127.0.0.2")
+        request = natchk.datagram(
+            0x1234,
+            (natchk.CHKFULLCONE, natchk.encode_addr(unknown.getsockname())))
+
+        client.sendto(request, server_addr)
+        got = natchk.expect(unknown, natchk.SENDFULLCONE, 1.0)
+        assert got is not None, "first CHKFULLCONE was not relayed"
+        assert natchk.decode_addr(got[1]) == client.getsockname()
+        # the relay is lost on its way to the client
+
+        client.sendto(request, server_addr)
+        got = natchk.expect(unknown, natchk.SENDFULLCONE, 1.0)
+        assert got is not None, "retry after a lost relay was not relayed"
+        unknown.sendto(natchk.datagram(got[0], (natchk.FULLCONE, b"")),
+                       natchk.decode_addr(got[1]))
+        got = natchk.expect(client, natchk.FULLCONE, 1.0)
+        assert got is not None, "FULLCONE did not reach the client"
+
+
+if __name__ == "__main__":
+    natchk.run(test)
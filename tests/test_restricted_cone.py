@@ -0,0 +1,34 @@
+"""CHKRESTRICTEDCONE is answered from the probed server's IP through another
+port, by a sibling on another loop here, and not at all where no server
+listens on that IP: an answer from another IP would test a different NAT
+filter."""
+
+import natchk
+
+
+def test(binary):
+    probed = ("127.0.0.1", natchk.free_port("127.0.0.1"))
+    same_ip = ("127.0.0.1", natchk.free_port("127.0.0.1"))
+    other_ip = ("127.0.0.2", natchk.free_port("127.0.0.2"))
+    with natchk.Server(binary, probed, "--loops", "2",
+                       siblings=(same_ip, other_ip)):
+        # not on a listen IP, so not taken for a sibling
+        client = natchk.udp_socket("127.0.0.5")
+
+        client.sendto(natchk.datagram(
+            0x0101, (natchk.CHKRESTRICTEDCONE, b"")), probed)
+        got = natchk.expect(client, natchk.RESTRICTEDCONE, 1.0)
+        assert got is not None, "no RESTRICTEDCONE from a sibling"
+        assert got[0] == 0x0101, "RESTRICTEDCONE in the wrong txid"
+        assert got[2] == same_ip, \
+            "RESTRICTEDCONE from %s:%d, not the probed IP" % got[2]
+
+        client.sendto(natchk.datagram(
+            0x0202, (natchk.CHKRESTRICTEDCONE, b"")), other_ip)
+        got = natchk.expect(client, natchk.RESTRICTEDCONE, 1.0)
+        assert got is None, "RESTRICTEDCONE from %s:%d, no server shares " \
+                            "the probed IP" % got[2]
+
+
+if __name__ == "__main__":
+    natchk.run(test)
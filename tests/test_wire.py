@@ -0,0 +1,95 @@
+"""wire::Reader as natchk-svr sees it: datagrams with a truncated header or
+a message length that overruns the datagram are dropped whole and counted
+as malformed, compact addresses whose family and length disagree are
+refused, and a first byte without the header marker selects the legacy
+format, answered in kind."""
+
+import socket
+import struct
+
+import natchk
+
+
+def malformed(sock, server_addr):
+    """the server's malformed counter, read through GETSTATS"""
+    sock.sendto(natchk.datagram(0x7777, (natchk.GETSTATS, b"")), server_addr)
+    got = natchk.expect(sock, natchk.STATS, 1.0)
+    assert got is not None, "no STATS"
+    for line in got[1].decode().splitlines():
+        name, _, value = line.partition(" ")
+        if name == "malformed":
+            return int(value)
+    raise AssertionError("no malformed counter in STATS")
+
+
+def silent(sock, timeout=0.2):
+    sock.settimeout(timeout)
+    try:
+        sock.recvfrom(65536)
+    except socket.timeout:
+        return True
+    return False
+
+
+def test(binary):
+    server_addr = ("127.0.0.1", natchk.free_port("127.0.0.1"))
+    with natchk.Server(binary, server_addr):
+        client = natchk.udp_socket("127.0.0.5")
+        stats = natchk.udp_socket("127.0.0.1")
+        getaddr = struct.pack("!BH", natchk.GETADDR, 0)
+
+        # truncated headers, a header without messages, a header marker
+        # with other bits set, an unknown version
+        bad = [b"\x80", b"\x80\x01", b"\x80\x01\x12",
+               b"\x80\x01\x12\x34",
+               b"\x81\x01\x12\x34" + getaddr,
+               b"\x80\x02\x12\x34" + getaddr]
+        # a message header cut short, message lengths running one byte and
+        # many bytes past the end, after a well-formed GETADDR
+        header = struct.pack("!BBH", 0x80, 1, 0x1234)
+        bad += [header + getaddr + b"\x02\x00",
+                header + getaddr + struct.pack("!BH", natchk.PING, 3) + b"ab",
+                header + getaddr + struct.pack("!BH", natchk.PING, 0xffff)]
+
+        before = malformed(stats, server_addr)
+        for data in bad:
+            client.sendto(data, server_addr)
+            assert silent(client), "answered malformed %r" % data
+        assert malformed(stats, server_addr) - before == len(bad), \
+            "malformed datagrams not counted"
+
+        # a GETADDR in the same datagram shows the rest of it was read
+        target = natchk.udp_socket("127.0.0.2")
+        ip, port = target.getsockname()
+        v4 = struct.pack("!H", port) + socket.inet_aton(ip)
+        for addr in [b"\x04" + v4 + b"\x00",               # IPv4, 8 bytes
+                     b"\x04" + v4[:-1],                    # IPv4, 6 bytes
+                     b"\x06" + v4,                         # IPv6, 7 bytes
+                     b"\x06" + v4 + b"\x00" * 12,          # IPv6, 19 bytes
+                     b"\x05" + v4]:                        # no such family
+            client.sendto(natchk.datagram(
+                0x2222, (natchk.CHKFULLCONE, addr), (natchk.GETADDR, b"")),
+                server_addr)
+            got = natchk.expect(client, natchk.ADDR, 1.0)
+            assert got is not None and got[0] == 0x2222, \
+                "datagram with address %r not read" % addr
+            assert silent(target), "relayed to address %r" % addr
+        # a well-formed one is relayed, so the above were refused on merit
+        client.sendto(natchk.datagram(
+            0x2223, (natchk.CHKFULLCONE, b"\x04" + v4)), server_addr)
+        assert natchk.expect(target, natchk.SENDFULLCONE, 1.0) is not None
+
+        # the high bit clear means legacy: one MessageId byte, answered
+        # with a legacy ADDR carrying a struct sockaddr_in
+        client.sendto(bytes([natchk.GETADDR]), server_addr)
+        client.settimeout(1.0)
+        data, _ = client.recvfrom(65536)
+        assert data[0] == natchk.ADDR, "legacy GETADDR not answered in kind"
+        assert len(data) >= 1 + 16
+        port_, addr_ = struct.unpack("!H4s", data[3:9])
+        assert (socket.inet_ntoa(addr_), port_) == client.getsockname()
+        assert malformed(stats, server_addr) - before == len(bad)
+
+
+if __name__ == "__main__":
+    natchk.run(test)
@@ -0,0 +1,198 @@
+#include "timeline.h"
+#include "log.h"
+#include "uv.h"
+#include <vector>
+#include <algorithm>
+#include <string.h>
+#include <errno.h>
+
+static void appendEscaped(std::string& out, const char* s) {
+    for (; *s != '\0'; s++) {
+        unsigned char c = (unsigned char)*s;
+        if ('"' == c || '\\' == c) {
+            out += '\\';
+            out += char(c);
+        } else if (c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += char(c);
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Section: TimelineArgs
+// -----------------------------------------------------------------------------
+TimelineArgs& TimelineArgs::add(const char* key, const std::string& value) {
+    return add(key, value.c_str());
+}
+
+TimelineArgs& TimelineArgs::add(const char* key, const char* value) {
+    if (!m_json.empty()) {
+        m_json += ',';
+    }
+    m_json += '"';
+    appendEscaped(m_json, key);
+    m_json += "\":\"";
+    appendEscaped(m_json, value);
+    m_json += '"';
+    return *this;
+}
+
+TimelineArgs& TimelineArgs::add(const char* key, int64_t value) {
+    if (!m_json.empty()) {
+        m_json += ',';
+    }
+    m_json += '"';
+    appendEscaped(m_json, key);
+    m_json += "\":";
+    m_json += std::to_string(value);
+    return *this;
+}
+
+TimelineArgs& TimelineArgs::add(const char* key, const Endpoint& value) {
+    char buf[INET6_ADDRSTRLEN + 8];
+    int len = value.format(buf, sizeof(buf));
+    return add(key, std::string(buf, len));
+}
+
+// -----------------------------------------------------------------------------
+// Section: Timeline
+// -----------------------------------------------------------------------------
+std::atomic<Timeline*> Timeline::s_current(nullptr);
+
+// static
+Timeline* Timeline::open(const std::string& path) {
+    FILE* fp = fopen(path.c_str(), "w");
+    if (nullptr == fp) {
+        LOGE << "fopen " << path << ": " << strerror(errno);
+        return nullptr;
+    }
+    LOGI << "writing timeline to " << path;
+    return new Timeline(fp, path);
+}
+
+// static
+void Timeline::install(Timeline* timeline) {
+    s_current.store(timeline, std::memory_order_release);
+}
+
+// static
+uint64_t Timeline::begin(const char* category, const std::string& name,
+                         const TimelineArgs& args) {
+    Timeline* self = s_current.load(std::memory_order_acquire);
+    if (nullptr == self) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> l(self->m_mutex);
+    uint64_t id = self->m_nextId++;
+    Span& span = self->m_spans[id];
+    span.category = category;
+    span.name = name;
+    self->write("b", category, name, id, args, 0);
+    return id;
+}
+
+// static
+void Timeline::end(uint64_t id, const TimelineArgs& args) {
+    Timeline* self = s_current.load(std::memory_order_acquire);
+    if (nullptr == self || 0 == id) {
+        return;
+    }
+    std::lock_guard<std::mutex> l(self->m_mutex);
+    auto it = self->m_spans.find(id);
+    if (it == self->m_spans.end()) {
+        return;
+    }
+    self->write("e", it->second.category, it->second.name, id, args, 0);
+    self->m_spans.erase(it);
+}
+
+// static
+void Timeline::event(uint64_t id, const char* name,
+                     const TimelineArgs& args, uint64_t nanos) {
+    Timeline* self = s_current.load(std::memory_order_acquire);
+    if (nullptr == self || 0 == id) {
+        return;
+    }
+    std::lock_guard<std::mutex> l(self->m_mutex);
+    auto it = self->m_spans.find(id);
+    if (it == self->m_spans.end()) {
+        return;
+    }
+    self->write("n", it->second.category, name, id, args, nanos);
+}
+
+// static
+void Timeline::mark(const char* name, const TimelineArgs& args) {
+    Timeline* self = s_current.load(std::memory_order_acquire);
+    if (nullptr == self) {
+        return;
+    }
+    std::lock_guard<std::mutex> l(self->m_mutex);
+    self->write("i", "decision", name, 0, args, 0);
+}
+
+Timeline::Timeline(FILE* fp, const std::string& path)
+    : m_fp(fp), m_path(path), m_pid(int(uv_os_getpid()))
+    , m_startNanos(uv_hrtime()), m_nextId(1) {
+    fprintf(m_fp, "{\"traceEvents\":[\n"
+            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":1,"
+            "\"args\":{\"name\":\"natchk-cli\"}}", m_pid);
+}
+
+Timeline::~Timeline() {
+    Timeline* self = this;
+    s_current.compare_exchange_strong(self, nullptr);
+    // spans are ended in the order they began
+    std::vector<uint64_t> open;
+    for (auto it = m_spans.begin(); it != m_spans.end(); ++it) {
+        open.push_back(it->first);
+    }
+    std::sort(open.begin(), open.end());
+    for (uint64_t id : open) {
+        const Span& span = m_spans[id];
+        write("e", span.category, span.name, id,
+              TimelineArgs().add("result", "unfinished"), 0);
+    }
+    fprintf(m_fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    if (fclose(m_fp) != 0) {
+        LOGE << "write " << m_path << ": " << strerror(errno);
+    }
+}
+
+void Timeline::write(const char* phase, const char* category,
+                     const std::string& name, uint64_t id,
+                     const TimelineArgs& args, uint64_t nanos) {
+    if (0 == nanos) {
+        nanos = uv_hrtime();
+    }
+    // a kernel receive time may predate the timeline by a hair
+    double micros = (nanos > m_startNanos) ?
+            double(nanos - m_startNanos) / 1000 : 0;
+    std::string line = ",\n{\"name\":\"";
+    appendEscaped(line, name.c_str());
+    line += "\",\"cat\":\"";
+    appendEscaped(line, category);
+    line += "\",\"ph\":\"";
+    line += phase;
+    line += '"';
+    if (0 != id) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), ",\"id\":\"0x%llx\"",
+                 (unsigned long long)id);
+        line += buf;
+    } else {
+        line += ",\"s\":\"g\"";
+    }
+    char buf[96];
+    snprintf(buf, sizeof(buf), ",\"ts\":%.3f,\"pid\":%d,\"tid\":1",
+             micros, m_pid);
+    line += buf;
+    line += ",\"args\":{";
+    line += args.json();
+    line += "}}";
+    fwrite(line.data(), 1, line.size(), m_fp);
+}
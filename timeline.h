@@ -0,0 +1,86 @@
+#pragma once
+
+#include "util.h"
+#include "endpoint.h"
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <stdio.h>
+#include <stdint.h>
+
+// -----------------------------------------------------------------------------
+// Section: TimelineArgs
+// -----------------------------------------------------------------------------
+// The "args" object of a trace event, built up as JSON text
+class TimelineArgs {
+public:
+    TimelineArgs& add(const char* key, const std::string& value);
+    TimelineArgs& add(const char* key, const char* value);
+    TimelineArgs& add(const char* key, int64_t value);
+    TimelineArgs& add(const char* key, const Endpoint& value);
+
+    const std::string& json() const {
+        return m_json;
+    }
+
+private:
+    std::string m_json;
+};
+
+// -----------------------------------------------------------------------------
+// Section: Timeline
+// -----------------------------------------------------------------------------
+// Writes Chrome trace-event JSON, as loaded by chrome://tracing and
+// Perfetto. Spans are async events keyed by id, so overlapping ones get a
+// track each; events either belong to a span or stand for the whole
+// process. Installed process-wide like PacketTrace, every call is a no-op
+// while none is installed.
+class Timeline {
+public:
+    static Timeline* open(const std::string& path);
+
+    static void install(Timeline* timeline);
+
+    // Starts a span and returns its id, 0 if no timeline is installed
+    static uint64_t begin(const char* category, const std::string& name,
+                          const TimelineArgs& args = TimelineArgs());
+
+    static void end(uint64_t id, const TimelineArgs& args = TimelineArgs());
+
+    // An instant on span |id| at |nanos| on the uv_hrtime() clock, or now
+    static void event(uint64_t id, const char* name,
+                      const TimelineArgs& args = TimelineArgs(),
+                      uint64_t nanos = 0);
+
+    // An instant of the whole process, such as a verdict
+    static void mark(const char* name,
+                     const TimelineArgs& args = TimelineArgs());
+
+    // Ends the spans still open and completes the JSON
+    ~Timeline();
+
+private:
+    struct Span {
+        const char* category;
+        std::string name;
+    };
+
+    Timeline(FILE* fp, const std::string& path);
+
+    void write(const char* phase, const char* category,
+               const std::string& name, uint64_t id,
+               const TimelineArgs& args, uint64_t nanos);
+
+    static std::atomic<Timeline*> s_current;
+
+    std::mutex m_mutex;
+    FILE* m_fp;
+    std::string m_path;
+    int m_pid;
+    uint64_t m_startNanos;
+    uint64_t m_nextId;
+    std::unordered_map<uint64_t, Span> m_spans;
+
+    DISALLOW_COPY_MOVE_AND_ASSIGN(Timeline);
+};
@@ -0,0 +1,327 @@
+#include "longopt.h"
+#include "log.h"
+#include "util.h"
+#include "endpoint.h"
+#include "message.h"
+#include "pkttrace.h"
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static const option_t kOptions[] = {
+    { '-', NULL, 0, NULL, "arguments:" },
+    { 'f', "file", LONGOPT_REQUIRE, NULL, "packet trace file from natchk-cli/natchk-svr --trace or natchk-svr on SIGUSR1"},
+    { 'p', "peer", LONGOPT_REQUIRE, NULL, "only packets from/to <ip> or <ip>:<port>"},
+    { 'm', "msg", LONGOPT_REQUIRE, NULL, "only packets whose first message is this name or id"},
+    { 'd', "dir", LONGOPT_REQUIRE, NULL, "only packets of direction in or out"},
+    { 'o', "pcap", LONGOPT_REQUIRE, NULL, "export the selected packets to this pcap file"},
+    { 0, NULL, 0, NULL, NULL }
+};
+
+// pcap with nanosecond timestamps and raw IPv4/IPv6 packets
+static const uint32_t kPcapMagicNanos = 0xa1b23c4d;
+static const uint32_t kLinkTypeRaw = 101;
+
+struct TraceFilter {
+    bool hasPeer;
+    bool peerHasPort;
+    EndpointKey peer;
+    bool hasMsg;
+    MessageId msg;
+    int direction;      // -1 for both
+
+    TraceFilter() : hasPeer(false), peerHasPort(false), hasMsg(false)
+                  , msg(MessageId::PING), direction(-1) {
+        memset(&peer, 0, sizeof(peer));
+    }
+
+    bool match(const PacketTraceRecord& r) const {
+        if (direction >= 0 && r.direction != direction) {
+            return false;
+        }
+        if (hasMsg && r.msgId != uint8_t(msg)) {
+            return false;
+        }
+        if (hasPeer) {
+            if (peerHasPort) {
+                return r.peer == peer;
+            }
+            return r.peer.hostOnly() == peer;
+        }
+        return true;
+    }
+};
+
+// -----------------------------------------------------------------------------
+// Section: PcapWriter
+// -----------------------------------------------------------------------------
+class PcapWriter {
+    FILE* m_fp;
+
+    static void putU16(uint8_t* p, uint16_t v) {
+        p[0] = uint8_t(v >> 8);
+        p[1] = uint8_t(v & 0xff);
+    }
+
+    static uint16_t ipChecksum(const uint8_t* p, int len) {
+        uint32_t sum = 0;
+        for (int i = 0; i + 1 < len; i += 2) {
+            sum += (uint32_t(p[i]) << 8) | p[i + 1];
+        }
+        while (sum >> 16) {
+            sum = (sum & 0xffff) + (sum >> 16);
+        }
+        return uint16_t(~sum);
+    }
+
+public:
+    PcapWriter() : m_fp(nullptr) {
+    }
+
+    ~PcapWriter() {
+        if (nullptr != m_fp) {
+            fclose(m_fp);
+        }
+    }
+
+    bool open(const std::string& path) {
+        m_fp = fopen(path.c_str(), "wb");
+        if (nullptr == m_fp) {
+            return false;
+        }
+        struct {
+            uint32_t magic;
+            uint16_t major;
+            uint16_t minor;
+            int32_t thiszone;
+            uint32_t sigfigs;
+            uint32_t snaplen;
+            uint32_t network;
+        } hdr = { kPcapMagicNanos, 2, 4, 0, 0, 65535, kLinkTypeRaw };
+        return fwrite(&hdr, sizeof(hdr), 1, m_fp) == 1;
+    }
+
+    // Synthesizes IP and UDP headers; the payload is cut to the recorded
+    // prefix while the original length is preserved
+    bool write(const PacketTraceRecord& r, uint64_t wallNanos) {
+        bool in = (kTraceIn == r.direction);
+        const EndpointKey& src = in ? r.peer : r.local;
+        const EndpointKey& dst = in ? r.local : r.peer;
+        if (src.family != dst.family) {
+            return false;
+        }
+        uint8_t pkt[40 + 8 + sizeof(r.prefix)];
+        memset(pkt, 0, sizeof(pkt));
+        int ipLen = 0;
+        int udpLen = 8 + r.length;
+        if (AF_INET == src.family) {
+            ipLen = 20;
+            pkt[0] = 0x45;
+            putU16(pkt + 2, uint16_t(ipLen + udpLen));
+            putU16(pkt + 6, 0x4000);
+            pkt[8] = 64;
+            pkt[9] = 17;
+            memcpy(pkt + 12, src.addr, 4);
+            memcpy(pkt + 16, dst.addr, 4);
+            putU16(pkt + 10, ipChecksum(pkt, ipLen));
+        } else if (AF_INET6 == src.family) {
+            ipLen = 40;
+            pkt[0] = 0x60;
+            putU16(pkt + 4, uint16_t(udpLen));
+            pkt[6] = 17;
+            pkt[7] = 64;
+            memcpy(pkt + 8, src.addr, 16);
+            memcpy(pkt + 24, dst.addr, 16);
+        } else {
+            return false;
+        }
+        uint8_t* udp = pkt + ipLen;
+        putU16(udp, src.port);
+        putU16(udp + 2, dst.port);
+        putU16(udp + 4, uint16_t(udpLen));
+        int prefixLen = std::min<int>(r.length, sizeof(r.prefix));
+        memcpy(udp + 8, r.prefix, prefixLen);
+
+        uint32_t capLen = ipLen + 8 + prefixLen;
+        uint32_t recHdr[4] = {
+            uint32_t(wallNanos / 1000000000ULL),
+            uint32_t(wallNanos % 1000000000ULL),
+            capLen,
+            uint32_t(ipLen + udpLen)
+        };
+        return fwrite(recHdr, sizeof(recHdr), 1, m_fp) == 1 &&
+               fwrite(pkt, capLen, 1, m_fp) == 1;
+    }
+};
+
+// -----------------------------------------------------------------------------
+// Section: main
+// -----------------------------------------------------------------------------
+static bool loadTrace(const std::string& path, std::vector<char>& data) {
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (nullptr == fp) {
+        return false;
+    }
+    char buf[64 * 1024];
+    size_t n;
+    while ( (n = fread(buf, 1, sizeof(buf), fp)) > 0 ) {
+        data.insert(data.end(), buf, buf + n);
+    }
+    fclose(fp);
+    return true;
+}
+
+static void printRecord(const PacketTraceRecord& r, uint64_t wallNanos) {
+    char ts[32];
+    time_t secs = time_t(wallNanos / 1000000000ULL);
+    struct tm tm;
+    localtime_r(&secs, &tm);
+    strftime(ts, sizeof(ts), "%Y/%m/%d %H:%M:%S", &tm);
+    Endpoint local;
+    Endpoint peer;
+    local.init(r.local);
+    peer.init(r.peer);
+    char localStr[INET6_ADDRSTRLEN + 8];
+    char peerStr[INET6_ADDRSTRLEN + 8];
+    local.format(localStr, sizeof(localStr));
+    peer.format(peerStr, sizeof(peerStr));
+    const char* name = messageName(MessageId(r.msgId));
+    char idStr[8];
+    if (nullptr == name) {
+        snprintf(idStr, sizeof(idStr), "%u", unsigned(r.msgId));
+        name = idStr;
+    }
+    printf("%s.%06u %s %s %s %s %s %u\n", ts,
+           unsigned( (wallNanos % 1000000000ULL) / 1000 ),
+           (kTraceIn == r.direction) ? "IN " : "OUT", localStr,
+           (kTraceIn == r.direction) ? "<" : ">", peerStr, name,
+           unsigned(r.length));
+}
+
+int main(int argc, char* argv[]) {
+    std::string traceFile;
+    std::string pcapFile;
+    TraceFilter filter;
+    int opt;
+    while ( (opt = longopt(argc, argv, kOptions)) != LONGOPT_DONE ) {
+        if (LONGOPT_NEED_PARAM == opt) {
+            const option_t& ent = kOptions[errindex];
+            LOGE << "missing parameter for -" << char(ent.val)
+                 << "--" << ent.name;
+            exit(1);
+        } else if (opt <= 0 || opt >= (int)ARRAY_SIZE(kOptions)) {
+            continue;
+        }
+        switch (opt) {
+        case 1:
+            traceFile = optparam;
+            break;
+        case 2: {
+            // IPv4 with optional port, or a bare IPv6 address
+            std::string str = optparam;
+            IpPort addr;
+            int af = AF_INET6;
+            filter.peerHasPort = false;
+            if (str.find('.') != std::string::npos) {
+                af = AF_INET;
+                filter.peerHasPort = util::parseIpPort(str, addr);
+            }
+            if (!filter.peerHasPort) {
+                addr.ip = str;
+                addr.port = 0;
+            }
+            Endpoint ep;
+            if (!ep.init(af, addr.ip, addr.port)) {
+                LOGE << "invalid peer " << optparam;
+                return 1;
+            }
+            filter.hasPeer = true;
+            filter.peer = ep.key();
+            break;
+        }
+        case 3:
+            if (!parseMessageId(optparam, filter.msg)) {
+                LOGE << "invalid message " << optparam;
+                return 1;
+            }
+            filter.hasMsg = true;
+            break;
+        case 4:
+            if (strcmp(optparam, "in") == 0) {
+                filter.direction = kTraceIn;
+            } else if (strcmp(optparam, "out") == 0) {
+                filter.direction = kTraceOut;
+            } else {
+                LOGE << "invalid direction " << optparam;
+                return 1;
+            }
+            break;
+        case 5:
+            pcapFile = optparam;
+            break;
+        }
+    }
+
+    if (traceFile.empty()) {
+        print_opt(kOptions);
+        return 1;
+    }
+
+    std::vector<char> data;
+    if (!loadTrace(traceFile, data)) {
+        LOGE << "cannot read " << traceFile;
+        return 1;
+    }
+    if (data.size() < sizeof(PacketTraceHeader)) {
+        LOGE << traceFile << " is not a packet trace";
+        return 1;
+    }
+    const PacketTraceHeader* header = (const PacketTraceHeader*)data.data();
+    if (memcmp(header->magic, "NATCHKTR", sizeof(header->magic)) != 0 ||
+            header->version != kPacketTraceVersion ||
+            header->recordSize != sizeof(PacketTraceRecord) ||
+            header->capacity == 0 ||
+            data.size() < sizeof(PacketTraceHeader) +
+                          header->capacity * sizeof(PacketTraceRecord)) {
+        LOGE << traceFile << " is not a packet trace of version "
+             << kPacketTraceVersion;
+        return 1;
+    }
+    const PacketTraceRecord* records =
+            (const PacketTraceRecord*)(header + 1);
+
+    PcapWriter pcap;
+    if (!pcapFile.empty() && !pcap.open(pcapFile)) {
+        LOGE << "cannot create " << pcapFile;
+        return 1;
+    }
+
+    uint64_t end = header->writeIndex.load();
+    uint64_t begin = (end > header->capacity) ? end - header->capacity : 0;
+    uint64_t selected = 0;
+    uint64_t torn = 0;
+    for (uint64_t i = begin; i < end; i++) {
+        const PacketTraceRecord& r = records[i % header->capacity];
+        if (r.seq != uint32_t(i + 1)) {
+            torn += 1;
+            continue;
+        }
+        if (!filter.match(r)) {
+            continue;
+        }
+        uint64_t wallNanos = header->realtimeAnchorNanos +
+                (r.timestampNanos - header->monotonicAnchorNanos);
+        selected += 1;
+        if (pcapFile.empty()) {
+            printRecord(r, wallNanos);
+        } else {
+            pcap.write(r, wallNanos);
+        }
+    }
+    LOGI << selected << " of " << (end - begin) << " packet(s) selected, "
+         << torn << " incomplete record(s) skipped";
+    return 0;
+}
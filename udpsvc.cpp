@@ -2,32 +2,260 @@
 #include "endpoint.h"
 #include "log.h"
 #include "async.h"
+#include "loopgroup.h"
+#include "pkttrace.h"
+#include "capture.h"
+#include "metrics.h"
+#include "loopmon.h"
+#include "uring.h"
+#include "busypoll.h"
+#include <atomic>
+#include <memory>
 #include <vector>
 #include <algorithm>
+#include <string.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <linux/sock_diag.h>
+#include <linux/sockios.h>
+#include <unistd.h>
+#include <time.h>
+#endif
 
 typedef UdpService::ShutdownCallback ShutdownCallback;
 typedef UdpService::IMessageHandler IMessageHandler;
+typedef UdpService::ReleaseCallback ReleaseCallback;
+typedef UdpService::WritableCallback WritableCallback;
+typedef UdpService::SendStatus SendStatus;
+
+static const uint64_t kSocketSampleMillis = 1000;
+// recvmmsg() batches per readable event
+static const int kMaxRecvRounds = 4;
+
+// io_uring sizing: SQEs and provided receive buffers (a power of two), each
+// large enough for the peer address, the control messages and a datagram
+// as large as recvmmsg takes
+static const unsigned kUringEntries = 256;
+static const unsigned kUringBuffers = 64;
+static const int kUringControlSize = 128;
+// user_data of the SQEs that are not sends, a send carries its SendReq
+static const uint64_t kUringRecv = 1;
+static const uint64_t kUringCancel = 2;
 
+#ifdef __linux__
+static_assert(sizeof(uv_buf_t) == sizeof(struct iovec),
+              "uv_buf_t doubles as struct iovec");
+
+static socklen_t sockaddrLen(const Endpoint& peer) {
+    return (AF_INET6 == peer.family()) ? 
+            sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+#endif
+
+// A datagram on its way out: either a copy in |data|, or the pieces of a
+// zero-copy send, whose owner gets them back through |release|. Requests
+// with room for up to kPooledSize bytes are recycled through a per-thread
+// free list.
 struct SendReq {
+    static const int kPooledSize = 2048;
+    static const size_t kMaxPooled = 1024;
+
     uv_udp_send_t handle;
     Endpoint peer;
+    uint64_t queuedNanos;
+    ReleaseCallback release;
+#ifdef __linux__
+    // read by an io_uring sendmsg until it completes
+    struct msghdr msg;
+#endif
+    int count;
+    uv_buf_t bufs[UdpService::kMaxSendBufs];
     int size;
+    bool pooled;
     char data[1];
 
     static SendReq* create(const Endpoint& peer, const char* data, int size) {
-        SendReq* req = (SendReq*)malloc(sizeof(SendReq) + size);
-        new(&req->peer) Endpoint(peer);
-        req->size = size;
+        SendReq* req = alloc(peer, size);
         memcpy(req->data, data, size);
+        req->count = 1;
+        req->bufs[0] = uv_buf_init(req->data, size);
         return req;
     }
 
+    // Gathers |bufs| into one copy
+    static SendReq* create(const Endpoint& peer, const uv_buf_t* bufs, 
+                           int count) {
+        SendReq* req = alloc(peer, totalSize(bufs, count));
+        char* p = req->data;
+        for (int i = 0; i < count; i++) {
+            memcpy(p, bufs[i].base, bufs[i].len);
+            p += bufs[i].len;
+        }
+        req->count = 1;
+        req->bufs[0] = uv_buf_init(req->data, req->size);
+        return req;
+    }
+
+    // Refers to the memory of |bufs| until destroyed
+    static SendReq* create(const Endpoint& peer, const uv_buf_t* bufs, 
+                           int count, ReleaseCallback&& release) {
+        SendReq* req = alloc(peer, 0);
+        req->size = totalSize(bufs, count);
+        req->release = std::move(release);
+        req->count = count;
+        memcpy(req->bufs, bufs, sizeof(uv_buf_t) * count);
+        return req;
+    }
+
+    static int totalSize(const uv_buf_t* bufs, int count) {
+        size_t size = 0;
+        for (int i = 0; i < count; i++) {
+            size += bufs[i].len;
+        }
+        return int(size);
+    }
+
     void destroy() {
-        free(this);
+        if (release) {
+            release();
+        }
+        release.~ReleaseCallback();
+        peer.~Endpoint();
+        std::vector<void*>& pool = freeList();
+        if (pooled && pool.size() < kMaxPooled) {
+            pool.push_back(this);
+        } else {
+            free(this);
+        }
+    }
+
+#ifdef __linux__
+    struct msghdr* prepareMsg() {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = (void*)peer.sockaddr();
+        msg.msg_namelen = sockaddrLen(peer);
+        msg.msg_iov = (struct iovec*)bufs;
+        msg.msg_iovlen = count;
+        return &msg;
     }
+#endif
+
+private:
+    struct FreeList : std::vector<void*> {
+        ~FreeList() {
+            for (void* block : *this) {
+                free(block);
+            }
+        }
+    };
 
-    uv_buf_t buf() {
-        return uv_buf_t{data, size_t(size)};
+    static std::vector<void*>& freeList() {
+        static thread_local FreeList s_freeList;
+        return s_freeList;
+    }
+
+    static SendReq* alloc(const Endpoint& peer, int size) {
+        SendReq* req = nullptr;
+        bool pooled = size <= kPooledSize;
+        std::vector<void*>& pool = freeList();
+        if (pooled && !pool.empty()) {
+            req = (SendReq*)pool.back();
+            pool.pop_back();
+        } else {
+            req = (SendReq*)malloc(sizeof(SendReq) + 
+                                   (pooled ? kPooledSize : size));
+        }
+        req->pooled = pooled;
+        new(&req->peer) Endpoint(peer);
+        new(&req->release) ReleaseCallback();
+        req->queuedNanos = uv_hrtime();
+        req->size = size;
+        return req;
+    }
+};
+
+#ifdef __linux__
+// -----------------------------------------------------------------------------
+// Section: RecvBatch
+// -----------------------------------------------------------------------------
+// recvmmsg() buffers shared by every UdpService of a loop thread, receive
+// callbacks on one thread never overlap.
+struct RecvBatch {
+    static const int kMessages = 16;
+    static const int kDatagramSize = 64 * 1024;
+    static const int kControlSize = 128;
+
+    struct mmsghdr msgs[kMessages];
+    struct iovec iovs[kMessages];
+    struct sockaddr_storage addrs[kMessages];
+    alignas(struct cmsghdr) char control[kMessages][kControlSize];
+    char data[kMessages][kDatagramSize];
+
+    static RecvBatch& current() {
+        static thread_local std::unique_ptr<RecvBatch> s_batch;
+        if (!s_batch) {
+            s_batch.reset(new RecvBatch);
+        }
+        return *s_batch;
+    }
+
+    // Rearms what recvmmsg() overwrites
+    void reset() {
+        for (int i = 0; i < kMessages; i++) {
+            iovs[i].iov_base = data[i];
+            iovs[i].iov_len = kDatagramSize;
+            struct msghdr& hdr = msgs[i].msg_hdr;
+            hdr.msg_name = &addrs[i];
+            hdr.msg_namelen = sizeof(addrs[i]);
+            hdr.msg_iov = &iovs[i];
+            hdr.msg_iovlen = 1;
+            hdr.msg_control = control[i];
+            hdr.msg_controllen = kControlSize;
+            hdr.msg_flags = 0;
+            msgs[i].msg_len = 0;
+        }
+    }
+};
+#endif
+
+// Kernel queue fill of one socket, in bytes
+struct SocketSample {
+    int64_t recvQueue;
+    int64_t recvBuffer;
+    int64_t sendQueue;
+
+    SocketSample() : recvQueue(0), recvBuffer(0), sendQueue(0) { }
+
+    bool read(uv_os_fd_t fd) {
+#ifdef __linux__
+        int value = 0;
+        if (ioctl(fd, SIOCOUTQ, &value) != 0) {
+            return false;
+        }
+        sendQueue = value;
+#ifdef SO_MEMINFO
+        // SIOCINQ only tells the size of the next datagram on a UDP socket,
+        // the memory charged to the receive queue is what runs into SO_RCVBUF
+        uint32_t meminfo[SK_MEMINFO_VARS];
+        socklen_t len = sizeof(meminfo);
+        if (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) == 0) {
+            recvQueue = meminfo[SK_MEMINFO_RMEM_ALLOC];
+            recvBuffer = meminfo[SK_MEMINFO_RCVBUF];
+            return true;
+        }
+#endif
+        if (ioctl(fd, SIOCINQ, &value) != 0) {
+            return false;
+        }
+        recvQueue = value;
+        return true;
+#else
+        (void)fd;
+        return false;
+#endif
     }
 };
 
@@ -38,10 +266,52 @@ class UdpServiceImpl {
     UdpService& m_udpSvc;
     uv_loop_t& m_loop;
     uv_udp_t m_udpHandle;
+    uv_timer_t m_sampleTimer;
+#ifdef __linux__
+    // watches a dup of the socket, so libuv keeps the original to itself
+    // for sending, or the io_uring; m_recvFd is -1 unless the former
+    uv_poll_t m_pollHandle;
+    bool m_polling;
+    int m_recvFd;
+
+    // with Options::ioUring, the ring does all socket I/O: SQEs queued by
+    // an iteration are submitted together right before the loop blocks,
+    // and completions come in through m_pollHandle
+    IoUring* m_ring;
+    uv_prepare_t m_submitPrepare;
+    int m_sockFd;
+    struct msghdr m_recvMsg;            // layout of the multishot recvmsg
+    int m_inflight;                     // SQEs that still post completions
+    bool m_closing;
+#endif
+    int m_openHandles;
     Endpoint m_listenAddr;
+    Endpoint m_localAddr;
+    UdpService::Options m_options;
+    uv_thread_t m_loopThread;           // for sendInPlace()
+    std::atomic<bool> m_loopThreadKnown;
     AsyncHandler m_asyncHandler;
+    // sends from the other loops of |m_group| go through LoopGroup::post(),
+    // whose tasks may still arrive after shutdown; |m_open| tells them,
+    // loop thread only
+    LoopGroup* m_group;
+    int m_loopIndex;
+    std::shared_ptr<bool> m_open;
     ShutdownCallback m_shutdownCallback;
     std::vector<IMessageHandler*> m_msgHandlers;
+    bool m_dispatching;                 // inside handleMessage()
+
+    // kernel drop count carried by the latest SO_RXQ_OVFL message, and
+    // how much of it was logged
+    uint32_t m_kernelDrops;
+    uint32_t m_loggedDrops;
+    SocketSample m_sample;              // contributed to the queue gauges
+
+    // SendReqs not completed yet, bounded by Options::maxPendingSends;
+    // whenWritable() callbacks wait for half of that
+    std::atomic<int> m_pendingSends;
+    int m_sampledPending;               // contributed to PENDING_SENDS
+    std::vector<WritableCallback> m_writableWaiters;
 
 private:
     static void allocRecvBuf(uv_handle_t* handle, 
@@ -56,6 +326,7 @@ private:
                            const uv_buf_t* buf, 
                            const struct sockaddr* addr,
                            unsigned flags) {
+        LoopMonitor::Scope scope(LoopMonitor::kUdpRecv);
         UdpServiceImpl* udpSvc = 
                 CONTAINER_OF(handle, UdpServiceImpl, m_udpHandle);
         if (0 == nread && NULL == addr) {
@@ -64,36 +335,112 @@ private:
         }
         Endpoint peer(addr);
         if ( (flags & UV_UDP_PARTIAL) != 0 ) {
-            LOGE << "partial data received from " << peer.ip() << ":" 
-                 << peer.port();
+            LOGE << "partial data received from " << peer;
         } else if (nread > 0) {
-            udpSvc->handleMessage(peer, buf->base, buf->len);
+            udpSvc->deliver(peer, buf->base, int(nread), uv_hrtime());
         }
         free(buf->base);
     }
 
+#ifdef __linux__
+    static void handleReadable(uv_poll_t* handle, int status, int events) {
+        LoopMonitor::Scope scope(LoopMonitor::kUdpRecv);
+        UdpServiceImpl* udpSvc = 
+                CONTAINER_OF(handle, UdpServiceImpl, m_pollHandle);
+        if (status < 0) {
+            LOGE << "uv_poll: " << uv_strerror(status);
+            return;
+        }
+        udpSvc->drainSocket();
+        (void)events;
+    }
+
+    static void handleUringReadable(uv_poll_t* handle, int status, 
+                                    int events) {
+        LoopMonitor::Scope scope(LoopMonitor::kUdpRecv);
+        UdpServiceImpl* udpSvc = 
+                CONTAINER_OF(handle, UdpServiceImpl, m_pollHandle);
+        if (status < 0) {
+            LOGE << "uv_poll: " << uv_strerror(status);
+            return;
+        }
+        udpSvc->drainUring();
+        (void)events;
+    }
+
+    static void handleSubmitPrepare(uv_prepare_t* handle) {
+        UdpServiceImpl* udpSvc = 
+                CONTAINER_OF(handle, UdpServiceImpl, m_submitPrepare);
+        if (udpSvc->m_ring->pendingSubmissions() > 0) {
+            udpSvc->m_ring->submit();
+        }
+    }
+#endif
+
+    static void handleSampleTimer(uv_timer_t* handle) {
+        LoopMonitor::Scope scope(LoopMonitor::kTimer);
+        UdpServiceImpl* udpSvc = 
+                CONTAINER_OF(handle, UdpServiceImpl, m_sampleTimer);
+        udpSvc->sampleSocket();
+    }
+
     static void handleSend(uv_udp_send_t* req, int status) {
+        LoopMonitor::Scope scope(LoopMonitor::kUdpSendDone);
         SendReq* sendReq = CONTAINER_OF(req, SendReq, handle);
         if (status) {
-            LOGE << "error sending message to " << sendReq->peer.ip() 
-                 << ":" << sendReq->peer.port() << ": " << uv_strerror(status);
+            LOGE << "error sending message to " << sendReq->peer << ": " 
+                 << uv_strerror(status);
+            metrics::add(metrics::Counter::SEND_ERRORS);
+        } else {
+            metrics::record(metrics::Hist::SEND_LATENCY, 
+                            uv_hrtime() - sendReq->queuedNanos);
         }
-        sendReq->destroy();
+        UdpServiceImpl* udpSvc = (UdpServiceImpl*)req->handle->data;
+        udpSvc->finishSend(sendReq);
     }
 
     static void handleClose(uv_handle_t* handle) {
-        UdpServiceImpl* udpSvc = 
-            CONTAINER_OF(handle, UdpServiceImpl, m_udpHandle);
+        UdpServiceImpl* udpSvc = (UdpServiceImpl*)handle->data;
+        if (--udpSvc->m_openHandles > 0) {
+            return;
+        }
+#ifdef __linux__
+        if (udpSvc->m_recvFd >= 0) {
+            ::close(udpSvc->m_recvFd);
+        }
+        delete udpSvc->m_ring;
+#endif
         ShutdownCallback cb(std::move(udpSvc->m_shutdownCallback));
+        metrics::addGauge(metrics::Gauge::MESSAGE_HANDLERS, 
+                          -int64_t(udpSvc->m_msgHandlers.size()));
+        metrics::addGauge(metrics::Gauge::RECV_QUEUE_BYTES,
+                          -udpSvc->m_sample.recvQueue);
+        metrics::addGauge(metrics::Gauge::SEND_QUEUE_BYTES,
+                          -udpSvc->m_sample.sendQueue);
+        metrics::addGauge(metrics::Gauge::PENDING_SENDS,
+                          -udpSvc->m_sampledPending);
         delete udpSvc;
         cb();
     }
 
 public:
     UdpServiceImpl(UdpService& udpSvc, uv_loop_t& loop, 
-                   const Endpoint& listenAddr)
-        : m_udpSvc(udpSvc), m_loop(loop), m_listenAddr(listenAddr)
-        , m_asyncHandler(loop) {
+                   LoopGroup* group, int loopIndex,
+                   const Endpoint& listenAddr, 
+                   const UdpService::Options& options)
+        : m_udpSvc(udpSvc), m_loop(loop)
+#ifdef __linux__
+        , m_polling(false), m_recvFd(-1), m_ring(nullptr), m_sockFd(-1)
+        , m_inflight(0), m_closing(false)
+#endif
+        , m_openHandles(0), m_listenAddr(listenAddr)
+        , m_localAddr(listenAddr), m_options(options)
+        , m_loopThreadKnown(false), m_asyncHandler(loop)
+        , m_group(group), m_loopIndex(loopIndex)
+        , m_open(std::make_shared<bool>(true))
+        , m_dispatching(false)
+        , m_kernelDrops(0), m_loggedDrops(0), m_pendingSends(0)
+        , m_sampledPending(0) {
         m_msgHandlers.reserve(128);
         m_asyncHandler.post([this]() {
             initUdpHandle();
@@ -102,39 +449,108 @@ public:
 
     bool start() {
         return m_asyncHandler.post([this]() {
-            int retval = uv_udp_recv_start(&m_udpHandle, 
-                    allocRecvBuf, handleRecv);
+            int retval = startRecv();
             if (retval != 0) {
-                LOGE << "uv_udp_recv_start: " << uv_strerror(retval);
+                LOGE << "failed to start receiving: " << uv_strerror(retval);
             } else {
-                LOGI << "udp service listening on " << m_listenAddr.ip() 
-                     << ":" << m_listenAddr.port();
+                LOGI << "udp service listening on " << m_listenAddr;
             }
+            uv_timer_start(&m_sampleTimer, handleSampleTimer, 
+                           kSocketSampleMillis, kSocketSampleMillis);
         });
     }
 
-    bool send(const Endpoint& peer, const char* data, int size) {
-        SendReq* req = SendReq::create(peer, data, size);
-        return m_asyncHandler.post([this, req]() {
-            uv_buf_t bufs[1] = { req->buf() };
-            int retval = uv_udp_send(&req->handle, &m_udpHandle, bufs, 1, 
-                                     req->peer, handleSend);
-            if (retval != 0) {
-                LOGE << "uv_udp_send: " << uv_strerror(retval);
+    SendStatus send(const Endpoint& peer, const char* data, int size) {
+        if (!reserveSend()) {
+            return UdpService::kSendWouldBlock;
+        }
+        return post(SendReq::create(peer, data, size));
+    }
+
+    SendStatus send(const Endpoint& peer, const uv_buf_t* bufs, int count,
+                    ReleaseCallback&& release) {
+        if (count <= 0 || count > UdpService::kMaxSendBufs) {
+            LOGE << "cannot send " << count << " pieces to " << peer;
+            return UdpService::kSendFailed;
+        }
+        if (!reserveSend()) {
+            return UdpService::kSendWouldBlock;
+        }
+        return post(SendReq::create(peer, bufs, count, std::move(release)));
+    }
+
+    SendStatus sendInPlace(const Endpoint& peer, const uv_buf_t* bufs, 
+                           int count) {
+        if (count <= 0 || count > UdpService::kMaxSendBufs) {
+            LOGE << "cannot send " << count << " pieces to " << peer;
+            return UdpService::kSendFailed;
+        }
+        if (!onLoopThread()) {
+            if (!reserveSend()) {
+                return UdpService::kSendWouldBlock;
+            }
+            return post(SendReq::create(peer, bufs, count));
+        }
+#ifdef __linux__
+        if (nullptr != m_ring) {
+            // a copy for the ring to read, submitted along with the other
+            // SQEs rather than a sendmsg() syscall per reply
+            if (!reserveSend()) {
+                return UdpService::kSendWouldBlock;
+            }
+            startSend(SendReq::create(peer, bufs, count));
+            return UdpService::kSendQueued;
+        }
+#endif
+        int retval = uv_udp_try_send(&m_udpHandle, bufs, count, peer);
+        if (retval >= 0) {
+            PacketTrace::record(kTraceOut, m_localAddr, peer, bufs, count);
+            metrics::add(metrics::Counter::TX_DATAGRAMS);
+            metrics::add(metrics::Counter::TX_BYTES, uint64_t(retval));
+            return UdpService::kSendQueued;
+        }
+        if (UV_EAGAIN != retval) {
+            LOGE << "error sending message to " << peer << ": " 
+                 << uv_strerror(retval);
+            metrics::add(metrics::Counter::SEND_ERRORS);
+            return UdpService::kSendFailed;
+        }
+        // the socket is backed up, or sends are queued that must go first
+        if (!reserveSend()) {
+            return UdpService::kSendWouldBlock;
+        }
+        startSend(SendReq::create(peer, bufs, count));
+        return UdpService::kSendQueued;
+    }
+
+    bool whenWritable(WritableCallback&& callback) {
+        return m_asyncHandler.post([this, cb(std::move(callback))]() mutable {
+            if (m_pendingSends.load(std::memory_order_relaxed) <= 
+                    lowWaterMark()) {
+                cb();
+            } else {
+                m_writableWaiters.push_back(std::move(cb));
             }
         });
     }
 
     bool shutdown(std::function<void()>&& callback) {
         return m_asyncHandler.post([this, cb(std::move(callback))]() {
-            if (uv_is_active((uv_handle_t*)&m_udpHandle)) {
-                int retval = uv_udp_recv_stop(&m_udpHandle);
-                if (retval != 0) {
-                    LOGW << "uv_udp_recv_stop: " << uv_strerror(retval);
+            *m_open = false;
+            m_shutdownCallback = std::move(cb);
+            uv_timer_stop(&m_sampleTimer);
+#ifdef __linux__
+            if (nullptr != m_ring) {
+                // the ring reads the buffers of in-flight SQEs, the
+                // handles wait for their completions
+                m_closing = true;
+                cancelUringRecv();
+                if (m_inflight > 0) {
+                    return;
                 }
             }
-            uv_close((uv_handle_t*)&m_udpHandle, handleClose);
-            m_shutdownCallback = std::move(cb);
+#endif
+            closeHandles();
         });
     }
 
@@ -158,27 +574,165 @@ public:
             if (std::find(m_msgHandlers.begin(), m_msgHandlers.end(), 
                           handler) == m_msgHandlers.end()) {
                 m_msgHandlers.push_back(handler);
+                metrics::addGauge(metrics::Gauge::MESSAGE_HANDLERS, 1);
             }
         });
     }
 
+    // Takes effect at once on the loop thread, a handler that finished
+    // inside handleMessage() must not see the datagrams that follow
     void removeMessageHandler(IMessageHandler* handler) {
+        if (onLoopThread()) {
+            removeHandlerNow(handler);
+            return;
+        }
         m_asyncHandler.post([this, handler]() {
-            auto it = std::find(m_msgHandlers.begin(), 
-                                m_msgHandlers.end(), handler);
-            if (it != m_msgHandlers.end()) {
-                m_msgHandlers.erase(it);
-            }
+            removeHandlerNow(handler);
         });
     }
 
 private:
+    void removeHandlerNow(IMessageHandler* handler) {
+        auto it = std::find(m_msgHandlers.begin(), m_msgHandlers.end(), 
+                            handler);
+        if (it == m_msgHandlers.end()) {
+            return;
+        }
+        // mid-dispatch the slot is only cleared, handleMessage() compacts
+        if (m_dispatching) {
+            *it = nullptr;
+        } else {
+            m_msgHandlers.erase(it);
+        }
+        metrics::addGauge(metrics::Gauge::MESSAGE_HANDLERS, -1);
+    }
+
+    SendStatus post(SendReq* req) {
+        bool posted;
+        if (viaGroup()) {
+            std::shared_ptr<bool> open(m_open);
+            posted = m_group->post(m_loopIndex, [this, open, req]() {
+                if (*open) {
+                    startSend(req);
+                } else {
+                    req->destroy();
+                }
+            });
+        } else {
+            posted = m_asyncHandler.post([this, req]() {
+                startSend(req);
+            });
+        }
+        if (!posted) {
+            // the caller keeps its buffers
+            req->release = nullptr;
+            req->destroy();
+            m_pendingSends.fetch_sub(1, std::memory_order_relaxed);
+            return UdpService::kSendFailed;
+        }
+        return UdpService::kSendQueued;
+    }
+
+    // Counts a send about to be queued, false at the high-water mark.
+    // Any thread, so the limit may be overshot by concurrent callers.
+    bool reserveSend() {
+        int limit = m_options.maxPendingSends;
+        int pending = m_pendingSends.fetch_add(1, std::memory_order_relaxed);
+        if (limit > 0 && pending >= limit) {
+            m_pendingSends.fetch_sub(1, std::memory_order_relaxed);
+            metrics::add(metrics::Counter::SEND_WOULD_BLOCK);
+            return false;
+        }
+        return true;
+    }
+
+    int lowWaterMark() const {
+        return m_options.maxPendingSends / 2;
+    }
+
+    // Loop thread, once the kernel is done with |req|
+    void finishSend(SendReq* req) {
+        req->destroy();
+        int pending = m_pendingSends.fetch_sub(1, std::memory_order_relaxed);
+        if (!m_writableWaiters.empty() && pending - 1 <= lowWaterMark()) {
+            std::vector<WritableCallback> waiters;
+            waiters.swap(m_writableWaiters);
+            for (WritableCallback& cb : waiters) {
+                cb();
+            }
+        }
+    }
+
+    // From a loop of the group once this one is set up; a thread
+    // keeps to one queue after that, so its sends stay in order
+    bool viaGroup() const {
+        return nullptr != m_group && m_group->currentIndex() >= 0 &&
+                m_loopThreadKnown.load(std::memory_order_acquire);
+    }
+
+    bool onLoopThread() const {
+        uv_thread_t self = uv_thread_self();
+        return m_loopThreadKnown.load(std::memory_order_acquire) && 
+                uv_thread_equal(&self, &m_loopThread);
+    }
+
+    void startSend(SendReq* req) {
+        PacketTrace::record(kTraceOut, m_localAddr, req->peer, 
+                            req->bufs, req->count);
+#ifdef __linux__
+        if (nullptr != m_ring && !m_closing && sendUring(req)) {
+            metrics::add(metrics::Counter::TX_DATAGRAMS);
+            metrics::add(metrics::Counter::TX_BYTES, uint64_t(req->size));
+            return;
+        }
+#endif
+        int retval = uv_udp_send(&req->handle, &m_udpHandle, req->bufs, 
+                                 req->count, req->peer, handleSend);
+        if (retval != 0) {
+            LOGE << "uv_udp_send: " << uv_strerror(retval);
+            metrics::add(metrics::Counter::SEND_ERRORS);
+            finishSend(req);
+            return;
+        }
+        metrics::add(metrics::Counter::TX_DATAGRAMS);
+        metrics::add(metrics::Counter::TX_BYTES, uint64_t(req->size));
+    }
+
+    void closeHandles() {
+#ifdef __linux__
+        if (m_polling) {
+            uv_poll_stop(&m_pollHandle);
+            uv_close((uv_handle_t*)&m_pollHandle, handleClose);
+        }
+        if (nullptr != m_ring) {
+            uv_prepare_stop(&m_submitPrepare);
+            uv_close((uv_handle_t*)&m_submitPrepare, handleClose);
+        }
+#endif
+        if (uv_is_active((uv_handle_t*)&m_udpHandle)) {
+            int retval = uv_udp_recv_stop(&m_udpHandle);
+            if (retval != 0) {
+                LOGW << "uv_udp_recv_stop: " << uv_strerror(retval);
+            }
+        }
+        uv_close((uv_handle_t*)&m_sampleTimer, handleClose);
+        uv_close((uv_handle_t*)&m_udpHandle, handleClose);
+    }
+
     bool initUdpHandle() {
+        m_loopThread = uv_thread_self();
+        m_loopThreadKnown.store(true, std::memory_order_release);
+        uv_timer_init(&m_loop, &m_sampleTimer);
+        uv_unref((uv_handle_t*)&m_sampleTimer);
+        m_sampleTimer.data = this;
+        m_openHandles++;
         int retval = uv_udp_init(&m_loop, &m_udpHandle);
         if (retval != 0) {
             LOGE << "uv_udp_init: " << uv_strerror(retval);
             return false;
         }
+        m_udpHandle.data = this;
+        m_openHandles++;
         LOGD << "bind local addr " << m_listenAddr;
         retval = uv_udp_bind(&m_udpHandle, m_listenAddr, UV_UDP_REUSEADDR);
         if (retval != 0) {
@@ -191,26 +745,437 @@ private:
                                         (struct sockaddr*)&sa, 
                                         &nameLen);
         if (retval == 0) {
-            Endpoint local((const struct sockaddr*)&sa);
-            LOGT << "local ip " << local.ip() << ":" << local.port();
+            m_localAddr.init((const struct sockaddr*)&sa);
+            LOGT << "local ip " << m_localAddr;
         } else {
             LOGE << "uv_udp_getsockname: " << uv_strerror(retval);
         }
+        setBufferSize("receive", uv_recv_buffer_size, 
+                      m_options.recvBufferSize);
+        setBufferSize("send", uv_send_buffer_size, 
+                      m_options.sendBufferSize);
+#ifdef __linux__
+        bindToDevice();
+#endif
         return true;
     }
 
-    void handleMessage(const Endpoint& addr, const char* data, int size) {
-        for (IMessageHandler* handler : m_msgHandlers) {
-            handler->handleMessage(m_udpSvc, addr, data, size);
+#ifdef __linux__
+    // Before Linux 5.7 it takes CAP_NET_RAW, the socket then stays with
+    // the routes
+    void bindToDevice() {
+        const std::string& device = m_options.device;
+        uv_os_fd_t fd;
+        if (device.empty() || 
+                uv_fileno((uv_handle_t*)&m_udpHandle, &fd) != 0) {
+            return;
+        }
+        if (setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, device.c_str(), 
+                       socklen_t(device.size())) != 0) {
+            LOGW << "SO_BINDTODEVICE " << device << " for " << m_localAddr 
+                 << ": " << strerror(errno);
+            return;
+        }
+        LOGD << m_localAddr << " bound to device " << device;
+    }
+#endif
+
+    typedef int (*BufferSizeFunc)(uv_handle_t* handle, int* value);
+
+    void setBufferSize(const char* name, BufferSizeFunc func, int requested) {
+        if (requested <= 0) {
+            return;
+        }
+        int value = requested;
+        int retval = func((uv_handle_t*)&m_udpHandle, &value);
+        if (retval != 0) {
+            LOGE << "setting " << name << " buffer of " << m_localAddr 
+                 << ": " << uv_strerror(retval);
+            return;
+        }
+        value = 0;
+        func((uv_handle_t*)&m_udpHandle, &value);
+#ifdef __linux__
+        // Linux caps the request at net.core.rmem_max/wmem_max, then
+        // doubles it to cover bookkeeping overhead and reports that
+        value /= 2;
+#endif
+        if (value < requested) {
+            LOGW << name << " buffer of " << m_localAddr << " is " << value 
+                 << " bytes, " << requested << " requested, raise the "
+                 << "system limit";
+        } else {
+            LOGI << name << " buffer of " << m_localAddr << " is " << value 
+                 << " bytes";
         }
     }
+
+    int startRecv() {
+#ifdef __linux__
+        uv_os_fd_t fd;
+        if (uv_fileno((uv_handle_t*)&m_udpHandle, &fd) == 0) {
+            int on = 1;
+            if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) != 0) {
+                LOGW << "SO_RXQ_OVFL: " << strerror(errno);
+            }
+            if (m_options.kernelTimestamps && setsockopt(fd, SOL_SOCKET, 
+                    SO_TIMESTAMPNS, &on, sizeof(on)) != 0) {
+                LOGW << "SO_TIMESTAMPNS: " << strerror(errno);
+            }
+            // beyond net.core.busy_read it takes CAP_NET_ADMIN
+            int busyPoll = m_options.busyPollMicros;
+            if (busyPoll > 0 && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, 
+                    &busyPoll, sizeof(busyPoll)) != 0) {
+                LOGW << "SO_BUSY_POLL: " << strerror(errno);
+            }
+            if (m_options.ioUring && startUring(fd)) {
+                return 0;
+            }
+            // a duplicate descriptor gets an epoll registration of its own
+            m_recvFd = dup(fd);
+            if (m_recvFd >= 0) {
+                int retval = uv_poll_init(&m_loop, &m_pollHandle, m_recvFd);
+                if (retval != 0) {
+                    ::close(m_recvFd);
+                    m_recvFd = -1;
+                    return retval;
+                }
+                m_pollHandle.data = this;
+                m_openHandles++;
+                m_polling = true;
+                return uv_poll_start(&m_pollHandle, UV_READABLE, 
+                                     handleReadable);
+            }
+            LOGW << "dup: " << strerror(errno) << ", receiving through libuv";
+        }
+#endif
+        return uv_udp_recv_start(&m_udpHandle, allocRecvBuf, handleRecv);
+    }
+
+#ifdef __linux__
+    void drainSocket() {
+        RecvBatch& batch = RecvBatch::current();
+        // the poll is level-triggered, leave the rest of a flood to the
+        // next iteration rather than starve everything else
+        for (int round = 0; round < kMaxRecvRounds; round++) {
+            batch.reset();
+            int n = recvmmsg(m_recvFd, batch.msgs, RecvBatch::kMessages, 
+                             MSG_DONTWAIT, nullptr);
+            if (n < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    LOGE << "recvmmsg: " << strerror(errno);
+                }
+                return;
+            }
+            uint64_t now = uv_hrtime();
+            uint64_t realNow = realtimeNanos();
+            for (int i = 0; i < n; i++) {
+                struct msghdr& hdr = batch.msgs[i].msg_hdr;
+                uint64_t kernelNanos = readControl(hdr);
+                Endpoint peer((const struct sockaddr*)hdr.msg_name);
+                if ( (hdr.msg_flags & MSG_TRUNC) != 0 ) {
+                    LOGE << "partial data received from " << peer;
+                    continue;
+                }
+                deliver(peer, batch.data[i], int(batch.msgs[i].msg_len), 
+                        toHrtime(kernelNanos, now, realNow));
+            }
+            if (n < RecvBatch::kMessages) {
+                return;
+            }
+        }
+    }
+
+    // -------- io_uring --------
+    bool startUring(int fd) {
+        m_ring = IoUring::create(kUringEntries, kUringBuffers, 
+                                 sizeof(struct io_uring_recvmsg_out) + 
+                                 sizeof(struct sockaddr_storage) + 
+                                 kUringControlSize + RecvBatch::kDatagramSize);
+        if (nullptr == m_ring) {
+            LOGW << "io_uring unavailable, falling back to recvmmsg";
+            return false;
+        }
+        if (!m_ring->supportsMultishotRecv()) {
+            LOGW << "io_uring multishot recvmsg needs Linux 6.0, "
+                 << "falling back to recvmmsg";
+            delete m_ring;
+            m_ring = nullptr;
+            return false;
+        }
+        m_sockFd = fd;
+        memset(&m_recvMsg, 0, sizeof(m_recvMsg));
+        m_recvMsg.msg_namelen = sizeof(struct sockaddr_storage);
+        m_recvMsg.msg_controllen = kUringControlSize;
+        int retval = armUringRecv() ? m_ring->submit() : -ENOMEM;
+        if (retval >= 0) {
+            retval = uv_poll_init(&m_loop, &m_pollHandle, m_ring->fd());
+        }
+        if (retval < 0) {
+            LOGW << "starting io_uring: " << uv_strerror(retval) 
+                 << ", falling back to recvmmsg";
+            delete m_ring;
+            m_ring = nullptr;
+            m_inflight = 0;
+            return false;
+        }
+        m_pollHandle.data = this;
+        m_openHandles++;
+        m_polling = true;
+        uv_poll_start(&m_pollHandle, UV_READABLE, handleUringReadable);
+        uv_prepare_init(&m_loop, &m_submitPrepare);
+        uv_unref((uv_handle_t*)&m_submitPrepare);
+        m_submitPrepare.data = this;
+        m_openHandles++;
+        uv_prepare_start(&m_submitPrepare, handleSubmitPrepare);
+        LOGI << m_localAddr << " does its I/O through io_uring";
+        return true;
+    }
+
+    // One recvmsg that keeps completing, a datagram per provided buffer,
+    // until the buffers run out or it fails
+    bool armUringRecv() {
+        struct io_uring_sqe* sqe = m_ring->getSqe();
+        if (nullptr == sqe) {
+            LOGE << "io_uring submission queue full, receive not armed";
+            return false;
+        }
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = m_sockFd;
+        sqe->addr = (uint64_t)(uintptr_t)&m_recvMsg;
+        // a non-zero length would cap the provided buffers
+        sqe->len = 0;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = IoUring::kBufferGroup;
+        sqe->user_data = kUringRecv;
+        m_inflight++;
+        return true;
+    }
+
+    void cancelUringRecv() {
+        struct io_uring_sqe* sqe = m_ring->getSqe();
+        if (nullptr == sqe) {
+            LOGE << "io_uring submission queue full, receive not cancelled";
+            return;
+        }
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = kUringRecv;
+        sqe->user_data = kUringCancel;
+        m_ring->submit();
+    }
+
+    // Queues |req| for the next submission, false if the ring is full
+    bool sendUring(SendReq* req) {
+        struct io_uring_sqe* sqe = m_ring->getSqe();
+        if (nullptr == sqe) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = m_sockFd;
+        sqe->addr = (uint64_t)(uintptr_t)req->prepareMsg();
+        sqe->len = 1;
+        sqe->user_data = (uint64_t)(uintptr_t)req;
+        m_inflight++;
+        return true;
+    }
+
+    void drainUring() {
+        uint64_t now = uv_hrtime();
+        uint64_t realNow = realtimeNanos();
+        m_ring->drain([this, now, realNow](const struct io_uring_cqe& cqe) {
+            if (kUringRecv == cqe.user_data) {
+                onUringRecv(cqe, now, realNow);
+            } else if (kUringCancel != cqe.user_data) {
+                onUringSend((SendReq*)(uintptr_t)cqe.user_data, cqe.res);
+            }
+        });
+        // the recv may have been re-armed
+        if (m_ring->pendingSubmissions() > 0) {
+            m_ring->submit();
+        }
+        if (m_closing && 0 == m_inflight) {
+            closeHandles();
+        }
+    }
+
+    void onUringRecv(const struct io_uring_cqe& cqe, uint64_t now, 
+                     uint64_t realNow) {
+        if ( (cqe.flags & IORING_CQE_F_BUFFER) != 0 ) {
+            uint16_t id = uint16_t(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            if (cqe.res >= 0) {
+                readUringBuffer(m_ring->buffer(id), size_t(cqe.res), 
+                                now, realNow);
+            }
+            m_ring->recycleBuffer(id);
+        } else if (cqe.res < 0 && -ENOBUFS != cqe.res && 
+                   -ECANCELED != cqe.res) {
+            LOGE << "io_uring recvmsg: " << strerror(-cqe.res);
+        }
+        if ( (cqe.flags & IORING_CQE_F_MORE) == 0 ) {
+            // the multishot ended, typically because every buffer was in
+            // use; the datagrams wait in the socket until it is re-armed
+            m_inflight--;
+            if (!m_closing) {
+                armUringRecv();
+            }
+        }
+    }
+
+    // A provided buffer holds io_uring_recvmsg_out, the peer address and
+    // the control messages at the sizes m_recvMsg asked for, then the data
+    void readUringBuffer(char* buf, size_t len, uint64_t now, 
+                         uint64_t realNow) {
+        const struct io_uring_recvmsg_out* out = 
+                (const struct io_uring_recvmsg_out*)buf;
+        size_t nameOffset = sizeof(*out);
+        size_t controlOffset = nameOffset + m_recvMsg.msg_namelen;
+        size_t dataOffset = controlOffset + m_recvMsg.msg_controllen;
+        if (len < dataOffset) {
+            return;
+        }
+        struct msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_control = buf + controlOffset;
+        hdr.msg_controllen = out->controllen;
+        uint64_t kernelNanos = readControl(hdr);
+        Endpoint peer((const struct sockaddr*)(buf + nameOffset));
+        if ( (out->flags & MSG_TRUNC) != 0 || 
+                out->payloadlen > len - dataOffset ) {
+            LOGE << "partial data received from " << peer;
+            return;
+        }
+        deliver(peer, buf + dataOffset, int(out->payloadlen), 
+                toHrtime(kernelNanos, now, realNow));
+    }
+
+    void onUringSend(SendReq* req, int res) {
+        if (res < 0) {
+            LOGE << "error sending message to " << req->peer << ": " 
+                 << strerror(-res);
+            metrics::add(metrics::Counter::SEND_ERRORS);
+        } else {
+            metrics::record(metrics::Hist::SEND_LATENCY, 
+                            uv_hrtime() - req->queuedNanos);
+        }
+        finishSend(req);
+        m_inflight--;
+    }
+
+    static uint64_t toNanos(const struct timespec& ts) {
+        return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+    }
+
+    static uint64_t realtimeNanos() {
+        struct timespec realtime;
+        clock_gettime(CLOCK_REALTIME, &realtime);
+        return toNanos(realtime);
+    }
+
+    // Kernel timestamps are CLOCK_REALTIME, handlers get their age
+    // subtracted from the uv_hrtime() clock
+    static uint64_t toHrtime(uint64_t kernelNanos, uint64_t now, 
+                             uint64_t realNow) {
+        if (0 != kernelNanos && kernelNanos < realNow && 
+                realNow - kernelNanos < now) {
+            return now - (realNow - kernelNanos);
+        }
+        return now;
+    }
+
+    // Returns the SO_TIMESTAMPNS receive time in realtime ns, 0 if absent
+    uint64_t readControl(struct msghdr& hdr) {
+        uint64_t kernelNanos = 0;
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); nullptr != cmsg;
+                cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+            if (SOL_SOCKET != cmsg->cmsg_level) {
+                continue;
+            }
+            if (SCM_TIMESTAMPNS == cmsg->cmsg_type) {
+                struct timespec ts;
+                memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                kernelNanos = toNanos(ts);
+            } else if (SO_RXQ_OVFL == cmsg->cmsg_type) {
+                // the socket's total, sent along once it is not 0
+                uint32_t drops;
+                memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+                uint32_t delta = drops - m_kernelDrops;
+                if (delta > 0) {
+                    metrics::add(metrics::Counter::KERNEL_DROPS, delta);
+                    m_kernelDrops = drops;
+                }
+            }
+        }
+        return kernelNanos;
+    }
+#endif
+
+    void sampleSocket() {
+        int pending = m_pendingSends.load(std::memory_order_relaxed);
+        metrics::addGauge(metrics::Gauge::PENDING_SENDS, 
+                          pending - m_sampledPending);
+        m_sampledPending = pending;
+        uv_os_fd_t fd;
+        SocketSample sample;
+        if (uv_fileno((uv_handle_t*)&m_udpHandle, &fd) != 0 || 
+                !sample.read(fd)) {
+            return;
+        }
+        metrics::addGauge(metrics::Gauge::RECV_QUEUE_BYTES, 
+                          sample.recvQueue - m_sample.recvQueue);
+        metrics::addGauge(metrics::Gauge::SEND_QUEUE_BYTES, 
+                          sample.sendQueue - m_sample.sendQueue);
+        m_sample = sample;
+        if (m_kernelDrops != m_loggedDrops) {
+            LOGW << "kernel dropped " << uint32_t(m_kernelDrops - m_loggedDrops)
+                 << " datagram(s) for " << m_localAddr << ", receive queue "
+                 << sample.recvQueue << " of " << sample.recvBuffer 
+                 << " bytes";
+            m_loggedDrops = m_kernelDrops;
+        }
+    }
+
+    void deliver(const Endpoint& peer, const char* data, int size, 
+                 uint64_t recvNanos) {
+        PacketTrace::record(kTraceIn, m_localAddr, peer, data, size);
+        PacketCapture::record(m_localAddr, peer, data, size);
+        metrics::add(metrics::Counter::RX_DATAGRAMS);
+        metrics::add(metrics::Counter::RX_BYTES, uint64_t(size));
+        BusyPoll::noteReceive();
+        handleMessage(peer, data, size, recvNanos);
+    }
+
+    void handleMessage(const Endpoint& addr, const char* data, int size,
+                       uint64_t recvNanos) {
+        m_dispatching = true;
+        for (size_t i = 0; i < m_msgHandlers.size(); i++) {
+            if (m_msgHandlers[i]) {
+                m_msgHandlers[i]->handleMessage(m_udpSvc, addr, data, size, 
+                                                recvNanos);
+            }
+        }
+        m_dispatching = false;
+        m_msgHandlers.erase(std::remove(m_msgHandlers.begin(), 
+                                        m_msgHandlers.end(), nullptr), 
+                            m_msgHandlers.end());
+    }
 };
 
 // -----------------------------------------------------------------------------
 // Section: UdpService
 // -----------------------------------------------------------------------------
-UdpService::UdpService(uv_loop_t& loop, const Endpoint& listenAddr) 
-    : m_pImpl(new UdpServiceImpl(*this, loop, listenAddr))
+UdpService::UdpService(uv_loop_t& loop, const Endpoint& listenAddr,
+                       const Options& options) 
+    : m_pImpl(new UdpServiceImpl(*this, loop, nullptr, -1, listenAddr, 
+                                 options))
+    , m_impl(*m_pImpl) {
+}
+
+UdpService::UdpService(LoopGroup& group, int loopIndex, 
+                       const Endpoint& listenAddr, const Options& options) 
+    : m_pImpl(new UdpServiceImpl(*this, group.loop(loopIndex), &group, 
+                                 loopIndex, listenAddr, options))
     , m_impl(*m_pImpl) {
 }
 
@@ -226,6 +1191,7 @@ bool UdpService::start() {
     return m_impl.start();
 }
 
+
 bool UdpService::shutdown(ShutdownCallback&& callback) {
     bool retval = m_impl.shutdown(std::move(callback));
     if (retval) {
@@ -242,10 +1208,27 @@ bool UdpService::shutdown() {
     return retval;
 }
 
-bool UdpService::send(const Endpoint& peer, const char* data, int size) {
+UdpService::SendStatus UdpService::send(const Endpoint& peer, 
+                                        const char* data, int size) {
     return m_impl.send(peer, data, size);
 }
 
+UdpService::SendStatus UdpService::send(const Endpoint& peer, 
+                                        const uv_buf_t* bufs, int count,
+                                        ReleaseCallback&& release) {
+    return m_impl.send(peer, bufs, count, std::move(release));
+}
+
+UdpService::SendStatus UdpService::sendInPlace(const Endpoint& peer, 
+                                               const uv_buf_t* bufs, 
+                                               int count) {
+    return m_impl.sendInPlace(peer, bufs, count);
+}
+
+bool UdpService::whenWritable(WritableCallback&& callback) {
+    return m_impl.whenWritable(std::move(callback));
+}
+
 void UdpService::addMessageHandler(IMessageHandler* handler) {
     m_impl.addMessageHandler(handler);
 }
@@ -2,13 +2,45 @@
 
 #include "uv.h"
 #include <functional>
+#include <string>
+#include <stdint.h>
 
 class UdpServiceImpl;
 class Endpoint;
+class LoopGroup;
 
 class UdpService {
 public:
-    UdpService(uv_loop_t& loop, const Endpoint& listenAddr);
+    // Socket options applied once the service is bound, 0 keeps the
+    // system default
+    struct Options {
+        int recvBufferSize;     // SO_RCVBUF in bytes
+        int sendBufferSize;     // SO_SNDBUF in bytes
+        bool kernelTimestamps;  // SO_TIMESTAMPNS receive times
+        // multishot recvmsg and batched sendmsg through io_uring, where
+        // the kernel has them (Linux 6.0+); recvmmsg otherwise
+        bool ioUring;
+        int busyPollMicros;     // SO_BUSY_POLL, Linux only
+        // sends queued and not completed before send() says
+        // kSendWouldBlock, 0 for no limit
+        int maxPendingSends;
+        // SO_BINDTODEVICE, so datagrams leave through this interface
+        // whatever the routes say, Linux only
+        std::string device;
+
+        Options() 
+            : recvBufferSize(0), sendBufferSize(0), kernelTimestamps(false)
+            , ioUring(false), busyPollMicros(0), maxPendingSends(0) {
+        }
+    };
+
+    UdpService(uv_loop_t& loop, const Endpoint& listenAddr, 
+               const Options& options = Options());
+
+    // On loop |loopIndex| of |group|: sends from its other loops come in
+    // through their lock-free mailboxes rather than a locked queue
+    UdpService(LoopGroup& group, int loopIndex, const Endpoint& listenAddr,
+               const Options& options = Options());
     ~UdpService();
 
     bool start();
@@ -18,12 +50,50 @@ public:
     bool shutdown(ShutdownCallback&& callback);
     bool shutdown();
 
-    bool send(const Endpoint& peer, const char* data, int size);
+    enum SendStatus {
+        kSendQueued,        // on its way, or sent already
+        kSendWouldBlock,    // Options::maxPendingSends reached, not queued
+        kSendFailed
+    };
+
+    // Copies |data|; any thread
+    SendStatus send(const Endpoint& peer, const char* data, int size);
+
+    // Called on the loop thread once the kernel is done with the buffers
+    // of a zero-copy send, whether or not the datagram went out
+    typedef std::function<void()> ReleaseCallback;
+
+    static const int kMaxSendBufs = 8;
+
+    // Sends the concatenation of |bufs| without copying it: their memory
+    // must stay valid until |release| runs, which may be empty; the array
+    // itself is copied. Unless kSendQueued is returned, |release| is not
+    // called. Any thread.
+    SendStatus send(const Endpoint& peer, const uv_buf_t* bufs, int count,
+                    ReleaseCallback&& release);
+
+    // For replies from IMessageHandler::handleMessage(): on the loop
+    // thread the kernel takes |bufs| before this returns, so they may live
+    // on the stack or point into the datagram being handled. Copies when
+    // the socket would block, when called from another thread, and with
+    // io_uring, where the copy joins the next batch of SQEs.
+    SendStatus sendInPlace(const Endpoint& peer, const uv_buf_t* bufs, 
+                           int count);
+
+    typedef std::function<void()> WritableCallback;
+
+    // Runs |callback| once on the loop thread when the pending sends are
+    // down to half of Options::maxPendingSends, right away if they are.
+    // Lets a sender that got kSendWouldBlock defer work until then.
+    bool whenWritable(WritableCallback&& callback);
 
     struct IMessageHandler {
         virtual ~IMessageHandler() { }
+        // |recvNanos| is on the uv_hrtime() clock: when the kernel queued
+        // the datagram if Options::kernelTimestamps is supported here,
+        // when it was dispatched otherwise
         virtual void handleMessage(UdpService& udpSvc, const Endpoint& peer, 
-                const char* data, int size) = 0;
+                const char* data, int size, uint64_t recvNanos) = 0;
     };
     void addMessageHandler(IMessageHandler* handler);
     void removeMessageHandler(IMessageHandler* handler);
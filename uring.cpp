@@ -0,0 +1,272 @@
+#include "uring.h"
+#include "log.h"
+#include <algorithm>
+#include <memory>
+#include <string.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int sysSetup(unsigned entries, struct io_uring_params* params) {
+    return int(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int sysEnter(int fd, unsigned toSubmit, unsigned minComplete,
+                    unsigned flags) {
+    return int(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags,
+                       nullptr, 0));
+}
+
+static int sysRegister(int fd, unsigned opcode, void* arg, unsigned count) {
+    return int(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+}
+
+// -----------------------------------------------------------------------------
+// Section: IoUring
+// -----------------------------------------------------------------------------
+// static
+IoUring* IoUring::create(unsigned entries, unsigned bufferCount,
+                         unsigned bufferSize) {
+    IoUring* ring = new IoUring;
+    if (!ring->init(entries, bufferCount, bufferSize)) {
+        delete ring;
+        return nullptr;
+    }
+    return ring;
+}
+
+IoUring::IoUring()
+    : m_fd(-1), m_multishotRecv(false), m_sqRing(MAP_FAILED), m_sqRingSize(0), m_cqRing(MAP_FAILED)
+    , m_cqRingSize(0), m_sqes((struct io_uring_sqe*)MAP_FAILED)
+    , m_sqesSize(0), m_sqHead(nullptr), m_sqTail(nullptr)
+    , m_sqFlags(nullptr), m_sqMask(0), m_sqEntries(0), m_sqTailLocal(0)
+    , m_sqSubmitted(0), m_cqHead(nullptr), m_cqTail(nullptr), m_cqMask(0)
+    , m_cqes(nullptr), m_bufRing((struct io_uring_buf_ring*)MAP_FAILED)
+    , m_bufRingSize(0), m_buffers(nullptr), m_bufferCount(0)
+    , m_bufferSize(0) {
+}
+
+IoUring::~IoUring() {
+    if (MAP_FAILED != (void*)m_bufRing) {
+        munmap(m_bufRing, m_bufRingSize);
+    }
+    free(m_buffers);
+    if (MAP_FAILED != (void*)m_sqes) {
+        munmap(m_sqes, m_sqesSize);
+    }
+    if (MAP_FAILED != m_cqRing && m_cqRing != m_sqRing) {
+        munmap(m_cqRing, m_cqRingSize);
+    }
+    if (MAP_FAILED != m_sqRing) {
+        munmap(m_sqRing, m_sqRingSize);
+    }
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+bool IoUring::init(unsigned entries, unsigned bufferCount,
+                   unsigned bufferSize) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // a multishot recv posts many completions per submission
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+    m_fd = sysSetup(entries, &params);
+    if (m_fd < 0) {
+        LOGW << "io_uring_setup: " << strerror(errno);
+        return false;
+    }
+    if ( (params.features & IORING_FEAT_NODROP) == 0 ) {
+        LOGW << "io_uring lacks IORING_FEAT_NODROP, kernel too old";
+        return false;
+    }
+    if (!probe()) {
+        return false;
+    }
+
+    m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cqRingSize = params.cq_off.cqes +
+            params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+    }
+    m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == m_sqRing) {
+        LOGE << "mmap io_uring sq: " << strerror(errno);
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        m_cqRing = m_sqRing;
+    } else {
+        m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        if (MAP_FAILED == m_cqRing) {
+            LOGE << "mmap io_uring cq: " << strerror(errno);
+            return false;
+        }
+    }
+    m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    m_sqes = (struct io_uring_sqe*)mmap(nullptr, m_sqesSize,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd,
+            IORING_OFF_SQES);
+    if (MAP_FAILED == (void*)m_sqes) {
+        LOGE << "mmap io_uring sqes: " << strerror(errno);
+        return false;
+    }
+
+    char* sq = (char*)m_sqRing;
+    m_sqHead = (unsigned*)(sq + params.sq_off.head);
+    m_sqTail = (unsigned*)(sq + params.sq_off.tail);
+    m_sqFlags = (unsigned*)(sq + params.sq_off.flags);
+    m_sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    m_sqEntries = params.sq_entries;
+    m_sqTailLocal = m_sqSubmitted = *m_sqTail;
+    // SQE i always sits in slot i
+    unsigned* array = (unsigned*)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < m_sqEntries; i++) {
+        array[i] = i;
+    }
+
+    char* cq = (char*)m_cqRing;
+    m_cqHead = (unsigned*)(cq + params.cq_off.head);
+    m_cqTail = (unsigned*)(cq + params.cq_off.tail);
+    m_cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    m_cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // provided buffers, handed to the kernel through a shared ring
+    m_bufferCount = bufferCount;
+    m_bufferSize = bufferSize;
+    m_bufRingSize = bufferCount * sizeof(struct io_uring_buf);
+    m_bufRing = (struct io_uring_buf_ring*)mmap(nullptr, m_bufRingSize,
+            PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (MAP_FAILED == (void*)m_bufRing) {
+        LOGE << "mmap buffer ring: " << strerror(errno);
+        return false;
+    }
+    m_buffers = (char*)malloc(size_t(bufferCount) * bufferSize);
+    if (nullptr == m_buffers) {
+        return false;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)m_bufRing;
+    reg.ring_entries = bufferCount;
+    reg.bgid = kBufferGroup;
+    if (sysRegister(m_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        LOGW << "io_uring provided buffer ring: " << strerror(errno);
+        return false;
+    }
+    m_bufRing->tail = 0;
+    for (unsigned i = 0; i < bufferCount; i++) {
+        recycleBuffer(uint16_t(i));
+    }
+    return true;
+}
+
+// Asks the kernel which opcodes it has
+bool IoUring::probe() {
+    size_t size = sizeof(struct io_uring_probe) + 
+                  IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    std::unique_ptr<char[]> buf(new char[size]());
+    struct io_uring_probe* probe = (struct io_uring_probe*)buf.get();
+    if (sysRegister(m_fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) != 0) {
+        LOGW << "io_uring probe: " << strerror(errno);
+        return false;
+    }
+    auto supported = [probe](int op) {
+        return op < probe->ops_len && 
+               (probe->ops[op].flags & IO_URING_OP_SUPPORTED) != 0;
+    };
+    if (!supported(IORING_OP_RECVMSG) || !supported(IORING_OP_SENDMSG)) {
+        LOGW << "io_uring lacks recvmsg or sendmsg";
+        return false;
+    }
+    m_multishotRecv = supported(IORING_OP_SEND_ZC);
+    return true;
+}
+
+struct io_uring_sqe* IoUring::getSqe() {
+    unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+    if (m_sqTailLocal - head >= m_sqEntries) {
+        submit();
+        head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+        if (m_sqTailLocal - head >= m_sqEntries) {
+            return nullptr;
+        }
+    }
+    struct io_uring_sqe* sqe = &m_sqes[m_sqTailLocal & m_sqMask];
+    m_sqTailLocal += 1;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int IoUring::submit() {
+    unsigned toSubmit = m_sqTailLocal - m_sqSubmitted;
+    if (0 == toSubmit) {
+        return 0;
+    }
+    __atomic_store_n(m_sqTail, m_sqTailLocal, __ATOMIC_RELEASE);
+    int retval = sysEnter(m_fd, toSubmit, 0, 0);
+    if (retval < 0) {
+        int err = errno;
+        if (EAGAIN != err && EBUSY != err && EINTR != err) {
+            LOGE << "io_uring_enter: " << strerror(err);
+        }
+        return -err;
+    }
+    m_sqSubmitted += unsigned(retval);
+    return retval;
+}
+
+void IoUring::recycleBuffer(uint16_t id) {
+    unsigned short tail = m_bufRing->tail;
+    // not m_bufRing->bufs: its empty struct header takes a byte in C++,
+    // moving the array off the kernel's layout
+    struct io_uring_buf* buf = (struct io_uring_buf*)m_bufRing + 
+            (tail & (m_bufferCount - 1));
+    buf->addr = (uint64_t)(uintptr_t)buffer(id);
+    buf->len = m_bufferSize;
+    buf->bid = id;
+    __atomic_store_n(&m_bufRing->tail, (unsigned short)(tail + 1),
+                     __ATOMIC_RELEASE);
+}
+
+void IoUring::flushOverflow() {
+    // completions the CQ had no room for wait in the kernel until asked for
+    if (__atomic_load_n(m_sqFlags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) {
+        sysEnter(m_fd, 0, 0, IORING_ENTER_GETEVENTS);
+    }
+}
+
+#else
+
+// static
+IoUring* IoUring::create(unsigned entries, unsigned bufferCount,
+                         unsigned bufferSize) {
+    (void)entries;
+    (void)bufferCount;
+    (void)bufferSize;
+    return nullptr;
+}
+
+IoUring::~IoUring() {
+}
+
+struct io_uring_sqe* IoUring::getSqe() {
+    return nullptr;
+}
+
+int IoUring::submit() {
+    return -ENOSYS;
+}
+
+void IoUring::recycleBuffer(uint16_t id) {
+    (void)id;
+}
+
+#endif
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "util.h"
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#else
+struct io_uring_sqe;
+struct io_uring_cqe;
+#endif
+
+// -----------------------------------------------------------------------------
+// Section: IoUring
+// -----------------------------------------------------------------------------
+// A minimal io_uring driven by raw syscalls, so there is no liburing
+// dependency: the submission and completion rings mapped from the kernel
+// plus one ring of provided buffers. Not thread-safe, it belongs to the
+// loop thread that polls fd() for completions.
+class IoUring {
+public:
+    // nullptr if the kernel lacks io_uring or provided buffer rings;
+    // |bufferCount| must be a power of two
+    static IoUring* create(unsigned entries, unsigned bufferCount,
+                           unsigned bufferSize);
+
+    // Multishot recvmsg arrived in Linux 6.0. Op flags cannot be probed
+    // for, IORING_OP_SEND_ZC of the same release stands in for it.
+    bool supportsMultishotRecv() const {
+        return m_multishotRecv;
+    }
+
+    ~IoUring();
+
+    int fd() const {
+        return m_fd;
+    }
+
+    // A zeroed SQE, submitting first if the ring is full; nullptr if it
+    // stays full
+    struct io_uring_sqe* getSqe();
+
+    // Hands the queued SQEs to the kernel, returns how many or -errno
+    int submit();
+
+    unsigned pendingSubmissions() const {
+        return m_sqTailLocal - m_sqSubmitted;
+    }
+
+#ifdef __linux__
+    // Calls |fn(cqe)| for every completion posted so far
+    template <typename Fn>
+    unsigned drain(Fn fn) {
+        unsigned count = 0;
+        flushOverflow();
+        unsigned head = *m_cqHead;
+        unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++, count++) {
+            fn(m_cqes[head & m_cqMask]);
+        }
+        __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+        return count;
+    }
+#endif
+
+    // The buffer group recvs select from with IOSQE_BUFFER_SELECT
+    static const uint16_t kBufferGroup = 0;
+
+    char* buffer(uint16_t id) const {
+        return m_buffers + size_t(id) * m_bufferSize;
+    }
+
+    unsigned bufferSize() const {
+        return m_bufferSize;
+    }
+
+    // Gives buffer |id| back to the kernel once its data is consumed
+    void recycleBuffer(uint16_t id);
+
+private:
+    IoUring();
+
+    bool init(unsigned entries, unsigned bufferCount, unsigned bufferSize);
+    bool probe();
+    void flushOverflow();
+
+    int m_fd;
+    bool m_multishotRecv;
+
+    void* m_sqRing;
+    size_t m_sqRingSize;
+    void* m_cqRing;
+    size_t m_cqRingSize;
+    struct io_uring_sqe* m_sqes;
+    size_t m_sqesSize;
+
+    unsigned* m_sqHead;
+    unsigned* m_sqTail;
+    unsigned* m_sqFlags;
+    unsigned m_sqMask;
+    unsigned m_sqEntries;
+    unsigned m_sqTailLocal;             // next SQE handed out
+    unsigned m_sqSubmitted;             // SQEs the kernel consumed
+
+    unsigned* m_cqHead;
+    unsigned* m_cqTail;
+    unsigned m_cqMask;
+    struct io_uring_cqe* m_cqes;
+
+    // provided buffers
+    struct io_uring_buf_ring* m_bufRing;
+    size_t m_bufRingSize;
+    char* m_buffers;
+    unsigned m_bufferCount;
+    unsigned m_bufferSize;
+
+    DISALLOW_COPY_MOVE_AND_ASSIGN(IoUring);
+};
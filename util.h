@@ -29,6 +29,7 @@ private:                                                                      \
 
 #ifdef _WIN32
 #define bzero(BUF, SIZE) memset( (BUF), 0, (SIZE) )
+#define strcasecmp _stricmp
 #endif
 
 struct IpPort {